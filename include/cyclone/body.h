@@ -195,6 +195,13 @@ namespace cyclone {
          */
         Matrix4 transformMatrix;
 
+        /**
+         * Holds the number of times the transform matrix has been
+         * calculated. Collision primitives use it to tell if the body
+         * has moved since they last worked out their own transform.
+         */
+        unsigned transformVersion;
+
         /*@}*/
 
 
@@ -247,6 +254,15 @@ namespace cyclone {
          */
         /*@{*/
 
+        /**
+         * Creates a new rigid body. Its state is not set.
+         */
+        RigidBody()
+        :
+        transformVersion(0)
+        {
+        }
+
         /*@}*/
 
 
@@ -656,6 +672,17 @@ namespace cyclone {
          */
         Matrix4 getTransform() const;
 
+        /**
+         * Returns a number that changes each time the transform
+         * matrix is calculated, which is when calculateDerivedData
+         * is called, including by integrate. A sleeping body's
+         * number doesn't change.
+         */
+        unsigned getTransformVersion() const
+        {
+            return transformVersion;
+        }
+
         /**
          * Converts the given point from world space into the body's
          * local space.
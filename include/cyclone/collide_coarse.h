@@ -16,16 +16,69 @@
  * This file contains the coarse collision detection system.  It is
  * used to return pairs of objects that may be in contact, which can
  * then be tested using fined grained methods.
+ *
+ * The pair cache and the worker pool use the C++11 standard library
+ * (unordered_map, thread, mutex and atomic), so this file, and the
+ * rest of Cyclone that includes it, needs a C++11 compiler.
  */
 #ifndef CYCLONE_COLLISION_COARSE_H
 #define CYCLONE_COLLISION_COARSE_H
 
 #include <vector>
 #include <cstddef>
+#include <unordered_map>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
 #include "contacts.h"
 
 namespace cyclone {
 
+    class RayBatch;
+    struct RayHit;
+    class CollisionPrimitive;
+
+    /**
+     * Represents an axis aligned bounding box that can be tested for
+     * overlap. It is used as a query region for the bounding volume
+     * hierarchy.
+     */
+    struct BoundingBox
+    {
+        Vector3 centre;
+        Vector3 halfSize;
+
+    public:
+        /**
+         * Creates a new bounding box at the given centre with the
+         * given half-sizes.
+         */
+        BoundingBox(const Vector3 &centre, const Vector3 &halfSize);
+
+        /**
+         * Checks if the bounding box overlaps with the other given
+         * bounding box.
+         */
+        bool overlaps(const BoundingBox *other) const;
+
+        /**
+         * Checks if the bounding box is within the given margin of
+         * the other given bounding box.
+         */
+        bool overlaps(const BoundingBox *other, real margin) const;
+
+        /**
+         * Finds which of the given rays reach the bounding box nearer
+         * than their current hit, writing their indices to the passed
+         * array and returning how many there are. Rays that start
+         * inside the box always pass.
+         */
+        unsigned clipRays(const RayBatch &rays,
+                          const unsigned *indices, unsigned count,
+                          const RayHit *hits, unsigned *passed) const;
+    };
+
     /**
      * Represents a bounding sphere that can be tested for overlap.
      */
@@ -52,6 +105,22 @@ namespace cyclone {
          */
         bool overlaps(const BoundingSphere *other) const;
 
+        /**
+         * Checks if the bounding sphere overlaps with the given
+         * bounding box.
+         */
+        bool overlaps(const BoundingBox *other) const;
+
+        /**
+         * Finds which of the given rays reach the bounding sphere
+         * nearer than their current hit, writing their indices to the
+         * passed array and returning how many there are. Rays that
+         * start inside the sphere always pass.
+         */
+        unsigned clipRays(const RayBatch &rays,
+                          const unsigned *indices, unsigned count,
+                          const RayHit *hits, unsigned *passed) const;
+
         /**
          * Reports how much this bounding sphere would have to grow
          * by to incorporate the given bounding sphere. Note that this
@@ -84,6 +153,408 @@ namespace cyclone {
         RigidBody* body[2];
     };
 
+    /**
+     * Decides which pairs of bodies the bounding volume hierarchy
+     * reports as potential contacts. The hierarchy asks the filter
+     * about each pair of leaves whose volumes overlap, before the
+     * pair is written, so pairs that can never collide, such as
+     * bodies joined together or bodies in groups that ignore each
+     * other, never reach the fine grained tests.
+     */
+    class PairFilter
+    {
+    public:
+        /**
+         * Returns true if the given pair of bodies should be
+         * reported. It may be called from several threads at once
+         * during a parallel traversal, so it should not change
+         * anything.
+         */
+        virtual bool allowPair(RigidBody *one, RigidBody *two) const = 0;
+    };
+
+    /**
+     * Stores a potential contact that has persisted over a number of
+     * frames, in the PairManager.
+     */
+    struct PersistentPair
+    {
+        /**
+         * Holds the bodies that might be in contact. The body with
+         * the lower address is always first, whatever order the pair
+         * was reported in.
+         */
+        RigidBody* body[2];
+
+        /**
+         * Holds data for the narrow phase to keep with the pair while
+         * it persists, such as a cached separating axis. It is NULL
+         * when the pair is added, and the pair manager never touches
+         * it: whoever sets it should free it when the pair is removed.
+         */
+        void *userData;
+
+        /**
+         * Holds the frame in which the pair was last reported.
+         */
+        unsigned lastFrame;
+    };
+
+    /**
+     * Keeps track of the potential contacts found by the coarse
+     * collision detector from frame to frame.
+     *
+     * Each frame the new list of potential contacts is passed to
+     * update. Pairs that weren't there last frame are reported as
+     * added, and pairs that are no longer there are reported as
+     * removed. Pairs that persist keep their user data, so work done
+     * on a pair can be carried over to the next frame.
+     */
+    class PairManager
+    {
+    protected:
+        typedef std::pair<RigidBody*, RigidBody*> PairKey;
+
+        /**
+         * Hashes a pair of body addresses.
+         */
+        struct PairKeyHash
+        {
+            size_t operator()(const PairKey &key) const;
+        };
+
+        typedef std::unordered_map<PairKey, unsigned, PairKeyHash> PairIndex;
+
+        /**
+         * Holds the current pairs.
+         */
+        std::vector<PersistentPair> pairs;
+
+        /**
+         * Maps each current pair to its position in the pairs list.
+         */
+        PairIndex index;
+
+        /**
+         * Holds the pairs added in the last update.
+         */
+        std::vector<PersistentPair> added;
+
+        /**
+         * Holds the pairs removed in the last update.
+         */
+        std::vector<PersistentPair> removed;
+
+        /**
+         * Holds the number of updates so far.
+         */
+        unsigned frame;
+
+        /**
+         * Creates the key for the given bodies, in address order.
+         */
+        static PairKey makeKey(RigidBody *one, RigidBody *two);
+
+    public:
+        /**
+         * Creates a new pair manager with no pairs.
+         */
+        PairManager();
+
+        /**
+         * Updates the pairs with this frame's potential contacts,
+         * filling the lists of added and removed pairs.
+         */
+        void update(const PotentialContact *contacts, unsigned count);
+
+        /**
+         * Returns the persistent pair for the given bodies, in either
+         * order, or NULL if they are not a current pair.
+         */
+        PersistentPair* findPair(RigidBody *one, RigidBody *two);
+
+        /**
+         * Returns the number of current pairs.
+         */
+        unsigned getPairCount() const
+        {
+            return (unsigned)pairs.size();
+        }
+
+        /**
+         * Returns the current pairs.
+         */
+        const std::vector<PersistentPair>& getPairs() const
+        {
+            return pairs;
+        }
+
+        /**
+         * Returns the pairs that were added in the last update, in
+         * the order they were reported.
+         */
+        const std::vector<PersistentPair>& getAddedPairs() const
+        {
+            return added;
+        }
+
+        /**
+         * Returns the pairs that were removed in the last update,
+         * along with their user data. Note that the bodies in a
+         * removed pair may have been deleted since they last
+         * overlapped.
+         */
+        const std::vector<PersistentPair>& getRemovedPairs() const
+        {
+            return removed;
+        }
+
+        /**
+         * Removes all the pairs, without reporting them as removed.
+         */
+        void clear();
+    };
+
+    /**
+     * Records a body found by a region query on a bounding volume
+     * hierarchy, along with the region it was found in.
+     */
+    struct RegionQueryResult
+    {
+        /**
+         * Holds the body whose bounding volume overlaps the region.
+         */
+        RigidBody* body;
+
+        /**
+         * Holds the index of the region in the list of regions
+         * passed to the query.
+         */
+        unsigned region;
+    };
+
+    /**
+     * The number of rays the batched ray casts work on at once. Each
+     * chunk is gathered into local arrays and checked in a single
+     * loop with no branches, which the compiler can turn into SIMD
+     * instructions.
+     */
+    static const unsigned RAY_BATCH_LANES = 16;
+
+    /**
+     * Holds a set of rays for the batched ray casts, with each
+     * property in its own array (structure of arrays form), so the
+     * casts can work on several rays at once with SIMD instructions.
+     */
+    class RayBatch
+    {
+    public:
+        /** Holds the coordinates of the ray origins. */
+        std::vector<real> originX;
+        std::vector<real> originY;
+        std::vector<real> originZ;
+
+        /** Holds the ray directions, which are unit length. */
+        std::vector<real> directionX;
+        std::vector<real> directionY;
+        std::vector<real> directionZ;
+
+        /**
+         * Holds the reciprocals of the direction components, for the
+         * slab tests against boxes.
+         */
+        std::vector<real> inverseX;
+        std::vector<real> inverseY;
+        std::vector<real> inverseZ;
+
+        /** Holds how far each ray reaches from its origin. */
+        std::vector<real> length;
+
+        /**
+         * Removes all the rays, keeping the memory for reuse.
+         */
+        void clear();
+
+        /**
+         * Adds a ray from the given origin in the given direction,
+         * which needn't be normalised, returning its index. The ray
+         * ignores anything further than the given length.
+         */
+        unsigned add(const Vector3 &origin, const Vector3 &direction,
+                     real length = REAL_MAX);
+
+        /**
+         * Sets each of the given hits to a miss at the full length of
+         * its ray, ready for a cast. There should be one hit for each
+         * ray.
+         */
+        void resetHits(RayHit *hits) const;
+
+        /**
+         * Returns the origin of the given ray.
+         */
+        Vector3 getOrigin(unsigned ray) const
+        {
+            return Vector3(originX[ray], originY[ray], originZ[ray]);
+        }
+
+        /**
+         * Returns the direction of the given ray.
+         */
+        Vector3 getDirection(unsigned ray) const
+        {
+            return Vector3(directionX[ray], directionY[ray], directionZ[ray]);
+        }
+
+        /**
+         * Returns the number of rays in the batch.
+         */
+        unsigned size() const
+        {
+            return (unsigned)originX.size();
+        }
+    };
+
+    /**
+     * Holds the closest thing hit by a ray in a batched ray cast.
+     */
+    struct RayHit
+    {
+        /**
+         * Is set if the ray hit anything.
+         */
+        bool hit;
+
+        /**
+         * Holds the distance along the ray to the hit, or the length
+         * of the ray if it hasn't hit anything.
+         */
+        real distance;
+
+        /**
+         * Holds the point hit.
+         */
+        Vector3 point;
+
+        /**
+         * Holds the surface normal at the point hit.
+         */
+        Vector3 normal;
+
+        /**
+         * Holds the primitive hit, or NULL if the ray hit static
+         * geometry such as a plane.
+         */
+        const CollisionPrimitive *primitive;
+    };
+
+    /**
+     * Keeps a set of threads waiting to share out work, so that the
+     * parallel parts of collision detection don't have to start new
+     * threads every frame.
+     *
+     * The calling thread always does its share of the work, so a
+     * pool with one thread has no threads of its own. Only one call
+     * to run should be made at a time.
+     */
+    class WorkerPool
+    {
+    public:
+        /**
+         * The type of function the pool runs. It is given the job
+         * passed to run and the index of the thread running it, with
+         * the calling thread being zero.
+         */
+        typedef void (*Function)(void *job, unsigned worker);
+
+    protected:
+        /**
+         * Holds the threads owned by the pool.
+         */
+        std::vector<std::thread> workers;
+
+        /**
+         * Guards the state below, and wakes the threads when there is
+         * work or the pool is shutting down, and the caller when the
+         * work is done.
+         */
+        std::mutex mutex;
+        std::condition_variable wake;
+        std::condition_variable done;
+
+        /**
+         * Holds the function and job of the current run.
+         */
+        Function function;
+        void *job;
+
+        /**
+         * Holds the number of the pool's threads taking part in the
+         * current run, and the number still running.
+         */
+        unsigned active;
+        unsigned pending;
+
+        /**
+         * Counts the calls to run, so the threads can tell new work
+         * from work they have already seen.
+         */
+        unsigned generation;
+
+        /**
+         * Is set when the threads should finish.
+         */
+        bool stopping;
+
+        /**
+         * Waits for and runs work as the thread with the given index.
+         */
+        void work(unsigned worker);
+
+        /**
+         * Finishes and joins all the threads.
+         */
+        void stop();
+
+    private:
+        // The pool owns its threads, so it can't be copied.
+        WorkerPool(const WorkerPool &);
+        WorkerPool& operator=(const WorkerPool &);
+
+    public:
+        /**
+         * Creates a pool with the given number of threads, including
+         * the calling thread.
+         */
+        WorkerPool(unsigned threads = 1);
+
+        /**
+         * Finishes and joins the pool's threads.
+         */
+        ~WorkerPool();
+
+        /**
+         * Sets the number of threads, including the calling thread.
+         * The pool's threads are only restarted if this changes.
+         */
+        void setThreadCount(unsigned threads);
+
+        /**
+         * Returns the number of threads, including the calling thread.
+         */
+        unsigned getThreadCount() const
+        {
+            return (unsigned)workers.size() + 1;
+        }
+
+        /**
+         * Runs the given function on up to the given number of
+         * threads, including the calling thread, and returns when
+         * they have all finished.
+         */
+        void run(Function function, void *job, unsigned threads);
+    };
+
     /**
      * A base class for nodes in a bounding volume hierarchy.
      *
@@ -127,7 +598,7 @@ namespace cyclone {
          */
         BVHNode(BVHNode *parent, const BoundingVolumeClass &volume,
             RigidBody* body=NULL)
-            : parent(parent), volume(volume), body(body)
+            : volume(volume), body(body), parent(parent)
         {
             children[0] = children[1] = NULL;
         }
@@ -144,10 +615,71 @@ namespace cyclone {
          * Checks the potential contacts from this node downwards in
          * the hierarchy, writing them to the given array (up to the
          * given limit). Returns the number of potential contacts it
-         * found.
+         * found. If a filter is given, only the pairs it allows are
+         * written.
          */
         unsigned getPotentialContacts(PotentialContact* contacts,
-                                      unsigned limit) const;
+                                      unsigned limit,
+                                      const PairFilter *filter = NULL) const;
+
+        /**
+         * Checks the potential contacts from this node downwards in
+         * the hierarchy, adding them to the end of the given list.
+         * There is no limit: the list grows to hold every pair.
+         *
+         * If a pool with more than one thread is given, the top levels
+         * of the hierarchy are split into independent tasks, which
+         * are shared out between the pool's threads. Each task writes
+         * into its own buffer, and the buffers are joined in task
+         * order at the end, so the pairs come out in the same order
+         * as the single threaded traversal whatever the number of
+         * threads. If a filter is given, only the pairs it allows are
+         * added.
+         */
+        void getPotentialContacts(std::vector<PotentialContact> &contacts,
+                                  WorkerPool *pool = NULL,
+                                  const PairFilter *filter = NULL) const;
+
+        /**
+         * Finds the bodies whose bounding volumes overlap the given
+         * region, adding them to the end of the given list. The
+         * region can be any type that the bounding volume class has
+         * an overlaps method for, such as a BoundingSphere or a
+         * BoundingBox.
+         */
+        template<class RegionClass>
+        void getBodiesInRegion(const RegionClass &region,
+                               std::vector<RigidBody*> &bodies) const;
+
+        /**
+         * Finds the bodies whose bounding volumes overlap any of the
+         * given regions, adding a result to the end of the given list
+         * for each body and region that overlap. All the regions are
+         * checked in one pass down the hierarchy, so nodes near the
+         * top are only visited once for the whole batch.
+         */
+        template<class RegionClass>
+        void getBodiesInRegions(const RegionClass *regions,
+                                unsigned regionCount,
+                                std::vector<RegionQueryResult> &results) const;
+
+        /**
+         * Casts the given rays into the hierarchy, as a single packet.
+         * Each node checks all the rays that reached it in one pass,
+         * and only the rays that reach the node's volume nearer than
+         * their closest hit so far go on to its children. The given
+         * visitor is called for each leaf the rays reach, as
+         * visitor(body, indices, count) with the indices of the rays,
+         * and should test the rays against the body's primitives and
+         * update their hits. The nearer child of each node is visited
+         * first, so that its hits can cull the further one.
+         *
+         * The hits should be reset before the first cast, with
+         * RayBatch::resetHits. There is one hit for each ray.
+         */
+        template<class Visitor>
+        void castRays(const RayBatch &rays, RayHit *hits,
+                      Visitor &visitor) const;
 
         /**
          * Inserts the given rigid body, with the given bounding volume,
@@ -170,6 +702,77 @@ namespace cyclone {
 
     protected:
 
+        /**
+         * Holds one piece of a parallel traversal. If other is NULL
+         * the task finds the pairs within node, otherwise it finds
+         * the pairs between node and other.
+         */
+        struct TraversalTask
+        {
+            const BVHNode *node;
+            const BVHNode *other;
+        };
+
+        /**
+         * Holds the state shared by the threads of a parallel
+         * traversal.
+         */
+        struct TraversalJob
+        {
+            const std::vector<TraversalTask> *tasks;
+            std::vector< std::vector<PotentialContact> > *buffers;
+            const PairFilter *filter;
+            std::atomic<unsigned> nextTask;
+        };
+
+        /**
+         * Takes tasks from the given job until there are none left,
+         * running each into its own buffer.
+         */
+        static void runTraversalTasks(void *job, unsigned worker);
+
+        /**
+         * Adds the potential contacts from this node downwards that
+         * the given filter (if any) allows to the given list.
+         */
+        void collectPotentialContacts(
+            std::vector<PotentialContact> &contacts,
+            const PairFilter *filter) const;
+
+        /**
+         * Adds the potential contacts between this node and the given
+         * other node that the given filter (if any) allows to the
+         * given list.
+         */
+        void collectPotentialContactsWith(
+            const BVHNode<BoundingVolumeClass> *other,
+            std::vector<PotentialContact> &contacts,
+            const PairFilter *filter) const;
+
+        /**
+         * Checks the regions whose indices are in the given range of
+         * the active list against this node, adding results for the
+         * leaves below. The regions that overlap this node are pushed
+         * onto the end of the active list for the children to check,
+         * and popped again before returning.
+         */
+        template<class RegionClass>
+        void queryRegions(const RegionClass *regions,
+                          std::vector<unsigned> &active,
+                          unsigned first, unsigned count,
+                          std::vector<RegionQueryResult> &results) const;
+
+        /**
+         * Clips the rays whose indices are in the given range of the
+         * active list against this node, and passes the ones that
+         * reach it to the leaves below, in the same way as
+         * queryRegions.
+         */
+        template<class Visitor>
+        void traceRays(const RayBatch &rays, std::vector<unsigned> &active,
+                       unsigned first, unsigned count,
+                       RayHit *hits, Visitor &visitor) const;
+
         /**
          * Checks for overlapping between nodes in the hierarchy. Note
          * that any bounding volume should have an overlaps method implemented
@@ -186,7 +789,8 @@ namespace cyclone {
         unsigned getPotentialContactsWith(
             const BVHNode<BoundingVolumeClass> *other,
             PotentialContact* contacts,
-            unsigned limit) const;
+            unsigned limit,
+            const PairFilter *filter = NULL) const;
 
         /**
          * For non-leaf nodes, this method recalculates the bounding volume
@@ -204,7 +808,7 @@ namespace cyclone {
         const BVHNode<BoundingVolumeClass> * other
         ) const
     {
-        return volume->overlaps(other->volume);
+        return volume.overlaps(&other->volume);
     }
 
     template<class BoundingVolumeClass>
@@ -307,30 +911,43 @@ namespace cyclone {
             );
 
         // Recurse up the tree
-        if (parent) parent->recalculateBoundingVolume(true);
+        if (parent && recurse) parent->recalculateBoundingVolume(true);
     }
 
     template<class BoundingVolumeClass>
     unsigned BVHNode<BoundingVolumeClass>::getPotentialContacts(
-        PotentialContact* contacts, unsigned limit
+        PotentialContact* contacts, unsigned limit,
+        const PairFilter *filter
         ) const
     {
         // Early out if we don't have the room for contacts, or
         // if we're a leaf node.
         if (isLeaf() || limit == 0) return 0;
 
-        // Get the potential contacts of one of our children with
-        // the other
-        return children[0]->getPotentialContactsWith(
-            children[1], contacts, limit
+        // Get the potential contacts within each of our children,
+        // then those of one of our children with the other.
+        unsigned count = children[0]->getPotentialContacts(
+            contacts, limit, filter
             );
+        if (limit > count) {
+            count += children[1]->getPotentialContacts(
+                contacts+count, limit-count, filter
+                );
+        }
+        if (limit > count) {
+            count += children[0]->getPotentialContactsWith(
+                children[1], contacts+count, limit-count, filter
+                );
+        }
+        return count;
     }
 
     template<class BoundingVolumeClass>
     unsigned BVHNode<BoundingVolumeClass>::getPotentialContactsWith(
         const BVHNode<BoundingVolumeClass> *other,
         PotentialContact* contacts,
-        unsigned limit
+        unsigned limit,
+        const PairFilter *filter
         ) const
     {
         // Early out if we don't overlap or if we have no room
@@ -338,8 +955,10 @@ namespace cyclone {
         if (!overlaps(other) || limit == 0) return 0;
 
         // If we're both at leaf nodes, then we have a potential contact
+        // (unless the filter rules it out).
         if (isLeaf() && other->isLeaf())
         {
+            if (filter && !filter->allowPair(body, other->body)) return 0;
             contacts->body[0] = body;
             contacts->body[1] = other->body;
             return 1;
@@ -349,17 +968,17 @@ namespace cyclone {
         // a leaf, then we descend the other. If both are branches,
         // then we use the one with the largest size.
         if (other->isLeaf() ||
-            (!isLeaf() && volume->getSize() >= other->volume->getSize()))
+            (!isLeaf() && volume.getSize() >= other->volume.getSize()))
         {
             // Recurse into ourself
             unsigned count = children[0]->getPotentialContactsWith(
-                other, contacts, limit
+                other, contacts, limit, filter
                 );
 
             // Check we have enough slots to do the other side too
             if (limit > count) {
                 return count + children[1]->getPotentialContactsWith(
-                    other, contacts+count, limit-count
+                    other, contacts+count, limit-count, filter
                     );
             } else {
                 return count;
@@ -369,13 +988,13 @@ namespace cyclone {
         {
             // Recurse into the other node
             unsigned count = getPotentialContactsWith(
-                other->children[0], contacts, limit
+                other->children[0], contacts, limit, filter
                 );
 
             // Check we have enough slots to do the other side too
             if (limit > count) {
                 return count + getPotentialContactsWith(
-                    other->children[1], contacts+count, limit-count
+                    other->children[1], contacts+count, limit-count, filter
                     );
             } else {
                 return count;
@@ -383,6 +1002,323 @@ namespace cyclone {
         }
     }
 
+    template<class BoundingVolumeClass>
+    void BVHNode<BoundingVolumeClass>::getPotentialContacts(
+        std::vector<PotentialContact> &contacts, WorkerPool *pool,
+        const PairFilter *filter
+        ) const
+    {
+        if (isLeaf()) return;
+        unsigned threads = pool ? pool->getThreadCount() : 1;
+
+        // With one thread there is no point splitting the work up.
+        if (threads <= 1)
+        {
+            collectPotentialContacts(contacts, filter);
+            return;
+        }
+
+        // Split the traversal into tasks by expanding the top of the
+        // tree, in the same order the recursive traversal would visit
+        // it. We want a few tasks per thread so that uneven tasks
+        // balance out.
+        std::vector<TraversalTask> tasks, expanded;
+        TraversalTask task;
+        task.node = this;
+        task.other = NULL;
+        tasks.push_back(task);
+
+        unsigned wanted = threads * 4;
+        bool changed = true;
+        while (changed && tasks.size() < wanted)
+        {
+            changed = false;
+            expanded.clear();
+            for (unsigned i = 0; i < tasks.size(); i++)
+            {
+                const BVHNode *node = tasks[i].node;
+                const BVHNode *other = tasks[i].other;
+
+                if (!other)
+                {
+                    // Pairs within a node are those within each
+                    // child, then those between the children.
+                    if (node->isLeaf()) { changed = true; continue; }
+                    task.node = node->children[0]; task.other = NULL;
+                    expanded.push_back(task);
+                    task.node = node->children[1];
+                    expanded.push_back(task);
+                    task.node = node->children[0];
+                    task.other = node->children[1];
+                    expanded.push_back(task);
+                    changed = true;
+                }
+                else if (!node->overlaps(other))
+                {
+                    // This task can't find anything, so drop it.
+                    changed = true;
+                }
+                else if (node->isLeaf() && other->isLeaf())
+                {
+                    expanded.push_back(tasks[i]);
+                }
+                else if (other->isLeaf() || (!node->isLeaf() &&
+                    node->volume.getSize() >= other->volume.getSize()))
+                {
+                    // Descend the same way getPotentialContactsWith does.
+                    task.node = node->children[0]; task.other = other;
+                    expanded.push_back(task);
+                    task.node = node->children[1];
+                    expanded.push_back(task);
+                    changed = true;
+                }
+                else
+                {
+                    task.node = node; task.other = other->children[0];
+                    expanded.push_back(task);
+                    task.other = other->children[1];
+                    expanded.push_back(task);
+                    changed = true;
+                }
+            }
+            tasks.swap(expanded);
+        }
+
+        // Run the tasks, each into its own buffer.
+        std::vector< std::vector<PotentialContact> > buffers(tasks.size());
+        TraversalJob job;
+        job.tasks = &tasks;
+        job.buffers = &buffers;
+        job.filter = filter;
+        job.nextTask = 0;
+
+        pool->run(runTraversalTasks, &job, (unsigned)tasks.size());
+
+        // Join the buffers in task order.
+        unsigned total = (unsigned)contacts.size();
+        for (unsigned i = 0; i < buffers.size(); i++)
+        {
+            total += (unsigned)buffers[i].size();
+        }
+        contacts.reserve(total);
+        for (unsigned i = 0; i < buffers.size(); i++)
+        {
+            contacts.insert(contacts.end(),
+                buffers[i].begin(), buffers[i].end());
+        }
+    }
+
+    template<class BoundingVolumeClass>
+    template<class RegionClass>
+    void BVHNode<BoundingVolumeClass>::getBodiesInRegion(
+        const RegionClass &region, std::vector<RigidBody*> &bodies
+        ) const
+    {
+        if (!volume.overlaps(&region)) return;
+
+        if (isLeaf())
+        {
+            bodies.push_back(body);
+        }
+        else
+        {
+            children[0]->getBodiesInRegion(region, bodies);
+            children[1]->getBodiesInRegion(region, bodies);
+        }
+    }
+
+    template<class BoundingVolumeClass>
+    template<class RegionClass>
+    void BVHNode<BoundingVolumeClass>::getBodiesInRegions(
+        const RegionClass *regions, unsigned regionCount,
+        std::vector<RegionQueryResult> &results
+        ) const
+    {
+        if (regionCount == 0) return;
+
+        // Start with every region active.
+        std::vector<unsigned> active(regionCount);
+        for (unsigned i = 0; i < regionCount; i++) active[i] = i;
+
+        queryRegions(regions, active, 0, regionCount, results);
+    }
+
+    template<class BoundingVolumeClass>
+    template<class RegionClass>
+    void BVHNode<BoundingVolumeClass>::queryRegions(
+        const RegionClass *regions, std::vector<unsigned> &active,
+        unsigned first, unsigned count,
+        std::vector<RegionQueryResult> &results
+        ) const
+    {
+        // Find which of the active regions overlap us.
+        unsigned start = (unsigned)active.size();
+        for (unsigned i = first; i < first + count; i++)
+        {
+            if (volume.overlaps(&regions[active[i]]))
+            {
+                active.push_back(active[i]);
+            }
+        }
+        unsigned overlapping = (unsigned)active.size() - start;
+
+        if (overlapping > 0)
+        {
+            if (isLeaf())
+            {
+                RegionQueryResult result;
+                result.body = body;
+                for (unsigned i = start; i < start + overlapping; i++)
+                {
+                    result.region = active[i];
+                    results.push_back(result);
+                }
+            }
+            else
+            {
+                children[0]->queryRegions(
+                    regions, active, start, overlapping, results
+                    );
+                children[1]->queryRegions(
+                    regions, active, start, overlapping, results
+                    );
+            }
+        }
+
+        active.resize(start);
+    }
+
+    template<class BoundingVolumeClass>
+    template<class Visitor>
+    void BVHNode<BoundingVolumeClass>::castRays(
+        const RayBatch &rays, RayHit *hits, Visitor &visitor
+        ) const
+    {
+        unsigned count = rays.size();
+        if (count == 0) return;
+
+        // Start with every ray active.
+        std::vector<unsigned> active(count);
+        for (unsigned i = 0; i < count; i++) active[i] = i;
+
+        traceRays(rays, active, 0, count, hits, visitor);
+    }
+
+    template<class BoundingVolumeClass>
+    template<class Visitor>
+    void BVHNode<BoundingVolumeClass>::traceRays(
+        const RayBatch &rays, std::vector<unsigned> &active,
+        unsigned first, unsigned count,
+        RayHit *hits, Visitor &visitor
+        ) const
+    {
+        // Find which of the active rays reach us, making room for
+        // them at the end of the list first.
+        unsigned start = (unsigned)active.size();
+        active.resize(start + count);
+        unsigned reaching = volume.clipRays(
+            rays, &active[first], count, hits, &active[start]
+            );
+        active.resize(start + reaching);
+
+        if (reaching > 0)
+        {
+            if (isLeaf())
+            {
+                visitor(body, &active[start], reaching);
+            }
+            else
+            {
+                // Visit the child nearer the start of the packet's
+                // first ray first.
+                Vector3 split =
+                    children[1]->volume.centre - children[0]->volume.centre;
+                unsigned near = split * rays.getDirection(active[start]) < 0;
+
+                children[near]->traceRays(
+                    rays, active, start, reaching, hits, visitor
+                    );
+                children[1-near]->traceRays(
+                    rays, active, start, reaching, hits, visitor
+                    );
+            }
+        }
+
+        active.resize(start);
+    }
+
+    template<class BoundingVolumeClass>
+    void BVHNode<BoundingVolumeClass>::runTraversalTasks(void *data,
+                                                         unsigned /*worker*/)
+    {
+        TraversalJob *job = static_cast<TraversalJob*>(data);
+        for (;;)
+        {
+            unsigned i = job->nextTask++;
+            if (i >= job->tasks->size()) return;
+
+            const TraversalTask &task = (*job->tasks)[i];
+            if (task.other)
+            {
+                task.node->collectPotentialContactsWith(
+                    task.other, (*job->buffers)[i], job->filter
+                    );
+            }
+            else
+            {
+                task.node->collectPotentialContacts(
+                    (*job->buffers)[i], job->filter
+                    );
+            }
+        }
+    }
+
+    template<class BoundingVolumeClass>
+    void BVHNode<BoundingVolumeClass>::collectPotentialContacts(
+        std::vector<PotentialContact> &contacts,
+        const PairFilter *filter
+        ) const
+    {
+        if (isLeaf()) return;
+
+        children[0]->collectPotentialContacts(contacts, filter);
+        children[1]->collectPotentialContacts(contacts, filter);
+        children[0]->collectPotentialContactsWith(
+            children[1], contacts, filter
+            );
+    }
+
+    template<class BoundingVolumeClass>
+    void BVHNode<BoundingVolumeClass>::collectPotentialContactsWith(
+        const BVHNode<BoundingVolumeClass> *other,
+        std::vector<PotentialContact> &contacts,
+        const PairFilter *filter
+        ) const
+    {
+        if (!overlaps(other)) return;
+
+        if (isLeaf() && other->isLeaf())
+        {
+            if (filter && !filter->allowPair(body, other->body)) return;
+
+            PotentialContact contact;
+            contact.body[0] = body;
+            contact.body[1] = other->body;
+            contacts.push_back(contact);
+        }
+        else if (other->isLeaf() ||
+            (!isLeaf() && volume.getSize() >= other->volume.getSize()))
+        {
+            children[0]->collectPotentialContactsWith(other, contacts, filter);
+            children[1]->collectPotentialContactsWith(other, contacts, filter);
+        }
+        else
+        {
+            collectPotentialContactsWith(other->children[0], contacts, filter);
+            collectPotentialContactsWith(other->children[1], contacts, filter);
+        }
+    }
+
 } // namespace cyclone
 
 #endif // CYCLONE_COLLISION_FINE_H
\ No newline at end of file
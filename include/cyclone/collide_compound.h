@@ -0,0 +1,251 @@
+/*
+ * Interface file for compound collision primitives.
+ *
+ * Part of the Cyclone physics system.
+ *
+ * Copyright (c) Icosagon 2003. All Rights Reserved.
+ *
+ * This software is distributed under licence. Use of this software
+ * implies agreement with all terms and conditions of the accompanying
+ * software licence.
+ */
+
+/**
+ * @file
+ *
+ * This file contains the compound primitive, which gathers several
+ * primitives into one shape for a single rigid body. A vehicle or a
+ * piece of debris made of several boxes and capsules can then be one
+ * body, rather than many bodies held together with joints.
+ *
+ * The compound keeps a bounding volume hierarchy over its children
+ * in its own coordinates. The hierarchy only changes when children
+ * are added, removed or moved relative to the compound, so it is
+ * kept from frame to frame. The collision pipeline uses it to test
+ * only the children near the other primitive in each pair.
+ */
+#ifndef CYCLONE_COLLISION_COMPOUND_H
+#define CYCLONE_COLLISION_COMPOUND_H
+
+#include "collide_pipeline.h"
+
+namespace cyclone {
+
+    /**
+     * Represents a rigid body made of several collision primitives.
+     *
+     * Each child's offset is relative to the compound rather than to
+     * the body, and its body is set to the compound's body. Children
+     * are updated by the compound's calculateInternals, so call that
+     * rather than calculateInternals on the children. The children
+     * are not deleted by the compound, and can't be compounds
+     * themselves.
+     */
+    class CollisionCompound : public CollisionPrimitive
+    {
+    public:
+        /**
+         * Holds a single child primitive with its type.
+         */
+        struct Child
+        {
+            CollisionPrimitive *primitive;
+            CollisionPipeline::PrimitiveType type;
+        };
+
+    protected:
+        /**
+         * Holds a node of the hierarchy. Leaf nodes hold a range of
+         * the child order, and other nodes hold the index of their
+         * first child node, with the second straight after it.
+         */
+        struct Node
+        {
+            BoundingBox volume;
+            unsigned first;
+            unsigned count;
+
+            Node()
+            :
+            volume(Vector3(), Vector3()), first(0), count(0)
+            {
+            }
+        };
+
+        /**
+         * Holds the children.
+         */
+        std::vector<Child> children;
+
+        /**
+         * Holds the bounds of each child, in the compound's
+         * coordinates.
+         */
+        std::vector<BoundingBox> childBounds;
+
+        /**
+         * Holds the nodes of the hierarchy, with the root first.
+         */
+        std::vector<Node> nodes;
+
+        /**
+         * Holds the child indices in the order the leaves use them.
+         */
+        std::vector<unsigned> order;
+
+        /**
+         * Holds the bounds of all the children together, in the
+         * compound's coordinates.
+         */
+        BoundingBox bounds;
+
+        /**
+         * Is set when the children have changed since the hierarchy
+         * was built.
+         */
+        bool dirty;
+
+        /**
+         * Adds a child of the given type.
+         */
+        void add(CollisionPrimitive *primitive,
+            CollisionPipeline::PrimitiveType type);
+
+        /**
+         * Works out the bounds of the given child, in the compound's
+         * coordinates. This uses the child's own calculateBounds, so
+         * it leaves the child's transform set to its offset.
+         */
+        static BoundingBox getChildBounds(const Child &child);
+
+        /**
+         * Works out the world bounds from the bounds of the children.
+         */
+        virtual void calculateBounds();
+
+        /**
+         * Rebuilds the bounds and the hierarchy.
+         */
+        void build();
+
+        /**
+         * Builds the node at the given index over the given range of
+         * the child order, and its children.
+         */
+        void buildNode(unsigned node, unsigned first, unsigned count);
+
+    public:
+        /**
+         * Creates a compound with no children.
+         */
+        CollisionCompound();
+
+        /**
+         * Adds the given primitive as a child.
+         */
+        void addSphere(CollisionSphere *sphere);
+        void addBox(CollisionBox *box);
+        void addCapsule(CollisionCapsule *capsule);
+        void addHull(CollisionConvexHull *hull);
+
+        /**
+         * Removes the given child, if it is one.
+         */
+        void remove(const CollisionPrimitive *primitive);
+
+        /**
+         * Removes all the children.
+         */
+        void clear();
+
+        /**
+         * Tells the compound that a child's offset or size has
+         * changed, so its bounds need to be worked out again.
+         */
+        void updateBounds()
+        {
+            dirty = true;
+        }
+
+        /**
+         * Calculates the internals for the compound and all its
+         * children, rebuilding the hierarchy first if needed. As for
+         * other primitives, nothing is done if the body hasn't moved
+         * and the children haven't changed.
+         */
+        void calculateInternals();
+
+        /**
+         * Returns the number of children.
+         */
+        unsigned getChildCount() const
+        {
+            return (unsigned)children.size();
+        }
+
+        /**
+         * Returns the child with the given index.
+         */
+        const Child& getChild(unsigned index) const
+        {
+            return children[index];
+        }
+
+        /**
+         * Returns the bounds of all the children, in the compound's
+         * coordinates, as of the last calculateInternals.
+         */
+        const BoundingBox& getLocalBounds() const
+        {
+            return bounds;
+        }
+
+        /**
+         * Returns a bounding sphere around all the children, in world
+         * coordinates.
+         */
+        BoundingSphere getBoundingSphere() const
+        {
+            return BoundingSphere(
+                transform.transform(bounds.centre),
+                bounds.halfSize.magnitude()
+                );
+        }
+
+        /**
+         * Calls the given visitor with the index of each child whose
+         * bounds overlap the given region. The region is in the
+         * compound's coordinates.
+         */
+        template<class Visitor>
+        void visitChildren(const BoundingBox &region, Visitor &visitor) const
+        {
+            if (nodes.empty()) return;
+
+            unsigned stack[64];
+            unsigned stackSize = 0;
+            stack[stackSize++] = 0;
+            while (stackSize > 0)
+            {
+                const Node &node = nodes[stack[--stackSize]];
+                if (!node.volume.overlaps(&region)) continue;
+
+                if (node.count > 0)
+                {
+                    for (unsigned i = 0; i < node.count; i++)
+                    {
+                        visitor(order[node.first + i]);
+                    }
+                }
+                else
+                {
+                    stack[stackSize++] = node.first + 1;
+                    stack[stackSize++] = node.first;
+                }
+            }
+        }
+    };
+
+} // namespace cyclone
+
+#endif // CYCLONE_COLLISION_COMPOUND_H
@@ -0,0 +1,246 @@
+/*
+ * Interface file for the continuous collision detection system.
+ *
+ * Part of the Cyclone physics system.
+ *
+ * Copyright (c) Icosagon 2003. All Rights Reserved.
+ *
+ * This software is distributed under licence. Use of this software
+ * implies agreement with all terms and conditions of the accompanying
+ * software licence.
+ */
+
+/**
+ * @file
+ *
+ * This file contains continuous collision detection for small, fast
+ * spheres such as projectiles.
+ *
+ * The fine grained tests only look at where things are at the end
+ * of each frame. A sphere moving further than its own size in one
+ * frame can be on one side of a thin object at the start of the
+ * frame and on the other side at the end, and never be seen to touch
+ * it. Rather than shrinking the timestep for the whole world, the
+ * tests here sweep the sphere along its movement for the frame and
+ * find the time it first touches something. The continuous stage
+ * uses them to move fast spheres from impact to impact, while the
+ * rest of the world takes a single step.
+ */
+#ifndef CYCLONE_COLLISION_CONTINUOUS_H
+#define CYCLONE_COLLISION_CONTINUOUS_H
+
+#include "collide_fine.h"
+
+namespace cyclone {
+
+    class CollisionPipeline;
+
+    /**
+     * Holds the first thing hit by a swept sphere.
+     */
+    struct SweepResult
+    {
+        /**
+         * Holds the proportion of the movement made before the
+         * sphere touches, between zero and one.
+         */
+        real time;
+
+        /**
+         * Holds the contact normal at the time of impact, pointing
+         * from the thing hit towards the sphere.
+         */
+        Vector3 normal;
+
+        /**
+         * Holds the point of contact at the time of impact.
+         */
+        Vector3 point;
+
+        /**
+         * Holds the primitive hit, or NULL if the sphere hit static
+         * geometry such as a plane.
+         */
+        CollisionPrimitive *primitive;
+    };
+
+    /**
+     * A wrapper class that holds the swept sphere tests. Each test
+     * moves the sphere from its current position by the given
+     * movement, with the other object held still, and returns true if
+     * they touch along the way. The time and normal are then set.
+     *
+     * A sphere already overlapping the other object at the start is
+     * not reported, as the normal collision tests deal with it.
+     */
+    class SweptTests
+    {
+    public:
+        static bool sphereAndHalfSpace(
+            const CollisionSphere &sphere,
+            const Vector3 &movement,
+            const CollisionPlane &plane,
+            real *time,
+            Vector3 *normal
+            );
+
+        static bool sphereAndSphere(
+            const CollisionSphere &sphere,
+            const Vector3 &movement,
+            const CollisionSphere &other,
+            real *time,
+            Vector3 *normal
+            );
+
+        static bool sphereAndBox(
+            const CollisionSphere &sphere,
+            const Vector3 &movement,
+            const CollisionBox &box,
+            real *time,
+            Vector3 *normal
+            );
+
+        static bool sphereAndCapsule(
+            const CollisionSphere &sphere,
+            const Vector3 &movement,
+            const CollisionCapsule &capsule,
+            real *time,
+            Vector3 *normal
+            );
+
+        static bool sphereAndTriangle(
+            const CollisionSphere &sphere,
+            const Vector3 &movement,
+            const CollisionTriangle &triangle,
+            real *time,
+            Vector3 *normal
+            );
+    };
+
+    /**
+     * Moves fast spheres through a frame without letting them pass
+     * through thin objects, by stopping them at each impact along the
+     * way.
+     *
+     * Register the spheres that might move fast, and call integrate
+     * in place of integrating their bodies. Spheres that will move
+     * less than a set proportion of their radius in the frame are
+     * integrated as normal. Fast spheres are swept against everything
+     * in the collision pipeline; at each impact the sphere is moved
+     * to the point of contact and the contact is resolved, bouncing
+     * the sphere and pushing the object it hit, before the sphere
+     * carries on with the rest of the frame. The other bodies are not
+     * moved, and can take their full step as usual. The sweeps find
+     * what is near each sphere using the hierarchy built by the
+     * pipeline's last broadphase, so integrate should be called
+     * before the other bodies are moved.
+     *
+     * Impacts are resolved with the velocity of the bodies only: the
+     * normal contact generation still runs for the frame, and deals
+     * with spheres left resting on things.
+     */
+    class ContinuousCollision
+    {
+    public:
+        /**
+         * Records an impact found by the last call to integrate.
+         */
+        struct Impact
+        {
+            CollisionSphere *sphere;
+            SweepResult result;
+        };
+
+    protected:
+        /**
+         * Holds the pipeline whose primitives the spheres are swept
+         * against.
+         */
+        const CollisionPipeline *pipeline;
+
+        /**
+         * Holds the registered spheres.
+         */
+        std::vector<CollisionSphere*> spheres;
+
+        /**
+         * Holds the impacts found by the last call to integrate.
+         */
+        std::vector<Impact> impacts;
+
+        /**
+         * Holds the resolver used for each impact.
+         */
+        ContactResolver resolver;
+
+        /**
+         * Moves a single fast sphere through the given duration.
+         */
+        void integrateFast(CollisionSphere *sphere, real duration);
+
+    public:
+        /**
+         * Holds the proportion of its radius a sphere must move in a
+         * frame before it is treated as fast.
+         */
+        real fastFraction;
+
+        /**
+         * Holds the most impacts a sphere can have in one frame. A
+         * sphere that uses them all stops for the rest of the frame.
+         */
+        unsigned maxSubsteps;
+
+        /**
+         * Holds the friction and restitution used for impacts.
+         */
+        real friction;
+        real restitution;
+
+        /**
+         * Creates a stage that sweeps spheres against the primitives
+         * in the given pipeline.
+         */
+        ContinuousCollision(const CollisionPipeline *pipeline);
+
+        /**
+         * Registers the given sphere. It should also be registered
+         * with the pipeline, so the other primitives can hit it.
+         */
+        void addSphere(CollisionSphere *sphere);
+
+        /**
+         * Removes the given sphere, if it is registered.
+         */
+        void removeSphere(const CollisionSphere *sphere);
+
+        /**
+         * Removes all the spheres.
+         */
+        void clear();
+
+        /**
+         * Checks if the given sphere would move far enough in the
+         * given duration to need sweeping.
+         */
+        bool isFast(const CollisionSphere &sphere, real duration) const;
+
+        /**
+         * Integrates the bodies of all the registered spheres for the
+         * given duration, and updates the spheres' internals. Fast
+         * spheres stop at each impact on the way.
+         */
+        void integrate(real duration);
+
+        /**
+         * Returns the impacts found by the last call to integrate.
+         */
+        const std::vector<Impact>& getImpacts() const
+        {
+            return impacts;
+        }
+    };
+
+} // namespace cyclone
+
+#endif // CYCLONE_COLLISION_CONTINUOUS_H
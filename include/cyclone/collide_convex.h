@@ -0,0 +1,274 @@
+/*
+ * Interface file for the convex collision detection system.
+ *
+ * Part of the Cyclone physics system.
+ *
+ * Copyright (c) Icosagon 2003. All Rights Reserved.
+ *
+ * This software is distributed under licence. Use of this software
+ * implies agreement with all terms and conditions of the accompanying
+ * software licence.
+ */
+
+/**
+ * @file
+ *
+ * This file contains collision detection for general convex shapes.
+ * The distance between two shapes, and whether they overlap, is
+ * found with the Gilbert-Johnson-Keerthi (GJK) algorithm, and how
+ * far they overlap is found with the expanding polytope algorithm
+ * (EPA).
+ *
+ * Both algorithms only need to know the furthest point of each shape
+ * in a given direction (its support function), so any pair of convex
+ * shapes can be tested in the same way. They are used for convex
+ * hulls, which have no dedicated tests, but work for the other
+ * primitives too. Repeating the distance test along a straight
+ * movement also gives a sweep for any convex shape, by conservative
+ * advancement.
+ */
+#ifndef CYCLONE_COLLISION_CONVEX_H
+#define CYCLONE_COLLISION_CONVEX_H
+
+#include "collide_fine.h"
+
+namespace cyclone {
+
+    /**
+     * Wraps a collision primitive with the support function for its
+     * shape, so it can be used in the convex tests.
+     */
+    class ConvexShape
+    {
+    public:
+        /**
+         * A support function returns the point of the primitive's
+         * shape furthest along the given direction, with both in the
+         * primitive's own coordinates.
+         */
+        typedef Vector3 (*SupportFunction)(
+            const CollisionPrimitive *primitive,
+            const Vector3 &direction);
+
+    protected:
+        /**
+         * Holds the primitive, which gives the shape's transform.
+         */
+        const CollisionPrimitive *primitive;
+
+        /**
+         * Holds the support function for the primitive's shape.
+         */
+        SupportFunction support;
+
+    public:
+        /**
+         * Holds a movement added to the primitive's position, so the
+         * shape can be tested part of the way along a sweep without
+         * moving the primitive. It is zero unless set.
+         */
+        Vector3 translation;
+
+        /**
+         * Creates a shape using the given support function.
+         */
+        ConvexShape(const CollisionPrimitive *primitive,
+                    SupportFunction support);
+
+        /**
+         * Creates shapes for each of the primitive types.
+         */
+        ConvexShape(const CollisionSphere &sphere);
+        ConvexShape(const CollisionBox &box);
+        ConvexShape(const CollisionCapsule &capsule);
+        ConvexShape(const CollisionConvexHull &hull);
+
+        /**
+         * Returns the primitive this shape wraps.
+         */
+        const CollisionPrimitive* getPrimitive() const
+        {
+            return primitive;
+        }
+
+        /**
+         * Returns the point of the shape furthest along the given
+         * direction, in the primitive's own coordinates. The
+         * direction is given in world coordinates.
+         */
+        Vector3 getLocalSupport(const Vector3 &direction) const
+        {
+            return support(
+                primitive,
+                primitive->getTransform().transformInverseDirection(direction)
+                );
+        }
+
+        /**
+         * Converts a point in the primitive's own coordinates into
+         * world coordinates.
+         */
+        Vector3 toWorld(const Vector3 &point) const
+        {
+            return primitive->getTransform().transform(point) + translation;
+        }
+
+        /**
+         * Returns the origin of the shape in world coordinates.
+         */
+        Vector3 getCentre() const
+        {
+            return primitive->getAxis(3) + translation;
+        }
+
+        /**
+         * The support functions for each of the primitive types.
+         */
+        static Vector3 sphereSupport(
+            const CollisionPrimitive *primitive, const Vector3 &direction);
+        static Vector3 boxSupport(
+            const CollisionPrimitive *primitive, const Vector3 &direction);
+        static Vector3 capsuleSupport(
+            const CollisionPrimitive *primitive, const Vector3 &direction);
+        static Vector3 hullSupport(
+            const CollisionPrimitive *primitive, const Vector3 &direction);
+    };
+
+    /**
+     * Holds the final simplex of a convex test between a pair of
+     * shapes, so the next test on the same pair can start from it.
+     *
+     * The simplex is stored as points on each shape in the shape's
+     * own coordinates, so it is still a good guess after the shapes
+     * have moved. When they have only moved a little, GJK then needs
+     * only one or two iterations. Use one cache per pair of shapes,
+     * always passing the shapes in the same order.
+     */
+    struct ConvexCache
+    {
+        /**
+         * Holds the number of points in the simplex, or zero if the
+         * cache is empty.
+         */
+        unsigned count;
+
+        /**
+         * Holds the points of the simplex on the first shape, in its
+         * own coordinates.
+         */
+        Vector3 pointOne[4];
+
+        /**
+         * Holds the points of the simplex on the second shape, in
+         * its own coordinates.
+         */
+        Vector3 pointTwo[4];
+
+        /**
+         * Holds the number of GJK iterations the last test took.
+         */
+        unsigned iterations;
+
+        /**
+         * Creates an empty cache.
+         */
+        ConvexCache()
+        :
+        count(0), iterations(0)
+        {
+        }
+    };
+
+    /**
+     * A wrapper class that holds the tests for general convex shapes.
+     * Each test can be given a cache for the pair of shapes, which is
+     * used to start the test and is updated with its result.
+     */
+    class ConvexTests
+    {
+    public:
+        /**
+         * Checks if the two shapes overlap.
+         */
+        static bool intersect(
+            const ConvexShape &one,
+            const ConvexShape &two,
+            ConvexCache *cache = NULL
+            );
+
+        /**
+         * Finds the distance between the two shapes, and the closest
+         * points on each in world coordinates. If the shapes overlap
+         * the distance is zero and the points are not set.
+         */
+        static real distance(
+            const ConvexShape &one,
+            const ConvexShape &two,
+            Vector3 *pointOne,
+            Vector3 *pointTwo,
+            ConvexCache *cache = NULL
+            );
+
+        /**
+         * Finds how far the two shapes overlap. If they do, this
+         * returns true and sets the direction the first shape has to
+         * move to separate them, the distance it has to move, and the
+         * deepest points of each shape in world coordinates.
+         */
+        static bool penetration(
+            const ConvexShape &one,
+            const ConvexShape &two,
+            Vector3 *normal,
+            real *depth,
+            Vector3 *pointOne,
+            Vector3 *pointTwo,
+            ConvexCache *cache = NULL
+            );
+
+        /**
+         * Does a collision test on two convex shapes, generating a
+         * single contact at the deepest point of the overlap. If the
+         * shapes are apart by less than the collision data's margin,
+         * the contact is between their closest points instead. The
+         * bodies are given to the contact in the order one, two.
+         */
+        static unsigned collide(
+            const ConvexShape &one,
+            const ConvexShape &two,
+            CollisionData *data,
+            ConvexCache *cache = NULL
+            );
+
+        /**
+         * Moves the first shape by the given movement, with the
+         * second held still, and returns true if they touch along the
+         * way. The proportion of the movement made before they touch
+         * is then set, along with the normal pointing from the second
+         * shape towards the first, and the point of contact.
+         *
+         * The sweep uses conservative advancement: it finds the
+         * distance between the shapes, and moves the first shape on
+         * by the time that gap would take to close at the rate it is
+         * closing now. Along a straight movement this never moves
+         * past the point of contact, and it stops once the shapes are
+         * close enough. Each distance is only found to within a
+         * tolerance, so if a step does end with the shapes
+         * overlapping, the sweep falls back to bisection between it
+         * and the last step. Shapes already overlapping at the start
+         * are not reported, as the normal collision tests deal with
+         * them, and nor are contacts the sweep can't close in on
+         * within its limit of steps.
+         */
+        static bool sweep(
+            const ConvexShape &one,
+            const Vector3 &movement,
+            const ConvexShape &two,
+            real *time,
+            Vector3 *normal,
+            Vector3 *point
+            );
+    };
+
+} // namespace cyclone
+
+#endif // CYCLONE_COLLISION_CONVEX_H
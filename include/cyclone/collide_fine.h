@@ -20,12 +20,15 @@
  * use the fastest separating axis method to check if two objects
  * intersect, and the collision tests generate the contacts. The
  * collision tests typically use the intersection tests as an early
- * out.
+ * out. The ray tests at the end cast batches of rays against single
+ * primitives.
  */
 #ifndef CYCLONE_COLLISION_FINE_H
 #define CYCLONE_COLLISION_FINE_H
 
+#include <vector>
 #include "contacts.h"
+#include "collide_coarse.h"
 
 namespace cyclone {
 
@@ -46,6 +49,7 @@ namespace cyclone {
          */
         friend class IntersectionTests;
         friend class CollisionDetector;
+        friend class CollisionCompound;
 
         /**
          * The rigid body that is represented by this primitive.
@@ -58,10 +62,79 @@ namespace cyclone {
         Matrix4 offset;
 
         /**
-         * Calculates the internals for the primitive.
+         * Holds the collision categories this primitive belongs to,
+         * one per bit. By default a primitive is in the first
+         * category only.
+         */
+        unsigned category;
+
+        /**
+         * Holds the categories this primitive collides with. Two
+         * primitives are only tested against each other if each is
+         * in a category the other's mask includes, so clearing a bit
+         * in the mask of either is enough to keep them apart. By
+         * default every bit is set.
+         */
+        unsigned mask;
+
+        /**
+         * Is set if this primitive is a trigger: a volume that only
+         * reports what overlaps it, such as a gameplay zone. The
+         * collision pipeline tests triggers with the cheap
+         * intersection tests and records enter and exit events for
+         * them, rather than generating contacts. Triggers don't
+         * report each other, and aren't tested against planes,
+         * meshes or heightfields, hit by sweeps or cast against. The
+         * flag is ignored by the CollisionDetector tests. For a
+         * compound, set it on the children. It is clear by default.
+         */
+        bool trigger;
+
+        /**
+         * Creates a primitive in the first category, which collides
+         * with every category.
+         */
+        CollisionPrimitive()
+        :
+        category(1), mask(0xffffffff), trigger(false),
+        worldBounds(Vector3(), Vector3()),
+        transformBody(NULL), transformVersion(0)
+        {
+        }
+
+        virtual ~CollisionPrimitive()
+        {
+        }
+
+        /**
+         * Checks if the categories and masks of this primitive and
+         * the given one allow them to collide.
+         */
+        bool canCollide(const CollisionPrimitive &other) const
+        {
+            return (category & other.mask) != 0 &&
+                (other.category & mask) != 0;
+        }
+
+        /**
+         * Calculates the internals for the primitive: its transform
+         * and its world bounds. These are only worked out again if
+         * the body has moved (or is a different body) since the last
+         * call, so this is cheap for sleeping bodies. If the offset
+         * is the identity, the body's transform is used directly.
          */
         void calculateInternals();
 
+        /**
+         * Tells the primitive that its offset or size has changed, so
+         * the next call to calculateInternals works out its transform
+         * and bounds even if the body hasn't moved.
+         */
+        void invalidateTransform()
+        {
+            transformBody = NULL;
+        }
+
         /**
          * This is a convenience function to allow access to the
          * axis vectors in the transform for this primitive.
@@ -82,6 +155,17 @@ namespace cyclone {
             return transform;
         }
 
+        /**
+         * Returns an axis aligned box in world coordinates around the
+         * primitive, as of the last calculateInternals. Checking two
+         * primitives' bounds for overlap takes six comparisons, so it
+         * makes a cheap early out before a full collision test.
+         */
+        const BoundingBox& getWorldBounds() const
+        {
+            return worldBounds;
+        }
+
 
     protected:
         /**
@@ -90,6 +174,32 @@ namespace cyclone {
          * with the transform of the rigid body.
          */
         Matrix4 transform;
+
+        /**
+         * Holds the world bounds of the primitive, worked out along
+         * with the transform.
+         */
+        BoundingBox worldBounds;
+
+        /**
+         * Works out the world bounds from the transform. Each type
+         * of primitive provides its own. This version gives a box
+         * with no size at the primitive's origin.
+         */
+        virtual void calculateBounds();
+
+        /**
+         * Returns the half-sizes in world coordinates of a box with
+         * the given half-sizes along the primitive's axes.
+         */
+        Vector3 getWorldHalfSize(const Vector3 &halfSize) const;
+
+        /**
+         * Holds the body and its transform version that the
+         * transform was last calculated from.
+         */
+        const RigidBody *transformBody;
+        unsigned transformVersion;
     };
 
     /**
@@ -103,6 +213,64 @@ namespace cyclone {
          * The radius of the sphere.
          */
         real radius;
+
+    protected:
+        /**
+         * Works out the world bounds from the transform.
+         */
+        virtual void calculateBounds();
+    };
+
+    /**
+     * Holds a set of spheres for the batched collision tests, with
+     * each property in its own array (structure of arrays form).
+     * Laying the spheres out this way means the batched tests can
+     * work on several spheres at once with SIMD instructions.
+     *
+     * The batch holds copies of the sphere positions, so it should
+     * be refilled after the bodies move.
+     */
+    class CollisionSphereBatch
+    {
+    public:
+        /** Holds the x coordinates of the sphere centres. */
+        std::vector<real> x;
+
+        /** Holds the y coordinates of the sphere centres. */
+        std::vector<real> y;
+
+        /** Holds the z coordinates of the sphere centres. */
+        std::vector<real> z;
+
+        /** Holds the sphere radii. */
+        std::vector<real> radius;
+
+        /** Holds the rigid body each sphere belongs to. */
+        std::vector<RigidBody*> body;
+
+        /**
+         * Removes all the spheres, keeping the memory for reuse.
+         */
+        void clear();
+
+        /**
+         * Adds a sphere at the given centre, returning its index.
+         */
+        unsigned add(RigidBody *body, const Vector3 &centre, real radius);
+
+        /**
+         * Adds a copy of the given sphere primitive at its current
+         * position, returning its index.
+         */
+        unsigned add(const CollisionSphere &sphere);
+
+        /**
+         * Returns the number of spheres in the batch.
+         */
+        unsigned size() const
+        {
+            return (unsigned)x.size();
+        }
     };
 
     /**
@@ -124,6 +292,72 @@ namespace cyclone {
         real offset;
     };
 
+    /**
+     * Holds a single triangle of static world geometry, such as a
+     * triangle from a mesh or heightfield. Like the plane, it isn't
+     * a primitive: the vertices are in world coordinates and there
+     * is no rigid body. Triangles are two sided.
+     *
+     * When triangles are joined into a surface, a primitive touching
+     * one near a shared edge can be pushed out across the edge, even
+     * though the surface carries on flat beyond it. To stop this each
+     * edge can be marked inactive, and the triangle tests won't push
+     * a primitive out across an inactive edge. An edge should only be
+     * active if it is on the boundary of the surface, or the surface
+     * bends away from the primitive there.
+     */
+    struct CollisionTriangle
+    {
+        /**
+         * Holds the corners of the triangle.
+         */
+        Vector3 vertex[3];
+
+        /**
+         * Holds which edges are active, edge i running from vertex i
+         * to the next. The first three bits are for primitives on the
+         * front of the triangle, and the next three for primitives
+         * behind it.
+         */
+        unsigned activeEdges;
+
+        /**
+         * Creates a triangle with all its edges active.
+         */
+        CollisionTriangle()
+        :
+        activeEdges(0x3f)
+        {
+        }
+
+        /**
+         * Returns the unit normal of the triangle, on the side from
+         * which the vertices run anticlockwise.
+         */
+        Vector3 getNormal() const
+        {
+            Vector3 normal =
+                (vertex[1] - vertex[0]) % (vertex[2] - vertex[0]);
+            normal.normalise();
+            return normal;
+        }
+
+        /**
+         * Sets whether the given edge is active, given the far vertex
+         * of the triangle on the other side of it. The edge is active
+         * on the side the surface bends away from, and inactive on
+         * both sides if the surface is flat there.
+         */
+        void setNeighbour(unsigned edge, const Vector3 &opposite);
+
+        /**
+         * Checks if a contact with this triangle may use the given
+         * normal, that is that the normal doesn't point out across an
+         * inactive edge.
+         */
+        bool allowsNormal(const Vector3 &normal) const;
+    };
+
     /**
      * Represents a rigid body that can be treated as an aligned bounding
      * box for collision detection.
@@ -135,6 +369,93 @@ namespace cyclone {
          * Holds the half-sizes of the box along each of its local axes.
          */
         Vector3 halfSize;
+
+    protected:
+        /**
+         * Works out the world bounds from the transform.
+         */
+        virtual void calculateBounds();
+    };
+
+    /**
+     * Represents a rigid body that can be treated as a capsule for
+     * collision detection: all the points within a given radius of a
+     * line segment. The segment runs through the centre of the
+     * primitive along its local Y axis.
+     *
+     * Capsules are a good fit for limbs and other long thin objects,
+     * and the tests between them only need the closest points of
+     * their segments, which is much cheaper than the box tests.
+     */
+    class CollisionCapsule : public CollisionPrimitive
+    {
+    public:
+        /**
+         * The radius of the capsule.
+         */
+        real radius;
+
+        /**
+         * Holds half the length of the segment, so the capsule's total
+         * length is twice this plus twice the radius.
+         */
+        real halfLength;
+
+        /**
+         * Returns one end of the segment in world coordinates: the
+         * positive end if the index is zero and the negative end
+         * otherwise.
+         */
+        Vector3 getEnd(unsigned index) const
+        {
+            Vector3 end = getAxis(1) * halfLength;
+            return index == 0 ? getAxis(3) + end : getAxis(3) - end;
+        }
+
+    protected:
+        /**
+         * Works out the world bounds from the transform.
+         */
+        virtual void calculateBounds();
+    };
+
+    /**
+     * Represents a rigid body that can be treated as a convex hull
+     * for collision detection. The hull is the smallest convex shape
+     * holding all of the given vertices, so they can be in any
+     * order, and vertices inside the hull do no harm other than
+     * slowing the tests down.
+     *
+     * Hulls are tested against other primitives using the general
+     * convex tests in collide_convex.h, and against planes with
+     * CollisionDetector::hullAndHalfSpace.
+     */
+    class CollisionConvexHull : public CollisionPrimitive
+    {
+    public:
+        /**
+         * Holds the vertices of the hull, in the primitive's own
+         * coordinates.
+         */
+        std::vector<Vector3> vertices;
+
+        /**
+         * Returns the vertex furthest along the given direction,
+         * with both in the primitive's own coordinates.
+         */
+        Vector3 getSupport(const Vector3 &direction) const;
+
+        /**
+         * Returns the distance of the furthest vertex from the
+         * primitive's origin.
+         */
+        real getRadius() const;
+
+    protected:
+        /**
+         * Works out the world bounds from the transform.
+         */
+        virtual void calculateBounds();
     };
 
     /**
@@ -158,6 +479,14 @@ namespace cyclone {
             const CollisionBox &one,
             const CollisionBox &two);
 
+        /**
+         * Checks if the sphere reaches the point in the box closest
+         * to its centre.
+         */
+        static bool boxAndSphere(
+            const CollisionBox &box,
+            const CollisionSphere &sphere);
+
         /**
          * Does an intersection test on an arbitrarily aligned box and a
          * half-space.
@@ -175,6 +504,288 @@ namespace cyclone {
             const CollisionPlane &plane);
     };
 
+    /**
+     * Records a primitive starting or stopping overlapping a
+     * trigger.
+     */
+    struct TriggerEvent
+    {
+        /**
+         * Identifies whether the primitive entered or left the
+         * trigger.
+         */
+        enum Type
+        {
+            TRIGGER_ENTER,
+            TRIGGER_EXIT
+        };
+
+        /**
+         * Holds the trigger.
+         */
+        CollisionPrimitive *trigger;
+
+        /**
+         * Holds the primitive that entered or left it.
+         */
+        CollisionPrimitive *other;
+
+        Type type;
+    };
+
+    /**
+     * Keeps track of the primitives overlapping each trigger from
+     * frame to frame, and gathers the frame's enter and exit events
+     * into a single list, so they can be handled in one pass.
+     *
+     * To use it, call begin at the start of the frame, add each
+     * overlap found during the frame once, then call finish to
+     * generate the events. A primitive that was deleted while inside
+     * a trigger is still reported as leaving it, so the primitives
+     * in exit events shouldn't be used, only compared.
+     */
+    class TriggerEventBuffer
+    {
+    public:
+        typedef std::pair<CollisionPrimitive*, CollisionPrimitive*> Overlap;
+
+    protected:
+        /**
+         * Holds the overlaps added this frame, in the order they
+         * were added.
+         */
+        std::vector<Overlap> overlaps;
+
+        /**
+         * Holds the overlaps from the last frame, in the order they
+         * were added.
+         */
+        std::vector<Overlap> lastOverlaps;
+
+        /**
+         * Holds sorted copies of the two lists above, so overlaps can
+         * be looked up quickly.
+         */
+        std::vector<Overlap> sorted;
+        std::vector<Overlap> lastSorted;
+
+        /**
+         * Holds the events generated by the last call to finish.
+         */
+        std::vector<TriggerEvent> events;
+
+    public:
+        /**
+         * Starts a new frame, with no overlaps.
+         */
+        void begin();
+
+        /**
+         * Records that the given primitive overlaps the given trigger
+         * this frame.
+         */
+        void addOverlap(CollisionPrimitive *trigger,
+                        CollisionPrimitive *other)
+        {
+            overlaps.push_back(Overlap(trigger, other));
+        }
+
+        /**
+         * Compares this frame's overlaps with the last frame's,
+         * generating an exit event for each overlap that has ended,
+         * in the order they were added last frame, followed by an
+         * enter event for each new overlap, in the order they were
+         * added this frame.
+         */
+        void finish();
+
+        /**
+         * Returns the events generated by the last call to finish.
+         */
+        const std::vector<TriggerEvent>& getEvents() const
+        {
+            return events;
+        }
+
+        /**
+         * Returns the overlaps added this frame, as trigger and
+         * primitive pairs.
+         */
+        const std::vector<Overlap>& getOverlaps() const
+        {
+            return overlaps;
+        }
+
+        /**
+         * Checks if the given primitive overlapped the given trigger
+         * in the frame last finished.
+         */
+        bool isOverlapping(CollisionPrimitive *trigger,
+                           CollisionPrimitive *other) const;
+
+        /**
+         * Removes all the overlaps and events, without reporting any
+         * exits.
+         */
+        void clear();
+    };
+
+
+    struct CollisionData;
+
+    /**
+     * Holds the storage for the contacts generated each frame,
+     * growing it as needed so contacts aren't lost when a frame
+     * generates more than expected.
+     *
+     * Contacts are written into a main block. If it fills up during
+     * a frame, further contacts go into extra chunks, so contacts
+     * that have already been written never move while contact
+     * generation is running. When generation finishes the chunks
+     * are joined into a single larger main block, so the resolver
+     * gets one array and the next frame has room for them all from
+     * the start. Once the main block is big enough for the scene, no
+     * more memory is allocated.
+     *
+     * To use it, call begin at the start of contact generation and
+     * finish at the end, then resolve the contacts in the collision
+     * data as usual.
+     */
+    class ContactBuffer
+    {
+    protected:
+        /**
+         * Holds one block of contacts.
+         */
+        struct Chunk
+        {
+            Contact *contacts;
+            unsigned capacity;
+            unsigned used;
+        };
+
+        /**
+         * Holds the blocks in use. The first is the main block, and
+         * any others were added during the current frame.
+         */
+        std::vector<Chunk> chunks;
+
+        /**
+         * Holds the smallest number of contacts to add at a time.
+         */
+        unsigned chunkSize;
+
+        /**
+         * Holds the most contacts the buffer will hold, or zero if
+         * there is no limit.
+         */
+        unsigned maxContacts;
+
+        /**
+         * Holds the number of contacts in the chunks before the one
+         * currently being written.
+         */
+        unsigned chunkStart;
+
+        /**
+         * Holds the number of frames that needed extra chunks.
+         */
+        unsigned overflowFrames;
+
+        /**
+         * Holds the number of times more room was asked for but
+         * couldn't be given, because of the maximum.
+         */
+        unsigned refusedRequests;
+
+        /**
+         * Holds the most contacts generated in a frame.
+         */
+        unsigned peakContacts;
+
+        /**
+         * Deletes any chunks after the main block.
+         */
+        void releaseChunks();
+
+    private:
+        // The buffer owns its memory, so it can't be copied.
+        ContactBuffer(const ContactBuffer &);
+        ContactBuffer& operator=(const ContactBuffer &);
+
+    public:
+        /**
+         * Creates a buffer with room for the given number of contacts
+         * to start with. It grows by at least chunkSize contacts at a
+         * time, up to the given maximum (zero means no maximum).
+         */
+        ContactBuffer(unsigned initialCapacity = 256,
+                      unsigned chunkSize = 256,
+                      unsigned maxContacts = 0);
+
+        /**
+         * Deletes the buffer and all its contacts.
+         */
+        ~ContactBuffer();
+
+        /**
+         * Resets the given collision data to write into this buffer
+         * from the start of the main block.
+         */
+        void begin(CollisionData *data);
+
+        /**
+         * Gives the collision data a new chunk with room for at least
+         * the given number of contacts. Any room left in the current
+         * chunk is abandoned. This is called by the collision data
+         * when it runs out of room. Returns false, leaving the data
+         * unchanged, if the maximum would be exceeded.
+         */
+        bool grow(CollisionData *data, unsigned minimum = 1);
+
+        /**
+         * Joins this frame's contacts into the main block, growing it
+         * if needed, and points the collision data's contact array at
+         * them. Contacts written into extra chunks move, so pointers
+         * to them taken during generation are no longer valid.
+         */
+        void finish(CollisionData *data);
+
+        /**
+         * Returns the number of contacts the main block can hold.
+         */
+        unsigned getCapacity() const
+        {
+            return chunks[0].capacity;
+        }
+
+        /**
+         * Returns the number of frames whose contacts didn't fit in
+         * the main block, causing it to grow.
+         */
+        unsigned getOverflowFrames() const
+        {
+            return overflowFrames;
+        }
+
+        /**
+         * Returns the number of times room for contacts was refused
+         * because the buffer had reached its maximum. Each refusal
+         * loses at least one contact.
+         */
+        unsigned getRefusedRequests() const
+        {
+            return refusedRequests;
+        }
+
+        /**
+         * Returns the most contacts generated in a single frame.
+         */
+        unsigned getPeakContacts() const
+        {
+            return peakContacts;
+        }
+    };
 
     /**
      * A helper structure that contains information for the detector to use
@@ -211,13 +822,56 @@ namespace cyclone {
          */
         real tolerance;
 
+        /**
+         * Holds how far apart two primitives can be and still have
+         * contacts generated. These are speculative contacts: their
+         * penetration is negative, giving the gap between the
+         * primitives, and the resolver only stops the primitives
+         * closing faster than would take up the gap in one frame. It
+         * is zero by default, so only touching primitives have
+         * contacts. The collision pipeline sets it for each test when
+         * its speculative contacts are turned on.
+         */
+        real margin;
+
+        /**
+         * Holds the buffer that gives more room when the contact
+         * array fills up, or NULL if the array is a fixed size.
+         */
+        ContactBuffer *buffer;
+
+        /**
+         * Creates an empty collision data structure with no contact
+         * array.
+         */
+        CollisionData()
+        :
+        contactArray(NULL), contacts(NULL), contactsLeft(0),
+        contactCount(0), friction(0), restitution(0), tolerance(0),
+        margin(0), buffer(NULL)
+        {
+        }
+
         /**
          * Checks if there are more contacts available in the contact
-         * data.
+         * data. If the array is full and there is a buffer, the
+         * buffer is asked for more room.
          */
         bool hasMoreContacts()
         {
-            return contactsLeft > 0;
+            return contactsLeft > 0 || (buffer && buffer->grow(this));
+        }
+
+        /**
+         * Tries to make sure there is room for the given number of
+         * contacts in a row, asking the buffer for more room if
+         * needed. Returns false if there isn't room for them all,
+         * though there may still be room for some.
+         */
+        bool reserveContacts(unsigned count)
+        {
+            if (contactsLeft >= (int)count) return true;
+            return buffer && buffer->grow(this, count);
         }
 
         /**
@@ -245,6 +899,97 @@ namespace cyclone {
         }
     };
 
+    /**
+     * Remembers which axis last separated each pair of boxes, so the
+     * next test on the pair can try that axis first. Boxes that
+     * nearly touch in a pile tend to stay apart along the same axis
+     * from frame to frame, so most of these tests then finish after
+     * checking a single axis rather than all fifteen.
+     *
+     * The axes are kept in a small hash table keyed by the pair of
+     * boxes. A remembered axis is only ever a hint, as the test
+     * checks it before trusting it, so a stale entry (for example
+     * after a box is deleted and its address reused) does no harm.
+     * Call nextFrame once per frame so entries for pairs that are no
+     * longer tested can be dropped.
+     */
+    class SeparatingAxisCache
+    {
+    public:
+        /**
+         * The value held for a pair with no remembered axis.
+         */
+        enum { NO_AXIS = 0xff };
+
+    protected:
+        /**
+         * Holds the axis for a single pair.
+         */
+        struct Entry
+        {
+            const CollisionBox *one;
+            const CollisionBox *two;
+            unsigned axis;
+            unsigned lastFrame;
+        };
+
+        /**
+         * Holds the hash table, whose size is always a power of two.
+         * Empty slots have no boxes.
+         */
+        std::vector<Entry> entries;
+
+        /**
+         * Holds the number of slots in use.
+         */
+        unsigned count;
+
+        /**
+         * Holds the number of calls to nextFrame so far.
+         */
+        unsigned frame;
+
+        /**
+         * Rebuilds the table with the given number of slots, keeping
+         * only the entries used in this frame or the last.
+         */
+        void rehash(unsigned capacity);
+
+    public:
+        /**
+         * Creates an empty cache.
+         */
+        SeparatingAxisCache();
+
+        /**
+         * Returns the axis slot for the given pair of boxes, creating
+         * it (holding NO_AXIS) if needed. The slot is only valid until
+         * the next call to find. The boxes should always be given in
+         * the same order.
+         */
+        unsigned& find(const CollisionBox *one, const CollisionBox *two);
+
+        /**
+         * Moves on to the next frame, dropping the entries that
+         * weren't used in the last two frames once the table gets
+         * full.
+         */
+        void nextFrame();
+
+        /**
+         * Removes all the entries.
+         */
+        void clear();
+
+        /**
+         * Returns the number of pairs held.
+         */
+        unsigned size() const
+        {
+            return count;
+        }
+    };
+
     /**
      * A wrapper class that holds the fine grained collision detection
      * routines.
@@ -275,21 +1020,79 @@ namespace cyclone {
             CollisionData *data
             );
 
+        /**
+         * Does the sphere and half-space test for every sphere in the
+         * batch against the given plane, writing the contacts in
+         * sphere order. Generation stops when the collision data has
+         * no more room.
+         */
+        static unsigned sphereAndHalfSpaceBatch(
+            const CollisionSphereBatch &spheres,
+            const CollisionPlane &plane,
+            CollisionData *data
+            );
+
+        /**
+         * Does the sphere and true plane test for every sphere in the
+         * batch against the given plane, writing the contacts in
+         * sphere order. Generation stops when the collision data has
+         * no more room.
+         */
+        static unsigned sphereAndTruePlaneBatch(
+            const CollisionSphereBatch &spheres,
+            const CollisionPlane &plane,
+            CollisionData *data
+            );
+
+        /**
+         * Does the sphere and sphere test for a list of pairs of
+         * spheres in the batch. The pairs are given as indices into
+         * the batch, two per pair, and the contacts are written in
+         * pair order. If pairHits isn't NULL, the index of the pair
+         * that generated each contact is written into it, so it needs
+         * room for one entry per pair. Generation stops when the
+         * collision data has no more room.
+         */
+        static unsigned sphereAndSphereBatch(
+            const CollisionSphereBatch &spheres,
+            const unsigned *pairs,
+            unsigned pairCount,
+            CollisionData *data,
+            unsigned *pairHits = NULL
+            );
+
         /**
          * Does a collision test on a collision box and a plane representing
          * a half-space (i.e. the normal of the plane
          * points out of the half-space).
+         *
+         * A contact is generated for each vertex through the plane,
+         * up to eight. If reduce is true, at most four are kept,
+         * chosen to include the deepest vertex and to cover as much
+         * of the box's footprint as possible.
          */
         static unsigned boxAndHalfSpace(
             const CollisionBox &box,
             const CollisionPlane &plane,
-            CollisionData *data
+            CollisionData *data,
+            bool reduce = false
             );
 
+        /**
+         * Does a collision test on two boxes. When a face of one box
+         * is touching the other box, the touching area is found by
+         * clipping, and up to four contacts are generated across it
+         * (fewer if the collision data is short of room). Edge to
+         * edge collisions generate a single contact.
+         *
+         * If a cache is given, the axis that last separated the boxes
+         * is tested first, and the cache is updated with the result.
+         */
         static unsigned boxAndBox(
             const CollisionBox &one,
             const CollisionBox &two,
-            CollisionData *data
+            CollisionData *data,
+            SeparatingAxisCache *cache = NULL
             );
 
         static unsigned boxAndPoint(
@@ -303,6 +1106,146 @@ namespace cyclone {
             const CollisionSphere &sphere,
             CollisionData *data
             );
+
+        /**
+         * Does a collision test on a capsule and a half-space. Each
+         * end of the capsule through the plane generates a contact,
+         * so a capsule lying on the plane gets two.
+         */
+        static unsigned capsuleAndHalfSpace(
+            const CollisionCapsule &capsule,
+            const CollisionPlane &plane,
+            CollisionData *data
+            );
+
+        /**
+         * Does a collision test on a capsule and a sphere, using the
+         * closest point on the capsule's segment to the sphere.
+         */
+        static unsigned capsuleAndSphere(
+            const CollisionCapsule &capsule,
+            const CollisionSphere &sphere,
+            CollisionData *data
+            );
+
+        /**
+         * Does a collision test on two capsules, using the closest
+         * points on their segments. Capsules lying alongside each
+         * other get a contact at each end of the part they share.
+         */
+        static unsigned capsuleAndCapsule(
+            const CollisionCapsule &one,
+            const CollisionCapsule &two,
+            CollisionData *data
+            );
+
+        /**
+         * Does a collision test on a box and a capsule. The point on
+         * the capsule's segment closest to the box is found exactly,
+         * and the ends of the segment generate their own contacts
+         * when they touch the box, so a capsule lying on a box face
+         * gets two contacts. If the segment passes into the box, a
+         * single contact pushes it out through the nearest face.
+         */
+        static unsigned boxAndCapsule(
+            const CollisionBox &box,
+            const CollisionCapsule &capsule,
+            CollisionData *data
+            );
+
+        /**
+         * Does a collision test on a convex hull and a half-space. A
+         * contact is generated for each vertex through the plane,
+         * and if there are more than four, the four covering the
+         * most area are kept, as for boxAndHalfSpace.
+         */
+        static unsigned hullAndHalfSpace(
+            const CollisionConvexHull &hull,
+            const CollisionPlane &plane,
+            CollisionData *data
+            );
+
+        /**
+         * Does a collision test on a sphere and a triangle, using the
+         * closest point on the triangle to the centre of the sphere.
+         */
+        static unsigned sphereAndTriangle(
+            const CollisionSphere &sphere,
+            const CollisionTriangle &triangle,
+            CollisionData *data
+            );
+
+        /**
+         * Does a collision test on a capsule and a triangle. As with
+         * boxAndCapsule, the ends of the capsule generate their own
+         * contacts when they touch the triangle, so a capsule lying
+         * on the triangle gets two.
+         */
+        static unsigned capsuleAndTriangle(
+            const CollisionCapsule &capsule,
+            const CollisionTriangle &triangle,
+            CollisionData *data
+            );
+
+        /**
+         * Does a collision test on a box and a triangle, using the
+         * separating axis test on the triangle's normal, the box's
+         * axes and the nine edge to edge axes. When a face of either
+         * is touching the other, up to four contacts are generated
+         * across the touching area.
+         */
+        static unsigned boxAndTriangle(
+            const CollisionBox &box,
+            const CollisionTriangle &triangle,
+            CollisionData *data
+            );
+    };
+
+    /**
+     * A wrapper class that holds the batched ray casts against
+     * primitives. Each test checks the rays with the given indices
+     * against one primitive, several rays at a time, and replaces
+     * the hit of each ray that reaches the primitive nearer than its
+     * current hit. It returns the number of hits replaced. If the
+     * indices are NULL, the first count rays in the batch are
+     * checked.
+     *
+     * Rays that start inside a primitive don't hit it.
+     */
+    class RayTests
+    {
+    public:
+        static unsigned raysAndSphere(
+            const RayBatch &rays,
+            const unsigned *indices,
+            unsigned count,
+            const CollisionSphere &sphere,
+            RayHit *hits
+            );
+
+        /**
+         * Casts the rays against a box, using the slab test in the
+         * box's coordinates.
+         */
+        static unsigned raysAndBox(
+            const RayBatch &rays,
+            const unsigned *indices,
+            unsigned count,
+            const CollisionBox &box,
+            RayHit *hits
+            );
+
+        /**
+         * Casts the rays against the surface of a half-space. Rays
+         * that start behind the plane don't hit it.
+         */
+        static unsigned raysAndHalfSpace(
+            const RayBatch &rays,
+            const unsigned *indices,
+            unsigned count,
+            const CollisionPlane &plane,
+            RayHit *hits
+            );
     };
 
 
@@ -0,0 +1,352 @@
+/*
+ * Interface file for the static mesh collision detection system.
+ *
+ * Part of the Cyclone physics system.
+ *
+ * Copyright (c) Icosagon 2003. All Rights Reserved.
+ *
+ * This software is distributed under licence. Use of this software
+ * implies agreement with all terms and conditions of the accompanying
+ * software licence.
+ */
+
+/**
+ * @file
+ *
+ * This file contains collision detection against static world
+ * geometry made of triangles: triangle meshes and heightfields.
+ *
+ * Testing a primitive against every triangle would be far too slow
+ * for a level of any size, so each kind of geometry has its own way
+ * of finding the triangles near a region (the midphase). Meshes keep
+ * a bounding volume hierarchy over their triangles, and heightfields
+ * look up the grid cells under the region directly. Only the
+ * triangles found are passed to the fine grained triangle tests in
+ * CollisionDetector.
+ */
+#ifndef CYCLONE_COLLISION_MESH_H
+#define CYCLONE_COLLISION_MESH_H
+
+#include "collide_coarse.h"
+#include "collide_fine.h"
+
+namespace cyclone {
+
+    /**
+     * Represents static world geometry made of triangles. Like the
+     * plane, the mesh doesn't have a rigid body: the vertices are
+     * given in world coordinates.
+     *
+     * Set the vertices and the indices of the triangle corners, then
+     * call build to make the hierarchy the collision tests use. Call
+     * build again if the vertices or indices are changed.
+     *
+     * Building also finds the edges shared by two triangles, so that
+     * primitives aren't pushed out across edges where the mesh is
+     * flat or bends towards them. Triangles are only found to share
+     * an edge if they use the same vertex indices for it.
+     */
+    class CollisionTriangleMesh
+    {
+    protected:
+        /**
+         * Holds a node of the hierarchy. Leaf nodes hold a range of
+         * the triangle order, and other nodes hold the index of their
+         * first child, with the second child straight after it.
+         */
+        struct Node
+        {
+            BoundingBox volume;
+            unsigned first;
+            unsigned count;
+
+            Node()
+            :
+            volume(Vector3(), Vector3()), first(0), count(0)
+            {
+            }
+        };
+
+        /**
+         * Holds the nodes of the hierarchy, with the root first.
+         */
+        std::vector<Node> nodes;
+
+        /**
+         * Holds the triangle indices in the order the leaves use them.
+         */
+        std::vector<unsigned> order;
+
+        /**
+         * Holds the centre of each triangle's bounds, used while
+         * building.
+         */
+        std::vector<Vector3> centres;
+
+        /**
+         * Holds the active edges of each triangle.
+         */
+        std::vector<unsigned> activeEdges;
+
+        /**
+         * Works out which edges of each triangle are active, from
+         * the triangles sharing them.
+         */
+        void findActiveEdges();
+
+        /**
+         * Builds the node at the given index over the given range of
+         * the triangle order, and its children.
+         */
+        void buildNode(unsigned node, unsigned first, unsigned count);
+
+    public:
+        /**
+         * Holds the vertices of the mesh, in world coordinates.
+         */
+        std::vector<Vector3> vertices;
+
+        /**
+         * Holds three indices into the vertices for each triangle.
+         */
+        std::vector<unsigned> indices;
+
+        /**
+         * Builds the hierarchy over the triangles, and works out
+         * their active edges.
+         */
+        void build();
+
+        /**
+         * Returns the number of triangles in the mesh.
+         */
+        unsigned getTriangleCount() const
+        {
+            return (unsigned)indices.size() / 3;
+        }
+
+        /**
+         * Returns the triangle with the given index.
+         */
+        CollisionTriangle getTriangle(unsigned index) const
+        {
+            CollisionTriangle triangle;
+            for (unsigned i = 0; i < 3; i++)
+            {
+                triangle.vertex[i] = vertices[indices[index*3 + i]];
+            }
+            if (index < activeEdges.size())
+            {
+                triangle.activeEdges = activeEdges[index];
+            }
+            return triangle;
+        }
+
+        /**
+         * Calls the given visitor with each triangle whose bounds
+         * overlap the given region. The visitor is called as a
+         * function taking the triangle.
+         */
+        template<class Visitor>
+        void visitTriangles(const BoundingBox &region, Visitor &visitor) const
+        {
+            if (nodes.empty()) return;
+
+            unsigned stack[64];
+            unsigned stackSize = 0;
+            stack[stackSize++] = 0;
+            while (stackSize > 0)
+            {
+                const Node &node = nodes[stack[--stackSize]];
+                if (!node.volume.overlaps(&region)) continue;
+
+                if (node.count > 0)
+                {
+                    for (unsigned i = 0; i < node.count; i++)
+                    {
+                        visitor(getTriangle(order[node.first + i]));
+                    }
+                }
+                else
+                {
+                    stack[stackSize++] = node.first + 1;
+                    stack[stackSize++] = node.first;
+                }
+            }
+        }
+    };
+
+    /**
+     * Represents static ground made from a regular grid of heights.
+     * The grid lies along the X and Z axes, starting at the origin
+     * and going up in X by the spacing for each column, and in Z for
+     * each row. Each grid cell is split into two triangles.
+     *
+     * The grid itself is the midphase: the cells under a region are
+     * found directly from its extent, and cells entirely above or
+     * below the region are skipped. The active edges of each
+     * triangle are worked out from its neighbours as it is visited.
+     */
+    class CollisionHeightfield
+    {
+    public:
+        /**
+         * Holds the position of the corner of the first cell.
+         */
+        Vector3 origin;
+
+        /**
+         * Holds the number of heights along X and along Z.
+         */
+        unsigned columns;
+        unsigned rows;
+
+        /**
+         * Holds the distance between heights along X and along Z.
+         */
+        real spacingX;
+        real spacingZ;
+
+        /**
+         * Holds the heights, a row at a time, relative to the origin.
+         */
+        std::vector<real> heights;
+
+        /**
+         * Creates an empty heightfield.
+         */
+        CollisionHeightfield()
+        :
+        columns(0), rows(0), spacingX(1), spacingZ(1)
+        {
+        }
+
+        /**
+         * Returns the height at the given column and row, relative
+         * to the origin.
+         */
+        real getHeight(unsigned column, unsigned row) const
+        {
+            return heights[row * columns + column];
+        }
+
+        /**
+         * Returns the world position of the given grid point.
+         */
+        Vector3 getPoint(unsigned column, unsigned row) const
+        {
+            return origin + Vector3(
+                column * spacingX,
+                getHeight(column, row),
+                row * spacingZ
+                );
+        }
+
+        /**
+         * Calls the given visitor with each triangle in the cells
+         * under the given region, skipping cells that are entirely
+         * above or below it.
+         */
+        template<class Visitor>
+        void visitTriangles(const BoundingBox &region, Visitor &visitor) const
+        {
+            if (columns < 2 || rows < 2) return;
+
+            // Find the range of cells under the region.
+            int firstColumn, lastColumn, firstRow, lastRow;
+            if (!findCells(region, &firstColumn, &lastColumn,
+                &firstRow, &lastRow)) return;
+
+            real low = region.centre.y - region.halfSize.y - origin.y;
+            real high = region.centre.y + region.halfSize.y - origin.y;
+            for (int row = firstRow; row <= lastRow; row++)
+            {
+                for (int column = firstColumn; column <= lastColumn; column++)
+                {
+                    real h[4] = {
+                        getHeight(column, row),
+                        getHeight(column + 1, row),
+                        getHeight(column, row + 1),
+                        getHeight(column + 1, row + 1)
+                    };
+                    real cellLow = h[0], cellHigh = h[0];
+                    for (unsigned i = 1; i < 4; i++)
+                    {
+                        if (h[i] < cellLow) cellLow = h[i];
+                        if (h[i] > cellHigh) cellHigh = h[i];
+                    }
+                    if (cellLow > high || cellHigh < low) continue;
+
+                    visitor(getTriangle(column, row, 0));
+                    visitor(getTriangle(column, row, 1));
+                }
+            }
+        }
+
+        /**
+         * Returns one of the two triangles of the given cell, with
+         * its active edges set. The first triangle has the cell's
+         * first corner, and the second the corner opposite it.
+         */
+        CollisionTriangle getTriangle(unsigned column, unsigned row,
+            unsigned half) const;
+
+        /**
+         * Finds the range of cells under the given region, returning
+         * false if there are none.
+         */
+        bool findCells(const BoundingBox &region,
+            int *firstColumn, int *lastColumn,
+            int *firstRow, int *lastRow) const;
+    };
+
+    /**
+     * A wrapper class that holds the collision tests between
+     * primitives and static triangle geometry. Each test finds the
+     * triangles near the primitive and runs the matching triangle
+     * test from CollisionDetector on each, stopping when the
+     * collision data has no more room.
+     */
+    class MeshTests
+    {
+    public:
+        static unsigned sphereAndMesh(
+            const CollisionSphere &sphere,
+            const CollisionTriangleMesh &mesh,
+            CollisionData *data
+            );
+
+        static unsigned boxAndMesh(
+            const CollisionBox &box,
+            const CollisionTriangleMesh &mesh,
+            CollisionData *data
+            );
+
+        static unsigned capsuleAndMesh(
+            const CollisionCapsule &capsule,
+            const CollisionTriangleMesh &mesh,
+            CollisionData *data
+            );
+
+        static unsigned sphereAndHeightfield(
+            const CollisionSphere &sphere,
+            const CollisionHeightfield &heightfield,
+            CollisionData *data
+            );
+
+        static unsigned boxAndHeightfield(
+            const CollisionBox &box,
+            const CollisionHeightfield &heightfield,
+            CollisionData *data
+            );
+
+        static unsigned capsuleAndHeightfield(
+            const CollisionCapsule &capsule,
+            const CollisionHeightfield &heightfield,
+            CollisionData *data
+            );
+    };
+
+} // namespace cyclone
+
+#endif // CYCLONE_COLLISION_MESH_H
@@ -0,0 +1,844 @@
+/*
+ * Interface file for the collision pipeline.
+ *
+ * Part of the Cyclone physics system.
+ *
+ * Copyright (c) Icosagon 2003. All Rights Reserved.
+ *
+ * This software is distributed under licence. Use of this software
+ * implies agreement with all terms and conditions of the accompanying
+ * software licence.
+ */
+
+/**
+ * @file
+ *
+ * This file contains the collision pipeline, which ties the coarse
+ * and fine collision detection systems together. Primitives are
+ * registered once, and each frame the pipeline finds the pairs that
+ * might be touching using a bounding volume hierarchy, then calls the
+ * right fine grained test for each pair depending on the types of
+ * primitive involved.
+ */
+#ifndef CYCLONE_COLLISION_PIPELINE_H
+#define CYCLONE_COLLISION_PIPELINE_H
+
+#include <map>
+#include <set>
+#include "collide_coarse.h"
+#include "collide_fine.h"
+#include "collide_convex.h"
+#include "collide_mesh.h"
+#include "collide_continuous.h"
+
+namespace cyclone {
+
+    class CollisionCompound;
+
+    /**
+     * Records a pair of primitives that generated contacts in the
+     * last call to CollisionPipeline::generateContacts, along with
+     * where those contacts were written in the collision data.
+     */
+    struct CollisionPair
+    {
+        /**
+         * Holds the two primitives, in the order they were passed to
+         * the fine grained collision test.
+         */
+        CollisionPrimitive *primitive[2];
+
+        /**
+         * Holds the index of the first contact generated for this pair.
+         */
+        unsigned firstContact;
+
+        /**
+         * Holds the number of contacts generated for this pair.
+         */
+        unsigned contactCount;
+    };
+
+    /**
+     * Manages a set of collision primitives and generates the contacts
+     * between them each frame.
+     *
+     * Contact generation runs in three parts. The primitives are
+     * grouped by rigid body, and a bounding sphere hierarchy is built
+     * over the bodies. The hierarchy reports the pairs of bodies whose
+     * bounding spheres overlap. Each primitive of one body in a pair is
+     * then tested against each primitive of the other, using the
+     * CollisionDetector test for their types. Finally every primitive
+     * is tested against the registered planes, meshes and
+     * heightfields.
+     *
+     * Speculative contacts can be turned on with setSpeculativeTime.
+     * Each pair of bodies then gets contacts if they are within the
+     * collision data's tolerance plus as far as they could move
+     * towards each other in that time, even if they aren't touching.
+     * Contacts for pairs that are apart have a negative penetration,
+     * and the resolver stops them closing past each other rather
+     * than pushing them apart, so fast bodies don't pass through
+     * each other between frames, and a longer timestep can be used.
+     *
+     * Compound primitives take part in the hierarchy as a single
+     * volume. When a pair involves a compound, only the children
+     * whose bounds overlap the other primitive are tested, and the
+     * pairs recorded are between the children.
+     *
+     * The world bounds of the primitives, worked out by
+     * calculateInternals, are used as a cheap check before the more
+     * expensive tests. Each pair of bodies reported by the hierarchy
+     * has its bounds checked before its primitives are tested, and
+     * each pair of primitives has its bounds checked before its fine
+     * grained test.
+     *
+     * Pairs can be kept apart with the category and mask of each
+     * primitive, and pairs of bodies, such as the bones of a ragdoll
+     * joined to each other, can be ignored altogether. Ignored body
+     * pairs, and body pairs none of whose primitives could collide,
+     * are dropped by the hierarchy before they are reported. The
+     * remaining primitive pairs are checked against each other's
+     * masks before their fine grained test. The planes, meshes and
+     * heightfields are not filtered.
+     *
+     * Primitives marked as triggers don't generate contacts. Each
+     * primitive pair involving a trigger gets an intersection test
+     * instead, and the overlaps found are passed to the pipeline's
+     * trigger event buffer, which reports the primitives entering
+     * and leaving each trigger.
+     *
+     * The pipeline does not update the primitives: call
+     * calculateInternals on each primitive after its body moves, as
+     * you would before calling the CollisionDetector directly.
+     * Primitives must have a rigid body, and primitives attached to
+     * the same body are never tested against each other.
+     */
+    class CollisionPipeline
+    {
+    public:
+        /**
+         * Identifies the type of a registered primitive, so the
+         * pipeline knows which fine grained test to use.
+         */
+        enum PrimitiveType
+        {
+            PRIMITIVE_SPHERE,
+            PRIMITIVE_BOX,
+            PRIMITIVE_CAPSULE,
+            PRIMITIVE_HULL,
+            PRIMITIVE_COMPOUND,
+
+            /**
+             * The number of types above, for combining a pair of
+             * types into a single case.
+             */
+            PRIMITIVE_TYPE_COUNT
+        };
+
+    protected:
+        /**
+         * Holds a single primitive with its type.
+         */
+        struct PrimitiveRegistration
+        {
+            CollisionPrimitive *primitive;
+            PrimitiveType type;
+        };
+
+        typedef std::vector<PrimitiveRegistration> Registry;
+
+        /**
+         * Holds the registered primitives.
+         */
+        Registry primitives;
+
+        /**
+         * Holds the registered planes.
+         */
+        std::vector<CollisionPlane*> planes;
+
+        /**
+         * Holds the registered triangle meshes and heightfields.
+         */
+        std::vector<const CollisionTriangleMesh*> meshes;
+        std::vector<const CollisionHeightfield*> heightfields;
+
+        /**
+         * Holds the primitives for a single body, as a range in the
+         * bodyPrimitives list.
+         */
+        struct BodyRecord
+        {
+            RigidBody *body;
+            unsigned firstPrimitive;
+            unsigned primitiveCount;
+
+            /**
+             * Holds how far the body's primitives can move in the
+             * speculative time, or zero if speculative contacts are
+             * off.
+             */
+            real margin;
+
+            /**
+             * Holds the categories of all the body's primitives
+             * together, and their masks together.
+             */
+            unsigned category;
+            unsigned mask;
+
+            /**
+             * Holds the world bounds of all the body's primitives
+             * together.
+             */
+            BoundingBox bounds;
+
+            BodyRecord()
+            :
+            bounds(Vector3(), Vector3())
+            {
+            }
+        };
+
+        /**
+         * Holds one record per body, in the order the body first
+         * appears in the registry. Rebuilt each frame.
+         */
+        std::vector<BodyRecord> bodies;
+
+        /**
+         * Holds indices into the registry, grouped by body. Rebuilt
+         * each frame.
+         */
+        std::vector<unsigned> bodyPrimitives;
+
+        /**
+         * Holds the bodies sorted by address along with their record
+         * index, so that a body from a potential contact can be
+         * looked up quickly. Rebuilt each frame.
+         */
+        std::vector< std::pair<RigidBody*, unsigned> > bodyLookup;
+
+        /**
+         * Holds the bodies found near a sweep, kept between sweeps so
+         * that it doesn't allocate each time. Because of this, only
+         * one sweep should run at a time.
+         */
+        mutable std::vector<RigidBody*> sweptBodies;
+
+        /**
+         * Holds the bounding volume hierarchy over the bodies.
+         */
+        BVHNode<BoundingSphere> *root;
+
+        typedef std::pair<RigidBody*, RigidBody*> BodyPair;
+
+        /**
+         * Holds the pairs of bodies that are never tested against
+         * each other, with the body with the lower address first.
+         */
+        std::set<BodyPair> ignoredPairs;
+
+        /**
+         * Is set by buildHierarchy if any pair of bodies needs its
+         * categories and masks, or the ignored pairs, checked by the
+         * body filter.
+         */
+        bool filtering;
+
+        /**
+         * Drops the pairs of bodies that are ignored, or whose
+         * primitives can't collide, from the broadphase. It is only
+         * used when filtering is set.
+         */
+        struct BodyFilter;
+
+        /**
+         * Holds the threads used to search the hierarchy and run the
+         * fine grained tests.
+         */
+        WorkerPool pool;
+
+        /**
+         * Holds the time ahead that speculative contacts look, or zero
+         * if they are off.
+         */
+        real speculativeTime;
+
+        /**
+         * Holds the tolerance of the collision data given to the last
+         * call to generateContacts, which the hierarchy allows for
+         * when speculative contacts are on.
+         */
+        real tolerance;
+
+        /**
+         * Holds the body pairs reported by the hierarchy. The buffer
+         * is kept between frames and grows as needed.
+         */
+        std::vector<PotentialContact> potentialContacts;
+
+        /**
+         * Keeps track of the body pairs from frame to frame.
+         */
+        PairManager pairManager;
+
+        /**
+         * Holds the primitive pairs that generated contacts in the
+         * last call to generateContacts.
+         */
+        std::vector<CollisionPair> collisionPairs;
+
+        /**
+         * Holds the overlaps between triggers and other primitives,
+         * and the events they generated in the last call to
+         * generateContacts.
+         */
+        TriggerEventBuffer triggerEvents;
+
+        /**
+         * Holds copies of the registered spheres, so sphere-sphere and
+         * sphere-plane tests can be done in batches. Rebuilt each
+         * frame.
+         */
+        CollisionSphereBatch sphereBatch;
+
+        /**
+         * Holds the registry index of each sphere in the batch.
+         */
+        std::vector<unsigned> sphereRegistrations;
+
+        /**
+         * Holds the batch index of each registered primitive (only
+         * meaningful for spheres).
+         */
+        std::vector<unsigned> sphereSlots;
+
+        /**
+         * Holds the simplex cache for a pair of primitives tested with
+         * the general convex tests, along with the last frame it was
+         * used in.
+         */
+        struct CachedSimplex
+        {
+            ConvexCache cache;
+            unsigned lastFrame;
+        };
+
+        typedef std::pair<const CollisionPrimitive*,
+            const CollisionPrimitive*> PrimitivePair;
+
+        typedef std::map<PrimitivePair, CachedSimplex> ConvexCacheMap;
+
+        /**
+         * Holds one run of the body pairs found by the broadphase,
+         * along with what the fine grained tests need for it.
+         *
+         * The runs are the same size whether the tests are run on one
+         * thread or several, and the same pair usually falls in the
+         * same run from frame to frame. Each run keeps its own caches,
+         * so they can be used without locking and still hit. When the
+         * tests run on several threads each task also writes into its
+         * own collision data, and the tasks are joined in order
+         * afterwards. The contact indices of its collision pairs are
+         * relative to its own contacts until then.
+         */
+        struct NarrowphaseTask
+        {
+            unsigned firstPair;
+            unsigned pairCount;
+
+            /**
+             * Holds the simplex caches for the primitive pairs tested
+             * with the general convex tests. Caches not used in a
+             * frame are dropped at the start of the next.
+             */
+            ConvexCacheMap convexCaches;
+
+            /**
+             * Holds the axis that last separated each pair of boxes.
+             */
+            SeparatingAxisCache axisCache;
+
+            /**
+             * Holds the sphere-sphere pairs waiting for the batched
+             * test, as two batch indices per pair, and the pairs that
+             * hit.
+             */
+            std::vector<unsigned> spherePairs;
+            std::vector<unsigned> sphereHits;
+
+            /**
+             * Holds the results of the task when it is run on its own
+             * thread.
+             */
+            ContactBuffer buffer;
+            CollisionData data;
+            std::vector<CollisionPair> collisionPairs;
+            std::vector<TriggerEventBuffer::Overlap> overlaps;
+
+            NarrowphaseTask()
+            :
+            buffer(32, 64)
+            {
+            }
+        };
+
+        /**
+         * Holds the tasks for the fine grained tests. They are kept
+         * between frames, so their caches and memory are reused.
+         */
+        std::vector<NarrowphaseTask*> narrowphaseTasks;
+
+        /**
+         * Holds where the fine grained tests record what they find
+         * other than contacts, the pairs that generated contacts and
+         * the trigger overlaps, along with the task whose caches they
+         * use.
+         */
+        struct NarrowphaseOutput
+        {
+            std::vector<CollisionPair> *collisionPairs;
+            std::vector<TriggerEventBuffer::Overlap> *overlaps;
+            NarrowphaseTask *task;
+        };
+
+        /**
+         * Holds the overlaps found by the fine grained tests, before
+         * they are added to the trigger events.
+         */
+        std::vector<TriggerEventBuffer::Overlap> triggerOverlaps;
+
+        /**
+         * Holds the state shared by the threads running the fine
+         * grained tests.
+         */
+        struct NarrowphaseJob
+        {
+            CollisionPipeline *pipeline;
+            unsigned taskCount;
+            std::atomic<unsigned> nextTask;
+        };
+
+        /**
+         * Takes tasks from the given job until there are none left,
+         * running each into its own collision data.
+         */
+        static void runNarrowphaseTasks(void *job, unsigned worker);
+
+        /**
+         * Holds the number of calls to generateContacts so far.
+         */
+        unsigned frame;
+
+        /**
+         * Adds a primitive of the given type.
+         */
+        void add(CollisionPrimitive *primitive, PrimitiveType type);
+
+        /**
+         * Works out a bounding sphere for the given primitive.
+         */
+        static BoundingSphere getBoundingSphere(
+            const PrimitiveRegistration &registration);
+
+        /**
+         * Groups the primitives by body and rebuilds the bounding
+         * volume hierarchy.
+         */
+        void buildHierarchy();
+
+        /**
+         * Finds the record index for the given body.
+         */
+        unsigned findBody(RigidBody *body) const;
+
+        /**
+         * Creates the key for the given bodies, in address order.
+         */
+        static BodyPair makeBodyPair(RigidBody *one, RigidBody *two);
+
+        /**
+         * Returns the registered primitive wrapped with the support
+         * function for its type.
+         */
+        static ConvexShape getConvexShape(
+            const PrimitiveRegistration &registration);
+
+        /**
+         * Returns the simplex cache for the given pair of primitives
+         * from the given task, creating it if needed.
+         */
+        ConvexCache* getConvexCache(NarrowphaseTask *task,
+            const CollisionPrimitive *one,
+            const CollisionPrimitive *two) const;
+
+        /**
+         * Makes sure there are at least the given number of tasks.
+         */
+        void reserveNarrowphaseTasks(unsigned count);
+
+        /**
+         * Copies the registered spheres into the sphere batch.
+         */
+        void buildSphereBatch();
+
+        /**
+         * Tests the primitives of each pair of bodies found by the
+         * broadphase against each other.
+         */
+        void collideBodies(CollisionData *data);
+
+        /**
+         * Tests the primitives of the given run of body pairs against
+         * each other, followed by the pairs of spheres put aside for
+         * batching. Triggers are tested even if the collision data
+         * fills up.
+         */
+        void collidePairs(unsigned firstPair,
+            unsigned pairCount,
+            CollisionData *data,
+            const NarrowphaseOutput &output);
+
+        /**
+         * Runs collidePairs for each task on the pipeline's threads,
+         * then copies the tasks' results into the given collision
+         * data in task order.
+         */
+        void collideBodiesInParallel(CollisionData *data);
+
+        /**
+         * Tests the primitives against the planes, meshes and
+         * heightfields.
+         */
+        void collideScenery(CollisionData *data);
+
+        /**
+         * Runs the fine grained test for the given pair of primitives,
+         * recording the pair if it generates any contacts.
+         */
+        void collide(const PrimitiveRegistration &one,
+            const PrimitiveRegistration &two,
+            CollisionData *data,
+            const NarrowphaseOutput &output);
+
+        /**
+         * Runs the intersection test for the given pair of primitives,
+         * at least one of which is a trigger, recording the overlap
+         * if they intersect.
+         */
+        void collideTrigger(const PrimitiveRegistration &one,
+            const PrimitiveRegistration &two,
+            const NarrowphaseOutput &output);
+
+        /**
+         * Runs the fine grained test between the given primitive and
+         * each child of the given compound whose bounds overlap it.
+         */
+        void collideCompound(const PrimitiveRegistration &other,
+            const PrimitiveRegistration &compound,
+            CollisionData *data,
+            const NarrowphaseOutput &output);
+
+        /**
+         * Visits the children of a compound for collideCompound.
+         */
+        struct CompoundVisitor;
+
+        /**
+         * Sweeps the given sphere against the given primitive, keeping
+         * the result if it is earlier than the one given.
+         */
+        static void sweepPrimitive(const PrimitiveRegistration &registration,
+            const CollisionSphere &sphere,
+            const Vector3 &movement,
+            SweepResult *result);
+
+        /**
+         * Sweeps the given convex shape against the given primitive,
+         * keeping the result if it is earlier than the one given.
+         */
+        static void sweepShape(const PrimitiveRegistration &registration,
+            const ConvexShape &shape,
+            const Vector3 &movement,
+            SweepResult *result);
+
+        /**
+         * Adds the bodies that a shape with the given bounding radius
+         * could touch, when moved by the given movement from the
+         * given start, to the given list, using the hierarchy.
+         */
+        void findSweptBodies(const Vector3 &start,
+            const Vector3 &movement,
+            real radius,
+            std::vector<RigidBody*> &found) const;
+
+        /**
+         * Casts the rays with the given indices against the given
+         * primitive.
+         */
+        static void castPrimitive(const PrimitiveRegistration &registration,
+            const RayBatch &rays,
+            const unsigned *indices,
+            unsigned count,
+            RayHit *hits);
+
+        /**
+         * Visits the bodies reached by a ray cast for castRays.
+         */
+        struct RayVisitor;
+
+        /**
+         * Tests the given primitive against the given plane.
+         */
+        static void collidePlane(const PrimitiveRegistration &registration,
+            const CollisionPlane &plane,
+            CollisionData *data);
+
+        /**
+         * Tests the given primitive against the registered meshes and
+         * heightfields.
+         */
+        void collideStatic(const PrimitiveRegistration &registration,
+            CollisionData *data);
+
+    public:
+        /**
+         * Creates a new pipeline with no primitives.
+         */
+        CollisionPipeline();
+
+        /**
+         * Deletes the pipeline. The primitives and static geometry
+         * are not deleted.
+         */
+        ~CollisionPipeline();
+
+        /**
+         * Registers the given sphere.
+         */
+        void addSphere(CollisionSphere *sphere);
+
+        /**
+         * Registers the given box.
+         */
+        void addBox(CollisionBox *box);
+
+        /**
+         * Registers the given capsule.
+         */
+        void addCapsule(CollisionCapsule *capsule);
+
+        /**
+         * Registers the given convex hull. Hulls are tested using the
+         * general convex tests, with the result of each pair's test
+         * kept to speed up the next.
+         */
+        void addHull(CollisionConvexHull *hull);
+
+        /**
+         * Registers the given compound. Its children should not be
+         * registered as well.
+         */
+        void addCompound(CollisionCompound *compound);
+
+        /**
+         * Registers the given plane. Planes are treated as half-spaces
+         * and are tested against every primitive.
+         */
+        void addPlane(CollisionPlane *plane);
+
+        /**
+         * Registers the given triangle mesh, which must already be
+         * built. Meshes are static and are tested against every
+         * primitive near them, except convex hulls, which have no
+         * triangle test.
+         */
+        void addMesh(const CollisionTriangleMesh *mesh);
+
+        /**
+         * Registers the given heightfield. Like meshes, heightfields
+         * are static and are not tested against convex hulls.
+         */
+        void addHeightfield(const CollisionHeightfield *heightfield);
+
+        /**
+         * Removes the given primitive, if it is registered.
+         */
+        void remove(const CollisionPrimitive *primitive);
+
+        /**
+         * Removes the given plane, if it is registered.
+         */
+        void removePlane(const CollisionPlane *plane);
+
+        /**
+         * Removes the given mesh, if it is registered.
+         */
+        void removeMesh(const CollisionTriangleMesh *mesh);
+
+        /**
+         * Removes the given heightfield, if it is registered.
+         */
+        void removeHeightfield(const CollisionHeightfield *heightfield);
+
+        /**
+         * Removes all primitives, planes, meshes and heightfields.
+         */
+        void clear();
+
+        /**
+         * Stops the given pair of bodies being tested against each
+         * other, whatever their primitives' categories and masks.
+         * This is useful for bodies held together by a joint.
+         */
+        void ignorePair(RigidBody *one, RigidBody *two);
+
+        /**
+         * Lets the given pair of bodies be tested against each other
+         * again, if they were ignored.
+         */
+        void removeIgnoredPair(RigidBody *one, RigidBody *two);
+
+        /**
+         * Lets every pair of bodies be tested against each other.
+         */
+        void clearIgnoredPairs();
+
+        /**
+         * Checks if the given pair of bodies is ignored.
+         */
+        bool isPairIgnored(RigidBody *one, RigidBody *two) const;
+
+        /**
+         * Sets the number of threads used to search the hierarchy for
+         * potential contacts and to run the fine grained tests on the
+         * pairs of bodies found. The pairs found, the trigger events,
+         * and the contacts and collision pairs generated, are the
+         * same, in the same order, whatever the number of threads.
+         * The only exception is the contacts and collision pairs once
+         * the collision data fills up. The default is one, which does
+         * all the work on the calling thread.
+         */
+        void setThreadCount(unsigned threads);
+
+        /**
+         * Sets how far ahead speculative contacts look, which should
+         * be the duration of the frame the contacts are resolved for.
+         * Zero, the default, turns them off. While they are on, the
+         * margin of the collision data is set for each test, and
+         * spheres are tested one pair at a time rather than in
+         * batches.
+         */
+        void setSpeculativeTime(real time);
+
+        /**
+         * Runs the broadphase, filling the list of potential contacts
+         * and updating the pair manager, and returns the number of
+         * body pairs found.
+         */
+        unsigned findPotentialContacts();
+
+        /**
+         * Generates the contacts between all the registered primitives,
+         * writing them into the given collision data, and updates the
+         * trigger events. Generation stops when the collision data
+         * has no more room.
+         */
+        void generateContacts(CollisionData *data);
+
+        /**
+         * Finds the first thing the given sphere would hit if it were
+         * moved by the given movement, with everything else held
+         * still. The sphere's own body and convex hulls are ignored,
+         * as are bodies ignored with its body and primitives its
+         * category and mask keep it apart from. Returns false if
+         * nothing is hit.
+         *
+         * Only the bodies the hierarchy built by the last broadphase
+         * finds near the movement are tested, so primitives added
+         * since then are not hit.
+         */
+        bool sweepSphere(const CollisionSphere &sphere,
+            const Vector3 &movement,
+            SweepResult *result) const;
+
+        /**
+         * Finds the first thing the given box would hit if it were
+         * moved by the given movement, without turning, with
+         * everything else held still. The box's own body is ignored.
+         * Returns false if nothing is hit.
+         *
+         * The box is swept against each primitive and triangle near
+         * the movement using ConvexTests::sweep, and against the
+         * planes directly. As with sweepSphere, the bodies are found
+         * with the hierarchy built by the last broadphase.
+         */
+        bool sweepBox(const CollisionBox &box,
+            const Vector3 &movement,
+            SweepResult *result) const;
+
+        /**
+         * Finds the closest thing hit by each of the given rays,
+         * writing one hit per ray. The planes are cast against first,
+         * then the rays go down the hierarchy built by the last
+         * broadphase together, and only reach the bodies whose
+         * bounding spheres they pass through nearer than their hit so
+         * far. Spheres, boxes and the sphere and box children of
+         * compounds are hit. Capsules, convex hulls, meshes and
+         * heightfields are not.
+         */
+        void castRays(const RayBatch &rays, RayHit *hits) const;
+
+        /**
+         * Returns the bounding volume hierarchy built by the last
+         * broadphase, with one leaf per body, or NULL if there are no
+         * primitives. It can be used for region queries until the
+         * next broadphase.
+         */
+        const BVHNode<BoundingSphere>* getHierarchy() const
+        {
+            return root;
+        }
+
+        /**
+         * Returns the body pairs found by the last broadphase.
+         */
+        const std::vector<PotentialContact>& getPotentialContacts() const
+        {
+            return potentialContacts;
+        }
+
+        /**
+         * Returns the pair manager, which reports the body pairs that
+         * started or stopped overlapping in the last broadphase.
+         */
+        PairManager& getPairManager()
+        {
+            return pairManager;
+        }
+
+        /**
+         * Returns the primitive pairs that generated contacts in the
+         * last call to generateContacts.
+         */
+        const std::vector<CollisionPair>& getCollisionPairs() const
+        {
+            return collisionPairs;
+        }
+
+        /**
+         * Returns the trigger event buffer, holding the primitives
+         * that overlapped each trigger in the last call to
+         * generateContacts, and the ones that entered or left it.
+         */
+        const TriggerEventBuffer& getTriggerEvents() const
+        {
+            return triggerEvents;
+        }
+    };
+
+} // namespace cyclone
+
+#endif // CYCLONE_COLLISION_PIPELINE_H
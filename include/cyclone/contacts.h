@@ -26,6 +26,7 @@
 #ifndef CYCLONE_CONTACTS_H
 #define CYCLONE_CONTACTS_H
 
+#include <vector>
 #include "body.h"
 
 namespace cyclone {
@@ -97,12 +98,36 @@ namespace cyclone {
          * Holds the depth of penetration at the contact point. If both
          * bodies are specified then the contact point should be midway
          * between the inter-penetrating points.
+         *
+         * A negative penetration is the gap between bodies that are
+         * not yet touching. Such a speculative contact is never moved
+         * apart, and its velocity is only changed enough that the
+         * bodies won't close the gap in a frame of the same duration.
          */
         real penetration;
 
+        /**
+         * Holds an identifier for the features (faces, edges and
+         * vertices) of the two bodies that generated the contact, so
+         * that the same contact can be recognised from one frame to
+         * the next. It is zero for contacts whose generator doesn't
+         * track features.
+         */
+        unsigned feature;
+
+        /**
+         * Holds the total impulse applied along the contact normal
+         * by the last resolution of this contact. It is cleared by
+         * setBodyData and added to by the contact resolver, so it is
+         * zero for a contact that hasn't been resolved.
+         */
+        real normalImpulse;
+
         /**
          * Sets the data that doesn't normally depend on the position
          * of the contact (i.e. the bodies, and their material properties).
+         * This also clears the feature identifier and the normal
+         * impulse.
          */
         void setBodyData(RigidBody* one, RigidBody *two,
                          real friction, real restitution);
@@ -420,6 +445,157 @@ namespace cyclone {
             real duration);
     };
 
+    /**
+     * Reports an impact between a pair of bodies, gathered from all
+     * the resolved contacts between them.
+     */
+    struct ContactEvent
+    {
+        /**
+         * Identifies whether the bodies started touching this frame,
+         * were already touching, or have stopped touching.
+         */
+        enum State
+        {
+            CONTACT_BEGIN,
+            CONTACT_PERSIST,
+            CONTACT_END
+        };
+
+        /**
+         * Holds the bodies, in address order. The second is NULL for
+         * contacts with the scenery.
+         */
+        RigidBody *body[2];
+
+        /**
+         * Holds the point and normal of the contact between the
+         * bodies that took the largest impulse. The normal points
+         * from the second body towards the first. Neither is set for
+         * an end event.
+         */
+        Vector3 contactPoint;
+        Vector3 contactNormal;
+
+        /**
+         * Holds the total normal impulse applied to all the contacts
+         * between the bodies. It is zero for an end event.
+         */
+        real normalImpulse;
+
+        State state;
+    };
+
+    /**
+     * Turns each frame's resolved contacts into a compact list of
+     * contact events, one per pair of bodies, so impacts can be
+     * handled (for damage, sound or fracture, say) in one pass
+     * without going through every contact.
+     *
+     * Pairs whose total normal impulse is below the impulse threshold
+     * don't generate begin or persist events, though they are still
+     * tracked, so a pair that hits harder in a later frame gets a
+     * persist event rather than a second begin. An end event is only
+     * generated for pairs that have had an event while touching.
+     *
+     * To use it, call update once per frame after the contacts have
+     * been resolved.
+     */
+    class ContactEventBuffer
+    {
+    protected:
+        /**
+         * Holds the summary of the contacts between a pair of bodies
+         * in a single frame.
+         */
+        struct PairRecord
+        {
+            RigidBody *body[2];
+
+            /**
+             * Holds the index of the pair's first contact, which
+             * orders the events.
+             */
+            unsigned firstContact;
+
+            /**
+             * Is set if the pair has had an event since it started
+             * touching.
+             */
+            bool reported;
+        };
+
+        /**
+         * Holds the pairs of bodies touching in the last update and
+         * the one before, sorted by their bodies.
+         */
+        std::vector<PairRecord> pairs;
+        std::vector<PairRecord> lastPairs;
+
+        /**
+         * Holds the events generated by the last update.
+         */
+        std::vector<ContactEvent> events;
+
+        /**
+         * Holds the bodies and index of each contact, for sorting.
+         */
+        struct ContactKey
+        {
+            RigidBody *body[2];
+            unsigned index;
+
+            bool operator<(const ContactKey &other) const;
+        };
+        std::vector<ContactKey> keys;
+
+        /**
+         * Holds the first contact index of each event, for sorting.
+         */
+        std::vector< std::pair<unsigned, unsigned> > order;
+
+        /**
+         * Holds the smallest total impulse a pair needs to generate
+         * a begin or persist event.
+         */
+        real impulseThreshold;
+
+    public:
+        /**
+         * Creates an event buffer with the given impulse threshold.
+         */
+        ContactEventBuffer(real impulseThreshold = 0);
+
+        /**
+         * Sets the smallest total normal impulse that generates an
+         * event.
+         */
+        void setImpulseThreshold(real impulseThreshold);
+
+        /**
+         * Generates the events for the given contacts, which should
+         * have been resolved. Begin and persist events come in the
+         * order of their pair's first contact, followed by the end
+         * events in the order of their pair's first contact in the
+         * last frame it touched.
+         */
+        void update(const Contact *contacts, unsigned numContacts);
+
+        /**
+         * Returns the events generated by the last update.
+         */
+        const std::vector<ContactEvent>& getEvents() const
+        {
+            return events;
+        }
+
+        /**
+         * Removes all the pairs and events, without reporting any
+         * ends.
+         */
+        void clear();
+    };
+
     /**
      * This is the basic polymorphic interface for contact generators
      * applying to rigid bodies.
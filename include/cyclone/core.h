@@ -645,6 +645,17 @@ namespace cyclone {
             data[10] = c;
         }
 
+        /**
+         * Checks if this is exactly the identity matrix.
+         */
+        bool isIdentity() const
+        {
+            return data[0] == 1 && data[5] == 1 && data[10] == 1 &&
+                data[1] == 0 && data[2] == 0 && data[3] == 0 &&
+                data[4] == 0 && data[6] == 0 && data[7] == 0 &&
+                data[8] == 0 && data[9] == 0 && data[11] == 0;
+        }
+
         /**
          * Returns a matrix which is this matrix multiplied by the given
          * other matrix.
@@ -17,6 +17,11 @@
 #include "pcontacts.h"
 #include "pworld.h"
 #include "collide_fine.h"
+#include "collide_convex.h"
+#include "collide_mesh.h"
+#include "collide_continuous.h"
+#include "collide_pipeline.h"
+#include "collide_compound.h"
 #include "contacts.h"
 #include "fgen.h"
 #include "joints.h"
\ No newline at end of file
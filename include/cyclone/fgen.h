@@ -20,6 +20,7 @@
 
 #include "body.h"
 #include "pfgen.h"
+#include "collide_coarse.h"
 #include <vector>
 
 namespace cyclone {
@@ -220,6 +221,14 @@ namespace cyclone {
           */
          real convectionDuration;
 
+    protected:
+        /**
+         * Works out the total force of the explosion on an object
+         * at the given position, moving with the given velocity.
+         */
+        Vector3 getForce(const Vector3 &position,
+                         const Vector3 &velocity) const;
+
     public:
         /**
          * Creates a new explosion with sensible default values.
@@ -236,8 +245,30 @@ namespace cyclone {
          * Calculates and applies the force that the explosion has
          * on the given particle.
          */
-        virtual void updateForce(Particle *particle, real duration) = 0;
+        virtual void updateForce(Particle *particle, real duration);
+
+        /**
+         * Moves the explosion on by the given time. Because the
+         * explosion is applied to many objects each frame, this isn't
+         * done in updateForce, and should be called once per frame.
+         */
+        void advance(real duration);
+
+        /**
+         * Returns a sphere enclosing the region in which the
+         * explosion can currently apply a force. Once all of its
+         * effects have finished the sphere has zero radius.
+         */
+        BoundingSphere getAffectedRegion() const;
 
+        /**
+         * Applies the explosion to the bodies in the given hierarchy
+         * whose bounding volumes overlap the affected region. Bodies
+         * outside the region are never visited, so the explosion
+         * doesn't need registering with each body in advance.
+         */
+        void applyToBodies(const BVHNode<BoundingSphere> *hierarchy,
+                           real duration);
     };
 
     /**
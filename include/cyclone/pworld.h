@@ -144,6 +144,82 @@ namespace cyclone {
             unsigned limit) const;
     };
 
+    /**
+     * A contact generator that collides the particles in an STL
+     * vector of particle pointers with each other, treating each one
+     * as a sphere of the same radius.
+     *
+     * Rather than checking every pair of particles, the generator
+     * hashes each particle into a uniform grid of cells one particle
+     * diameter across. The cell lists are rebuilt every time contacts
+     * are requested, using a counting sort into a flat array, so there
+     * is no per-frame allocation once the tables have grown to fit.
+     * Each particle then only needs checking against the particles in
+     * its own and the 26 neighbouring cells, which makes the cost
+     * linear in the number of particles rather than quadratic.
+     */
+    class ParticleGridContacts : public cyclone::ParticleContactGenerator
+    {
+        cyclone::ParticleWorld::Particles *particles;
+
+        /**
+         * Holds the radius of every particle.
+         */
+        real radius;
+
+        /**
+         * Holds the restitution to write into any contacts.
+         */
+        real restitution;
+
+        /**
+         * Holds the size of a grid cell, set to the particle diameter
+         * so that only neighbouring cells need checking.
+         */
+        real cellSize;
+
+        /**
+         * Holds the hash table bucket that each particle falls into,
+         * indexed in the same order as the particle vector.
+         */
+        mutable std::vector<unsigned> particleBucket;
+
+        /**
+         * Holds the index of the first entry for each bucket, with
+         * one extra element at the end so that the entries for bucket
+         * b are in [bucketStart[b], bucketStart[b+1]).
+         */
+        mutable std::vector<unsigned> bucketStart;
+
+        /**
+         * Holds the particle indices sorted by bucket.
+         */
+        mutable std::vector<unsigned> bucketEntries;
+
+        /**
+         * Hashes the given integer cell coordinates into a bucket.
+         */
+        unsigned hashCell(int x, int y, int z, unsigned buckets) const;
+
+        /**
+         * Rebuilds the bucket tables from the current particle
+         * positions.
+         */
+        void buildGrid() const;
+
+    public:
+        /**
+         * Sets the particles to collide, the radius of each particle
+         * and the restitution of any contacts between them. The
+         * radius can't be negative.
+         */
+        void init(cyclone::ParticleWorld::Particles *particles,
+            real radius, real restitution = 0.2f);
+
+        virtual unsigned addContact(cyclone::ParticleContact *contact,
+            unsigned limit) const;
+    };
+
 } // namespace cyclone
 
 #endif // CYCLONE_PWORLD_H
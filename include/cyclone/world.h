@@ -21,6 +21,7 @@
 
 #include "body.h"
 #include "contacts.h"
+#include "collide_fine.h"
 
 namespace cyclone {
     /**
@@ -71,26 +72,35 @@ namespace cyclone {
         ContactGenRegistration *firstContactGen;
 
         /**
-         * Holds an array of contacts, for filling by the contact
-         * generators.
+         * Holds the storage for contacts, for filling by the contact
+         * generators. It grows when a frame needs more contacts, up
+         * to the contact limit.
          */
-        Contact *contacts;
+        ContactBuffer contactBuffer;
 
         /**
-         * Holds the maximum number of contacts allowed (i.e. the size
-         * of the contacts array).
+         * Holds the contacts generated in the current frame.
          */
-        unsigned maxContacts;
+        CollisionData contactData;
+
+        /**
+         * Holds the number of frames that lost contacts because the
+         * contact limit was reached.
+         */
+        unsigned truncatedFrames;
 
     public:
         /**
-         * Creates a new simulator that can handle up to the given
-         * number of contacts per frame. You can also optionally give
+         * Creates a new simulator with room for the given number of
+         * contacts per frame to start with. The room grows if more
+         * contacts are generated, up to the given contact limit (zero
+         * means no limit). You can also optionally give
          * a number of contact-resolution iterations to use. If you
          * don't give a number of iterations, then four times the
          * number of detected contacts will be used for each frame.
          */
-        World(unsigned maxContacts, unsigned iterations=0);
+        World(unsigned maxContacts, unsigned iterations=0,
+              unsigned contactLimit=0);
         ~World();
 
         /**
@@ -99,6 +109,17 @@ namespace cyclone {
          */
         unsigned generateContacts();
 
+        /**
+         * Returns the number of frames whose contacts didn't all fit
+         * because the contact limit was reached. A generator that
+         * fills the room it is given is run again with more room, so
+         * it should give the same contacts each time it is asked.
+         */
+        unsigned getTruncatedFrames() const
+        {
+            return truncatedFrames;
+        }
+
         /**
          * Processes all the physics for the world.
          */
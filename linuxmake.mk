@@ -4,7 +4,7 @@
 PLATFORM = $(shell uname)
 
 ifeq ($(PLATFORM), Linux)
-    LDFLAGS = -lGL -lGLU -lglut
+    LDFLAGS = -lGL -lGLU -lglut -pthread
 else
     $(error This OS is not Ubuntu Linux. Aborting)
 endif
@@ -20,14 +20,14 @@ DEMOLIST = ballisticsdamping forcegrenades modifiedbigballistic ballistic bigbal
 
 
 # Cyclone core files.
-CYCLONEFILES = ./src/body.cpp ./src/collide_coarse.cpp ./src/collide_fine.cpp ./src/contacts.cpp ./src/core.cpp ./src/fgen.cpp ./src/joints.cpp ./src/particle.cpp ./src/pcontacts.cpp ./src/pfgen.cpp ./src/plinks.cpp ./src/pworld.cpp ./src/random.cpp ./src/world.cpp
+CYCLONEFILES = ./src/body.cpp ./src/collide_coarse.cpp ./src/collide_compound.cpp ./src/collide_continuous.cpp ./src/collide_convex.cpp ./src/collide_fine.cpp ./src/collide_mesh.cpp ./src/collide_pipeline.cpp ./src/contacts.cpp ./src/core.cpp ./src/fgen.cpp ./src/joints.cpp ./src/particle.cpp ./src/pcontacts.cpp ./src/pfgen.cpp ./src/plinks.cpp ./src/pworld.cpp ./src/random.cpp ./src/world.cpp
 
 .PHONY: clean
 
 all: ./output/$(DEMOLIST)
 
 $(DEMOLIST):
-	g++ -O2 -Iinclude $(DEMOCOREFILES) $(CYCLONEFILES) $(DEMOPATH)$@/$@.cpp -o ./output/$@ $(LDFLAGS) 
+	g++ -O2 -std=c++11 -Iinclude $(DEMOCOREFILES) $(CYCLONEFILES) $(DEMOPATH)$@/$@.cpp -o ./output/$@ $(LDFLAGS) 
 
 clean:
 	rm $(DEMOLIST)
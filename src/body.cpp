@@ -142,6 +142,7 @@ void RigidBody::calculateDerivedData()
 
     // Calculate the transform matrix for the body.
     _calculateTransformMatrix(transformMatrix, position, orientation);
+    transformVersion++;
 
     // Calculate the inertiaTensor in world space.
     _transformInertiaTensor(inverseInertiaTensorWorld,
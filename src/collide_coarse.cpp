@@ -11,9 +11,130 @@
  */
 
 #include <cyclone/collide_coarse.h>
+#include <assert.h>
 
 using namespace cyclone;
 
+WorkerPool::WorkerPool(unsigned threads)
+:
+function(NULL), job(NULL), active(0), pending(0), generation(0),
+stopping(false)
+{
+    setThreadCount(threads);
+}
+
+WorkerPool::~WorkerPool()
+{
+    stop();
+}
+
+void WorkerPool::stop()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    wake.notify_all();
+    for (unsigned i = 0; i < workers.size(); i++)
+    {
+        workers[i].join();
+    }
+    workers.clear();
+
+    // New threads count runs from zero, so forget the earlier ones.
+    stopping = false;
+    function = NULL;
+    job = NULL;
+    active = 0;
+    pending = 0;
+    generation = 0;
+}
+
+void WorkerPool::setThreadCount(unsigned threads)
+{
+    if (threads < 1) threads = 1;
+    if (threads == getThreadCount()) return;
+
+    stop();
+    for (unsigned i = 1; i < threads; i++)
+    {
+        workers.push_back(std::thread(&WorkerPool::work, this, i));
+    }
+}
+
+void WorkerPool::work(unsigned worker)
+{
+    unsigned seen = 0;
+    std::unique_lock<std::mutex> lock(mutex);
+    for (;;)
+    {
+        while (!stopping && generation == seen) wake.wait(lock);
+        if (stopping) return;
+        seen = generation;
+
+        // Threads beyond the ones asked for sit this run out.
+        if (worker > active) continue;
+
+        Function current = function;
+        void *currentJob = job;
+        lock.unlock();
+        current(currentJob, worker);
+        lock.lock();
+        assert(pending > 0);
+        if (--pending == 0) done.notify_one();
+    }
+}
+
+void WorkerPool::run(Function function, void *job, unsigned threads)
+{
+    if (threads > getThreadCount()) threads = getThreadCount();
+    if (threads <= 1)
+    {
+        function(job, 0);
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        WorkerPool::function = function;
+        WorkerPool::job = job;
+        active = threads - 1;
+        pending = threads - 1;
+        generation++;
+    }
+    wake.notify_all();
+
+    // Do a share of the work here, then wait for the rest.
+    function(job, 0);
+    std::unique_lock<std::mutex> lock(mutex);
+    while (pending > 0) done.wait(lock);
+}
+
+BoundingBox::BoundingBox(const Vector3 &centre, const Vector3 &halfSize)
+{
+    BoundingBox::centre = centre;
+    BoundingBox::halfSize = halfSize;
+}
+
+bool BoundingBox::overlaps(const BoundingBox *other) const
+{
+    return
+        real_abs(centre.x - other->centre.x) <= halfSize.x + other->halfSize.x &&
+        real_abs(centre.y - other->centre.y) <= halfSize.y + other->halfSize.y &&
+        real_abs(centre.z - other->centre.z) <= halfSize.z + other->halfSize.z;
+}
+
+bool BoundingBox::overlaps(const BoundingBox *other, real margin) const
+{
+    return
+        real_abs(centre.x - other->centre.x) <=
+            halfSize.x + other->halfSize.x + margin &&
+        real_abs(centre.y - other->centre.y) <=
+            halfSize.y + other->halfSize.y + margin &&
+        real_abs(centre.z - other->centre.z) <=
+            halfSize.z + other->halfSize.z + margin;
+}
+
 BoundingSphere::BoundingSphere(const Vector3 &centre, real radius)
 {
     BoundingSphere::centre = centre;
@@ -67,6 +188,20 @@ bool BoundingSphere::overlaps(const BoundingSphere *other) const
     return distanceSquared < (radius+other->radius)*(radius+other->radius);
 }
 
+bool BoundingSphere::overlaps(const BoundingBox *other) const
+{
+    // Find the distance from the centre to the closest point in
+    // the box, one axis at a time.
+    real distanceSquared = 0;
+    for (unsigned i = 0; i < 3; i++)
+    {
+        real excess = real_abs(centre[i] - other->centre[i]) -
+            other->halfSize[i];
+        if (excess > 0) distanceSquared += excess * excess;
+    }
+    return distanceSquared < radius*radius;
+}
+
 real BoundingSphere::getGrowth(const BoundingSphere &other) const
 {
     BoundingSphere newSphere(*this, other);
@@ -74,4 +209,256 @@ real BoundingSphere::getGrowth(const BoundingSphere &other) const
     // We return a value proportional to the change in surface
     // area of the sphere.
     return newSphere.radius*newSphere.radius - radius*radius;
+}
+
+unsigned BoundingBox::clipRays(const RayBatch &rays,
+                               const unsigned *indices, unsigned count,
+                               const RayHit *hits, unsigned *passed) const
+{
+    unsigned reaching = 0;
+    real ox[RAY_BATCH_LANES], oy[RAY_BATCH_LANES], oz[RAY_BATCH_LANES];
+    real ix[RAY_BATCH_LANES], iy[RAY_BATCH_LANES], iz[RAY_BATCH_LANES];
+    real limit[RAY_BATCH_LANES];
+    unsigned char reaches[RAY_BATCH_LANES];
+    Vector3 low = centre - halfSize;
+    Vector3 high = centre + halfSize;
+
+    for (unsigned first = 0; first < count; first += RAY_BATCH_LANES)
+    {
+        unsigned lanes = count - first;
+        if (lanes > RAY_BATCH_LANES) lanes = RAY_BATCH_LANES;
+
+        // Gather the rays.
+        for (unsigned lane = 0; lane < lanes; lane++)
+        {
+            unsigned ray = indices[first + lane];
+            ox[lane] = rays.originX[ray];
+            oy[lane] = rays.originY[ray];
+            oz[lane] = rays.originZ[ray];
+            ix[lane] = rays.inverseX[ray];
+            iy[lane] = rays.inverseY[ray];
+            iz[lane] = rays.inverseZ[ray];
+            limit[lane] = hits[ray].distance;
+        }
+
+        // Clip each ray against the three pairs of faces (the slabs)
+        // in one pass. The ray is inside the box between the last
+        // slab it enters and the first it leaves.
+        for (unsigned lane = 0; lane < lanes; lane++)
+        {
+            real one = (low.x - ox[lane]) * ix[lane];
+            real two = (high.x - ox[lane]) * ix[lane];
+            real enter = one < two ? one : two;
+            real leave = one < two ? two : one;
+
+            one = (low.y - oy[lane]) * iy[lane];
+            two = (high.y - oy[lane]) * iy[lane];
+            real slabEnter = one < two ? one : two;
+            real slabLeave = one < two ? two : one;
+            enter = slabEnter > enter ? slabEnter : enter;
+            leave = slabLeave < leave ? slabLeave : leave;
+
+            one = (low.z - oz[lane]) * iz[lane];
+            two = (high.z - oz[lane]) * iz[lane];
+            slabEnter = one < two ? one : two;
+            slabLeave = one < two ? two : one;
+            enter = slabEnter > enter ? slabEnter : enter;
+            leave = slabLeave < leave ? slabLeave : leave;
+
+            reaches[lane] = (enter <= leave) & (leave >= 0) &
+                (enter < limit[lane]);
+        }
+
+        // Keep the rays that reach the box.
+        for (unsigned lane = 0; lane < lanes; lane++)
+        {
+            passed[reaching] = indices[first + lane];
+            reaching += reaches[lane];
+        }
+    }
+    return reaching;
+}
+
+unsigned BoundingSphere::clipRays(const RayBatch &rays,
+                                  const unsigned *indices, unsigned count,
+                                  const RayHit *hits, unsigned *passed) const
+{
+    unsigned reaching = 0;
+    real mx[RAY_BATCH_LANES], my[RAY_BATCH_LANES], mz[RAY_BATCH_LANES];
+    real dx[RAY_BATCH_LANES], dy[RAY_BATCH_LANES], dz[RAY_BATCH_LANES];
+    real limit[RAY_BATCH_LANES];
+    unsigned char reaches[RAY_BATCH_LANES];
+    real radiusSquared = radius * radius;
+
+    for (unsigned first = 0; first < count; first += RAY_BATCH_LANES)
+    {
+        unsigned lanes = count - first;
+        if (lanes > RAY_BATCH_LANES) lanes = RAY_BATCH_LANES;
+
+        // Gather the rays, relative to the centre.
+        for (unsigned lane = 0; lane < lanes; lane++)
+        {
+            unsigned ray = indices[first + lane];
+            mx[lane] = rays.originX[ray] - centre.x;
+            my[lane] = rays.originY[ray] - centre.y;
+            mz[lane] = rays.originZ[ray] - centre.z;
+            dx[lane] = rays.directionX[ray];
+            dy[lane] = rays.directionY[ray];
+            dz[lane] = rays.directionZ[ray];
+            limit[lane] = hits[ray].distance;
+        }
+
+        // Find where each ray enters the sphere in one pass.
+        for (unsigned lane = 0; lane < lanes; lane++)
+        {
+            real along = mx[lane]*dx[lane] + my[lane]*dy[lane] +
+                mz[lane]*dz[lane];
+            real outside = mx[lane]*mx[lane] + my[lane]*my[lane] +
+                mz[lane]*mz[lane] - radiusSquared;
+            real discriminant = along*along - outside;
+            real root = real_sqrt(discriminant > 0 ? discriminant : 0);
+            real enter = -along - root;
+
+            reaches[lane] = (outside <= 0) | ((discriminant >= 0) &
+                (enter >= 0) & (enter < limit[lane]));
+        }
+
+        // Keep the rays that reach the sphere.
+        for (unsigned lane = 0; lane < lanes; lane++)
+        {
+            passed[reaching] = indices[first + lane];
+            reaching += reaches[lane];
+        }
+    }
+    return reaching;
+}
+
+void RayBatch::clear()
+{
+    originX.clear();
+    originY.clear();
+    originZ.clear();
+    directionX.clear();
+    directionY.clear();
+    directionZ.clear();
+    inverseX.clear();
+    inverseY.clear();
+    inverseZ.clear();
+    length.clear();
+}
+
+unsigned RayBatch::add(const Vector3 &origin, const Vector3 &direction,
+                       real length)
+{
+    Vector3 unit = direction.unit();
+
+    originX.push_back(origin.x);
+    originY.push_back(origin.y);
+    originZ.push_back(origin.z);
+    directionX.push_back(unit.x);
+    directionY.push_back(unit.y);
+    directionZ.push_back(unit.z);
+
+    // A ray parallel to a slab gets a huge reciprocal rather than an
+    // infinite one, so a ray lying on a face can't produce a NaN.
+    inverseX.push_back(unit.x != 0 ? 1 / unit.x : REAL_MAX);
+    inverseY.push_back(unit.y != 0 ? 1 / unit.y : REAL_MAX);
+    inverseZ.push_back(unit.z != 0 ? 1 / unit.z : REAL_MAX);
+    RayBatch::length.push_back(length);
+    return size() - 1;
+}
+
+void RayBatch::resetHits(RayHit *hits) const
+{
+    for (unsigned i = 0; i < size(); i++)
+    {
+        hits[i].hit = false;
+        hits[i].distance = length[i];
+        hits[i].point = Vector3();
+        hits[i].normal = Vector3();
+        hits[i].primitive = NULL;
+    }
+}
+
+size_t PairManager::PairKeyHash::operator()(const PairKey &key) const
+{
+    size_t one = (size_t)key.first;
+    size_t two = (size_t)key.second;
+    return one ^ (two + 0x9e3779b9 + (one << 6) + (one >> 2));
+}
+
+PairManager::PairKey PairManager::makeKey(RigidBody *one, RigidBody *two)
+{
+    if (two < one) return PairKey(two, one);
+    return PairKey(one, two);
+}
+
+PairManager::PairManager()
+:
+frame(0)
+{
+}
+
+void PairManager::update(const PotentialContact *contacts, unsigned count)
+{
+    frame++;
+    added.clear();
+    removed.clear();
+
+    // Stamp the pairs we've seen this frame, adding any new ones.
+    for (unsigned i = 0; i < count; i++)
+    {
+        PairKey key = makeKey(contacts[i].body[0], contacts[i].body[1]);
+        PairIndex::iterator found = index.find(key);
+        if (found != index.end())
+        {
+            pairs[found->second].lastFrame = frame;
+            continue;
+        }
+
+        PersistentPair pair;
+        pair.body[0] = key.first;
+        pair.body[1] = key.second;
+        pair.userData = NULL;
+        pair.lastFrame = frame;
+        index[key] = (unsigned)pairs.size();
+        pairs.push_back(pair);
+        added.push_back(pair);
+    }
+
+    // Remove the pairs we didn't see, moving the last pair into
+    // the gap each time.
+    unsigned i = 0;
+    while (i < pairs.size())
+    {
+        if (pairs[i].lastFrame == frame)
+        {
+            i++;
+            continue;
+        }
+
+        removed.push_back(pairs[i]);
+        index.erase(PairKey(pairs[i].body[0], pairs[i].body[1]));
+        if (i + 1 < pairs.size())
+        {
+            pairs[i] = pairs.back();
+            index[PairKey(pairs[i].body[0], pairs[i].body[1])] = i;
+        }
+        pairs.pop_back();
+    }
+}
+
+PersistentPair* PairManager::findPair(RigidBody *one, RigidBody *two)
+{
+    PairIndex::iterator found = index.find(makeKey(one, two));
+    if (found == index.end()) return NULL;
+    return &pairs[found->second];
+}
+
+void PairManager::clear()
+{
+    pairs.clear();
+    index.clear();
+    added.clear();
+    removed.clear();
 }
\ No newline at end of file
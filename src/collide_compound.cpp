@@ -0,0 +1,224 @@
+/*
+ * Implementation file for compound collision primitives.
+ *
+ * Part of the Cyclone physics system.
+ *
+ * Copyright (c) Icosagon 2003. All Rights Reserved.
+ *
+ * This software is distributed under licence. Use of this software
+ * implies agreement with all terms and conditions of the accompanying
+ * software licence.
+ */
+
+#include <cyclone/collide_compound.h>
+#include <algorithm>
+#include <assert.h>
+
+using namespace cyclone;
+
+CollisionCompound::CollisionCompound()
+:
+bounds(Vector3(), Vector3()), dirty(true)
+{
+}
+
+void CollisionCompound::add(CollisionPrimitive *primitive,
+                            CollisionPipeline::PrimitiveType type)
+{
+    assert(type != CollisionPipeline::PRIMITIVE_COMPOUND);
+
+    Child child;
+    child.primitive = primitive;
+    child.type = type;
+    children.push_back(child);
+    dirty = true;
+}
+
+void CollisionCompound::addSphere(CollisionSphere *sphere)
+{
+    add(sphere, CollisionPipeline::PRIMITIVE_SPHERE);
+}
+
+void CollisionCompound::addBox(CollisionBox *box)
+{
+    add(box, CollisionPipeline::PRIMITIVE_BOX);
+}
+
+void CollisionCompound::addCapsule(CollisionCapsule *capsule)
+{
+    add(capsule, CollisionPipeline::PRIMITIVE_CAPSULE);
+}
+
+void CollisionCompound::addHull(CollisionConvexHull *hull)
+{
+    add(hull, CollisionPipeline::PRIMITIVE_HULL);
+}
+
+void CollisionCompound::remove(const CollisionPrimitive *primitive)
+{
+    for (std::vector<Child>::iterator i = children.begin();
+        i != children.end();
+        i++)
+    {
+        if (i->primitive == primitive)
+        {
+            children.erase(i);
+            dirty = true;
+            return;
+        }
+    }
+}
+
+void CollisionCompound::clear()
+{
+    children.clear();
+    dirty = true;
+}
+
+void CollisionCompound::calculateInternals()
+{
+    bool rebuilt = dirty;
+    if (dirty) build();
+
+    // The children only need updating if the compound moved, or
+    // they changed.
+    const RigidBody *lastBody = transformBody;
+    unsigned lastVersion = transformVersion;
+    CollisionPrimitive::calculateInternals();
+    if (!rebuilt && transformBody == lastBody &&
+        transformVersion == lastVersion)
+    {
+        return;
+    }
+    if (rebuilt) calculateBounds();
+
+    for (unsigned i = 0; i < children.size(); i++)
+    {
+        CollisionPrimitive *primitive = children[i].primitive;
+        primitive->body = body;
+        primitive->transform = transform * primitive->offset;
+        primitive->calculateBounds();
+    }
+}
+
+void CollisionCompound::calculateBounds()
+{
+    worldBounds = BoundingBox(transform.transform(bounds.centre),
+        getWorldHalfSize(bounds.halfSize));
+}
+
+BoundingBox CollisionCompound::getChildBounds(const Child &child)
+{
+    // The child's own bounds, as if the compound sat at the origin.
+    // calculateInternals sets the child's real transform afterwards.
+    CollisionPrimitive *primitive = child.primitive;
+    primitive->transform = primitive->offset;
+    primitive->calculateBounds();
+    return primitive->getWorldBounds();
+}
+
+/**
+ * Orders child indices by the centres of their bounds along one
+ * axis, for splitting the compound hierarchy.
+ */
+struct ChildOrder
+{
+    const std::vector<BoundingBox> *bounds;
+    unsigned axis;
+
+    bool operator()(unsigned a, unsigned b) const
+    {
+        return (*bounds)[a].centre[axis] < (*bounds)[b].centre[axis];
+    }
+};
+
+void CollisionCompound::build()
+{
+    dirty = false;
+    nodes.clear();
+    order.clear();
+    childBounds.clear();
+    bounds = BoundingBox(Vector3(), Vector3());
+
+    unsigned count = (unsigned)children.size();
+    if (count == 0) return;
+
+    for (unsigned i = 0; i < count; i++)
+    {
+        childBounds.push_back(getChildBounds(children[i]));
+        order.push_back(i);
+    }
+
+    nodes.push_back(Node());
+    buildNode(0, 0, count);
+    bounds = nodes[0].volume;
+}
+
+void CollisionCompound::buildNode(unsigned node,
+                                  unsigned first,
+                                  unsigned count)
+{
+    // Find the bounds of the children, and of their centres.
+    const BoundingBox &firstBounds = childBounds[order[first]];
+    Vector3 low = firstBounds.centre - firstBounds.halfSize;
+    Vector3 high = firstBounds.centre + firstBounds.halfSize;
+    Vector3 centreLow = firstBounds.centre;
+    Vector3 centreHigh = centreLow;
+    for (unsigned i = first + 1; i < first + count; i++)
+    {
+        const BoundingBox &child = childBounds[order[i]];
+        Vector3 childLow = child.centre - child.halfSize;
+        Vector3 childHigh = child.centre + child.halfSize;
+        for (unsigned axis = 0; axis < 3; axis++)
+        {
+            if (childLow[axis] < low[axis]) low[axis] = childLow[axis];
+            if (childHigh[axis] > high[axis]) high[axis] = childHigh[axis];
+            if (child.centre[axis] < centreLow[axis])
+            {
+                centreLow[axis] = child.centre[axis];
+            }
+            if (child.centre[axis] > centreHigh[axis])
+            {
+                centreHigh[axis] = child.centre[axis];
+            }
+        }
+    }
+    nodes[node].volume = BoundingBox(
+        (low + high) * ((real)0.5),
+        (high - low) * ((real)0.5)
+        );
+
+    // Each child gets its own leaf, so pairs are culled per child.
+    if (count == 1)
+    {
+        nodes[node].first = first;
+        nodes[node].count = 1;
+        return;
+    }
+
+    // Split at the median along the axis the centres spread furthest.
+    Vector3 spread = centreHigh - centreLow;
+    ChildOrder compare;
+    compare.bounds = &childBounds;
+    compare.axis = 0;
+    if (spread.y > spread[compare.axis]) compare.axis = 1;
+    if (spread.z > spread[compare.axis]) compare.axis = 2;
+
+    unsigned half = count / 2;
+    std::nth_element(
+        order.begin() + first,
+        order.begin() + first + half,
+        order.begin() + first + count,
+        compare
+        );
+
+    // The children go next to each other at the end of the list.
+    unsigned nodeChildren = (unsigned)nodes.size();
+    nodes.push_back(Node());
+    nodes.push_back(Node());
+    nodes[node].first = nodeChildren;
+    nodes[node].count = 0;
+
+    buildNode(nodeChildren, first, half);
+    buildNode(nodeChildren + 1, first + half, count - half);
+}
@@ -0,0 +1,515 @@
+/*
+ * Implementation file for the continuous collision detection system.
+ *
+ * Part of the Cyclone physics system.
+ *
+ * Copyright (c) Icosagon 2003. All Rights Reserved.
+ *
+ * This software is distributed under licence. Use of this software
+ * implies agreement with all terms and conditions of the accompanying
+ * software licence.
+ */
+
+#include <cyclone/collide_continuous.h>
+#include <cyclone/collide_pipeline.h>
+
+using namespace cyclone;
+
+/**
+ * Finds the first time, between zero and one, that a point moving
+ * from origin by the given movement comes within the given radius
+ * of the centre. Returns false if it doesn't, or if it starts there.
+ */
+static bool pointAndSphere(
+    const Vector3 &origin,
+    const Vector3 &movement,
+    const Vector3 &centre,
+    real radius,
+    real *time
+    )
+{
+    Vector3 offset = origin - centre;
+    real c = offset.squareMagnitude() - radius * radius;
+    if (c <= 0) return false;
+
+    real a = movement.squareMagnitude();
+    real b = offset * movement;
+    if (b >= 0 || a <= 0) return false;
+
+    real discriminant = b * b - a * c;
+    if (discriminant < 0) return false;
+
+    real t = (-b - real_sqrt(discriminant)) / a;
+    if (t > 1) return false;
+    *time = t > 0 ? t : 0;
+    return true;
+}
+
+/**
+ * Finds the first time, between zero and one, that a point moving
+ * from origin by the given movement comes within the given radius
+ * of the segment from start to end (that is, enters a capsule).
+ * Returns false if it doesn't, or if it starts inside.
+ */
+static bool pointAndCapsule(
+    const Vector3 &origin,
+    const Vector3 &movement,
+    const Vector3 &start,
+    const Vector3 &end,
+    real radius,
+    real *time
+    )
+{
+    // The capsule is the union of a cylinder and a sphere at each
+    // end, so the point enters it when it first enters any of them.
+    real best = REAL_MAX;
+    real t;
+    if (pointAndSphere(origin, movement, start, radius, &t)) best = t;
+    if (pointAndSphere(origin, movement, end, radius, &t) && t < best)
+    {
+        best = t;
+    }
+
+    // Work with the components at right angles to the axis, scaled
+    // by its square length to avoid dividing.
+    Vector3 axis = end - start;
+    Vector3 offset = origin - start;
+    real axisSquared = axis.squareMagnitude();
+    real offsetAlong = offset * axis;
+    real movementAlong = movement * axis;
+    real a = axisSquared * movement.squareMagnitude() -
+        movementAlong * movementAlong;
+    real b = axisSquared * (offset * movement) - offsetAlong * movementAlong;
+    real c = axisSquared * offset.squareMagnitude() -
+        offsetAlong * offsetAlong - radius * radius * axisSquared;
+
+    // Moving along the axis can only enter through the end spheres.
+    if (axisSquared > 0 && a > (real)0.000001 * axisSquared && c > 0 && b < 0)
+    {
+        real discriminant = b * b - a * c;
+        if (discriminant >= 0)
+        {
+            t = (-b - real_sqrt(discriminant)) / a;
+            real along = offsetAlong + movementAlong * t;
+            if (t <= 1 && along >= 0 && along <= axisSquared && t < best)
+            {
+                best = t > 0 ? t : 0;
+            }
+        }
+    }
+
+    if (best > 1) return false;
+    *time = best;
+    return true;
+}
+
+/**
+ * Returns the square of the distance from the point to the segment.
+ */
+static real pointToSegmentSquared(
+    const Vector3 &point,
+    const Vector3 &start,
+    const Vector3 &end
+    )
+{
+    Vector3 axis = end - start;
+    real axisSquared = axis.squareMagnitude();
+    real t = axisSquared > 0 ? ((point - start) * axis) / axisSquared : 0;
+    if (t < 0) t = 0;
+    else if (t > 1) t = 1;
+    return (point - (start + axis * t)).squareMagnitude();
+}
+
+/**
+ * Works out the normal at a point on the surface of a capsule.
+ */
+static Vector3 capsuleNormal(
+    const Vector3 &point,
+    const Vector3 &start,
+    const Vector3 &end
+    )
+{
+    Vector3 axis = end - start;
+    real axisSquared = axis.squareMagnitude();
+    real t = axisSquared > 0 ? ((point - start) * axis) / axisSquared : 0;
+    if (t < 0) t = 0;
+    else if (t > 1) t = 1;
+    Vector3 normal = point - (start + axis * t);
+    normal.normalise();
+    return normal;
+}
+
+bool SweptTests::sphereAndHalfSpace(
+    const CollisionSphere &sphere,
+    const Vector3 &movement,
+    const CollisionPlane &plane,
+    real *time,
+    Vector3 *normal
+    )
+{
+    real distance = plane.direction * sphere.getAxis(3) -
+        plane.offset - sphere.radius;
+    if (distance < 0) return false;
+
+    real approach = plane.direction * movement;
+    if (approach >= 0 || distance > -approach) return false;
+
+    *time = distance / -approach;
+    *normal = plane.direction;
+    return true;
+}
+
+bool SweptTests::sphereAndSphere(
+    const CollisionSphere &sphere,
+    const Vector3 &movement,
+    const CollisionSphere &other,
+    real *time,
+    Vector3 *normal
+    )
+{
+    Vector3 centre = sphere.getAxis(3);
+    if (!pointAndSphere(centre, movement, other.getAxis(3),
+        sphere.radius + other.radius, time)) return false;
+
+    *normal = centre + movement * (*time) - other.getAxis(3);
+    normal->normalise();
+    return true;
+}
+
+bool SweptTests::sphereAndBox(
+    const CollisionSphere &sphere,
+    const Vector3 &movement,
+    const CollisionBox &box,
+    real *time,
+    Vector3 *normal
+    )
+{
+    // Work in box coordinates, where the sphere's centre is a point
+    // moving towards a box with rounded corners and edges.
+    Vector3 origin = box.getTransform().transformInverse(sphere.getAxis(3));
+    Vector3 direction =
+        box.getTransform().transformInverseDirection(movement);
+    const Vector3 &halfSize = box.halfSize;
+    real radius = sphere.radius;
+
+    // Check the sphere isn't already touching the box.
+    Vector3 closest;
+    for (unsigned i = 0; i < 3; i++)
+    {
+        closest[i] = origin[i];
+        if (closest[i] < -halfSize[i]) closest[i] = -halfSize[i];
+        else if (closest[i] > halfSize[i]) closest[i] = halfSize[i];
+    }
+    if ((origin - closest).squareMagnitude() <= radius * radius)
+    {
+        return false;
+    }
+
+    // Find where the point enters the box grown by the radius.
+    real enter = 0, leave = 1;
+    for (unsigned i = 0; i < 3; i++)
+    {
+        real extent = halfSize[i] + radius;
+        if (real_abs(direction[i]) < (real)0.000001)
+        {
+            if (origin[i] < -extent || origin[i] > extent) return false;
+            continue;
+        }
+
+        real t1 = (-extent - origin[i]) / direction[i];
+        real t2 = (extent - origin[i]) / direction[i];
+        if (t1 > t2) { real swap = t1; t1 = t2; t2 = swap; }
+        if (t1 > enter) enter = t1;
+        if (t2 < leave) leave = t2;
+        if (enter > leave) return false;
+    }
+
+    // If it enters through a face of the grown box, that's the time
+    // of impact. Near an edge or corner the grown box sticks out past
+    // the rounded one, so check the capsules around the edges there.
+    Vector3 point = origin + direction * enter;
+    unsigned outside = 0;
+    Vector3 corner;
+    for (unsigned i = 0; i < 3; i++)
+    {
+        corner[i] = point[i] < 0 ? -halfSize[i] : halfSize[i];
+        if (real_abs(point[i]) > halfSize[i]) outside++;
+    }
+
+    real t = enter;
+    if (outside >= 2)
+    {
+        real best = REAL_MAX;
+        for (unsigned i = 0; i < 3; i++)
+        {
+            // Only the edges touching the outside faces matter: with
+            // two outside, the edge between them.
+            if (outside == 2 && real_abs(point[i]) > halfSize[i]) continue;
+
+            Vector3 start = corner;
+            Vector3 end = corner;
+            start[i] = -halfSize[i];
+            end[i] = halfSize[i];
+            real edgeTime;
+            if (pointAndCapsule(origin, direction, start, end, radius,
+                &edgeTime) && edgeTime < best)
+            {
+                best = edgeTime;
+            }
+        }
+        if (best > 1) return false;
+        t = best;
+    }
+
+    // The normal runs from the closest point on the box.
+    point = origin + direction * t;
+    for (unsigned i = 0; i < 3; i++)
+    {
+        closest[i] = point[i];
+        if (closest[i] < -halfSize[i]) closest[i] = -halfSize[i];
+        else if (closest[i] > halfSize[i]) closest[i] = halfSize[i];
+    }
+    Vector3 localNormal = point - closest;
+    localNormal.normalise();
+
+    *time = t;
+    *normal = box.getTransform().transformDirection(localNormal);
+    return true;
+}
+
+bool SweptTests::sphereAndCapsule(
+    const CollisionSphere &sphere,
+    const Vector3 &movement,
+    const CollisionCapsule &capsule,
+    real *time,
+    Vector3 *normal
+    )
+{
+    Vector3 centre = sphere.getAxis(3);
+    Vector3 start = capsule.getEnd(1);
+    Vector3 end = capsule.getEnd(0);
+    real radius = sphere.radius + capsule.radius;
+    if (pointToSegmentSquared(centre, start, end) <= radius * radius)
+    {
+        return false;
+    }
+    if (!pointAndCapsule(centre, movement, start, end, radius, time))
+    {
+        return false;
+    }
+
+    *normal = capsuleNormal(centre + movement * (*time), start, end);
+    return true;
+}
+
+bool SweptTests::sphereAndTriangle(
+    const CollisionSphere &sphere,
+    const Vector3 &movement,
+    const CollisionTriangle &triangle,
+    real *time,
+    Vector3 *normal
+    )
+{
+    Vector3 centre = sphere.getAxis(3);
+    real radius = sphere.radius;
+    Vector3 faceNormal = triangle.getNormal();
+
+    // Check the sphere isn't already touching the triangle, and find
+    // where it would first touch the triangle's face.
+    real height = (centre - triangle.vertex[0]) * faceNormal;
+    real side = height < 0 ? -1 : 1;
+    bool inside = true;
+    for (unsigned i = 0; i < 3; i++)
+    {
+        Vector3 edge = triangle.vertex[(i+1) % 3] - triangle.vertex[i];
+        if ((edge % (centre - triangle.vertex[i])) * faceNormal < 0)
+        {
+            inside = false;
+        }
+        if (pointToSegmentSquared(centre, triangle.vertex[i],
+            triangle.vertex[(i+1) % 3]) <= radius * radius) return false;
+    }
+    if (inside && height * side <= radius) return false;
+
+    real best = REAL_MAX;
+    Vector3 bestNormal;
+    real approach = movement * faceNormal * side;
+    if (approach < 0)
+    {
+        // If the sphere already reaches the plane, it can only touch
+        // the triangle through an edge.
+        real t = (height * side - radius) / -approach;
+        if (t >= 0 && t <= 1)
+        {
+            Vector3 onPlane = centre + movement * t - faceNormal * (radius * side);
+            bool hit = true;
+            for (unsigned i = 0; i < 3 && hit; i++)
+            {
+                Vector3 edge = triangle.vertex[(i+1) % 3] - triangle.vertex[i];
+                if ((edge % (onPlane - triangle.vertex[i])) * faceNormal < 0)
+                {
+                    hit = false;
+                }
+            }
+            if (hit)
+            {
+                best = t;
+                bestNormal = faceNormal * side;
+            }
+        }
+    }
+
+    // The edges and corners are capsules around each edge.
+    for (unsigned i = 0; i < 3; i++)
+    {
+        const Vector3 &start = triangle.vertex[i];
+        const Vector3 &end = triangle.vertex[(i+1) % 3];
+        real t;
+        if (pointAndCapsule(centre, movement, start, end, radius, &t) &&
+            t < best)
+        {
+            best = t;
+            bestNormal = capsuleNormal(centre + movement * t, start, end);
+        }
+    }
+
+    if (best > 1) return false;
+    *time = best;
+    *normal = bestNormal;
+    return true;
+}
+
+ContinuousCollision::ContinuousCollision(const CollisionPipeline *pipeline)
+:
+pipeline(pipeline),
+resolver(2),
+fastFraction((real)0.5),
+maxSubsteps(4),
+friction((real)0.9),
+restitution((real)0.1)
+{
+}
+
+void ContinuousCollision::addSphere(CollisionSphere *sphere)
+{
+    spheres.push_back(sphere);
+}
+
+void ContinuousCollision::removeSphere(const CollisionSphere *sphere)
+{
+    for (std::vector<CollisionSphere*>::iterator i = spheres.begin();
+        i != spheres.end();
+        i++)
+    {
+        if (*i == sphere)
+        {
+            spheres.erase(i);
+            return;
+        }
+    }
+}
+
+void ContinuousCollision::clear()
+{
+    spheres.clear();
+}
+
+bool ContinuousCollision::isFast(const CollisionSphere &sphere,
+                                 real duration) const
+{
+    real distance = sphere.body->getVelocity().magnitude() * duration;
+    return distance > sphere.radius * fastFraction;
+}
+
+void ContinuousCollision::integrate(real duration)
+{
+    impacts.clear();
+    for (unsigned i = 0; i < spheres.size(); i++)
+    {
+        CollisionSphere *sphere = spheres[i];
+        if (sphere->body->getAwake() && isFast(*sphere, duration))
+        {
+            integrateFast(sphere, duration);
+        }
+        else
+        {
+            sphere->body->integrate(duration);
+            sphere->calculateInternals();
+        }
+    }
+}
+
+void ContinuousCollision::integrateFast(CollisionSphere *sphere,
+                                        real duration)
+{
+    RigidBody *body = sphere->body;
+
+    // Integrating clears the forces on the body, so work out the
+    // force from a trial step, to apply again in later substeps.
+    RigidBody trial = *body;
+    trial.integrate(duration);
+    Vector3 force;
+    if (body->hasFiniteMass())
+    {
+        force = (trial.getLastFrameAcceleration() - body->getAcceleration()) *
+            body->getMass();
+    }
+
+    real remaining = duration;
+    for (unsigned step = 0; step < maxSubsteps; step++)
+    {
+        if (step > 0)
+        {
+            trial = *body;
+            trial.addForce(force);
+            trial.integrate(remaining);
+            body->addForce(force);
+        }
+        Vector3 start = body->getPosition();
+        Vector3 movement = trial.getPosition() - start;
+
+        SweepResult result;
+        if (!pipeline->sweepSphere(*sphere, movement, &result))
+        {
+            body->integrate(remaining);
+            sphere->calculateInternals();
+            return;
+        }
+
+        // Move to just short of the impact, so the sphere doesn't
+        // start the next sweep touching what it hit.
+        real time = result.time;
+        real length = movement.magnitude();
+        if (length > 0) time -= sphere->radius * (real)0.01 / length;
+        if (time < 0) time = 0;
+
+        real stepDuration = remaining * time;
+        body->integrate(stepDuration);
+        body->setPosition(start + movement * time);
+        body->calculateDerivedData();
+        sphere->calculateInternals();
+        remaining -= stepDuration;
+
+        // Resolve the impact, changing the velocities of the sphere
+        // and whatever it hit. The resolver takes off the velocity
+        // built up by the sphere's acceleration over the time given,
+        // so give it the substep that led up to the impact rather
+        // than the whole frame.
+        Contact contact;
+        contact.contactNormal = result.normal;
+        contact.contactPoint = result.point;
+        contact.penetration = 0;
+        contact.setBodyData(body,
+            result.primitive ? result.primitive->body : NULL,
+            friction, restitution);
+        resolver.resolveContacts(&contact, 1, stepDuration);
+
+        Impact impact;
+        impact.sphere = sphere;
+        impact.result = result;
+        impacts.push_back(impact);
+    }
+
+    // The sphere has used up its impacts for this frame, so it waits
+    // where it is for the next.
+}
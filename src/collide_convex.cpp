@@ -0,0 +1,929 @@
+/*
+ * Implementation file for the convex collision detection system.
+ *
+ * Part of the Cyclone physics system.
+ *
+ * Copyright (c) Icosagon 2003. All Rights Reserved.
+ *
+ * This software is distributed under licence. Use of this software
+ * implies agreement with all terms and conditions of the accompanying
+ * software licence.
+ */
+
+#include <cyclone/collide_convex.h>
+
+using namespace cyclone;
+
+// The most iterations either algorithm will run for.
+#define GJK_MAX_ITERATIONS 32
+#define EPA_MAX_ITERATIONS 64
+
+// The size of the polytope EPA can build.
+#define EPA_MAX_VERTICES 68
+#define EPA_MAX_FACES 132
+
+// The distances below which points are treated as the same.
+#define CONVEX_TOLERANCE ((real)0.0001)
+
+// The most steps a sweep will take, and the gap at which it stops.
+#define SWEEP_MAX_ITERATIONS 32
+#define SWEEP_TOLERANCE ((real)0.001)
+
+ConvexShape::ConvexShape(const CollisionPrimitive *primitive,
+                         SupportFunction support)
+:
+primitive(primitive), support(support)
+{
+}
+
+ConvexShape::ConvexShape(const CollisionSphere &sphere)
+:
+primitive(&sphere), support(sphereSupport)
+{
+}
+
+ConvexShape::ConvexShape(const CollisionBox &box)
+:
+primitive(&box), support(boxSupport)
+{
+}
+
+ConvexShape::ConvexShape(const CollisionCapsule &capsule)
+:
+primitive(&capsule), support(capsuleSupport)
+{
+}
+
+ConvexShape::ConvexShape(const CollisionConvexHull &hull)
+:
+primitive(&hull), support(hullSupport)
+{
+}
+
+Vector3 ConvexShape::sphereSupport(const CollisionPrimitive *primitive,
+                                   const Vector3 &direction)
+{
+    Vector3 point = direction;
+    point.normalise();
+    return point * static_cast<const CollisionSphere*>(primitive)->radius;
+}
+
+Vector3 ConvexShape::boxSupport(const CollisionPrimitive *primitive,
+                                const Vector3 &direction)
+{
+    const Vector3 &halfSize =
+        static_cast<const CollisionBox*>(primitive)->halfSize;
+    return Vector3(
+        direction.x < 0 ? -halfSize.x : halfSize.x,
+        direction.y < 0 ? -halfSize.y : halfSize.y,
+        direction.z < 0 ? -halfSize.z : halfSize.z
+        );
+}
+
+Vector3 ConvexShape::capsuleSupport(const CollisionPrimitive *primitive,
+                                    const Vector3 &direction)
+{
+    const CollisionCapsule *capsule =
+        static_cast<const CollisionCapsule*>(primitive);
+
+    Vector3 point = direction;
+    point.normalise();
+    point *= capsule->radius;
+    point.y += direction.y < 0 ? -capsule->halfLength : capsule->halfLength;
+    return point;
+}
+
+Vector3 ConvexShape::hullSupport(const CollisionPrimitive *primitive,
+                                 const Vector3 &direction)
+{
+    return static_cast<const CollisionConvexHull*>(primitive)->
+        getSupport(direction);
+}
+
+namespace {
+
+    /**
+     * Holds a point on the Minkowski difference of the two shapes
+     * (every point of the first shape minus every point of the
+     * second), along with the points on each shape it came from.
+     */
+    struct SupportPoint
+    {
+        Vector3 point;
+        Vector3 worldOne;
+        Vector3 worldTwo;
+        Vector3 localOne;
+        Vector3 localTwo;
+    };
+
+    /**
+     * Holds the simplex GJK works with: up to four support points,
+     * with the weights that give the point closest to the origin.
+     */
+    struct Simplex
+    {
+        SupportPoint vertex[4];
+        real weight[4];
+        unsigned count;
+    };
+}
+
+/**
+ * Finds the support point of the Minkowski difference of the two
+ * shapes along the given direction.
+ */
+static SupportPoint getSupport(const ConvexShape &one,
+                               const ConvexShape &two,
+                               const Vector3 &direction)
+{
+    SupportPoint result;
+    result.localOne = one.getLocalSupport(direction);
+    result.localTwo = two.getLocalSupport(direction * -1);
+    result.worldOne = one.toWorld(result.localOne);
+    result.worldTwo = two.toWorld(result.localTwo);
+    result.point = result.worldOne - result.worldTwo;
+    return result;
+}
+
+/**
+ * Returns the point on the simplex given by its weights, which is
+ * the point closest to the origin once the simplex is solved.
+ */
+static Vector3 getClosestPoint(const Simplex &simplex)
+{
+    Vector3 point;
+    for (unsigned i = 0; i < simplex.count; i++)
+    {
+        point += simplex.vertex[i].point * simplex.weight[i];
+    }
+    return point;
+}
+
+/**
+ * Reduces the simplex to the single point closest to the origin.
+ */
+static void keepVertex(Simplex &simplex, unsigned a)
+{
+    simplex.vertex[0] = simplex.vertex[a];
+    simplex.weight[0] = 1;
+    simplex.count = 1;
+}
+
+/**
+ * Reduces the simplex to the edge between the given vertices, with
+ * the closest point the given proportion along it.
+ */
+static void keepEdge(Simplex &simplex, unsigned a, unsigned b, real t)
+{
+    SupportPoint one = simplex.vertex[a];
+    SupportPoint two = simplex.vertex[b];
+    simplex.vertex[0] = one;
+    simplex.vertex[1] = two;
+    simplex.weight[0] = 1 - t;
+    simplex.weight[1] = t;
+    simplex.count = 2;
+}
+
+/**
+ * Finds the closest point to the origin on the segment between the
+ * given vertices, reducing the simplex to the vertices needed.
+ */
+static void solveEdge(Simplex &simplex, unsigned a, unsigned b)
+{
+    Vector3 start = simplex.vertex[a].point;
+    Vector3 edge = simplex.vertex[b].point - start;
+    real length = edge.squareMagnitude();
+    real t = length > 0 ? -(start * edge) / length : 0;
+
+    if (t <= 0) keepVertex(simplex, a);
+    else if (t >= 1) keepVertex(simplex, b);
+    else keepEdge(simplex, a, b, t);
+}
+
+/**
+ * Finds the closest point to the origin on the triangle made by
+ * the given vertices, reducing the simplex to the vertices needed.
+ * This works through the regions around the triangle in turn.
+ */
+static void solveTriangle(Simplex &simplex,
+                          unsigned a, unsigned b, unsigned c)
+{
+    Vector3 pa = simplex.vertex[a].point;
+    Vector3 pb = simplex.vertex[b].point;
+    Vector3 pc = simplex.vertex[c].point;
+    Vector3 ab = pb - pa;
+    Vector3 ac = pc - pa;
+
+    // The region beyond a.
+    real d1 = ab * pa * -1;
+    real d2 = ac * pa * -1;
+    if (d1 <= 0 && d2 <= 0)
+    {
+        keepVertex(simplex, a);
+        return;
+    }
+
+    // The region beyond b.
+    real d3 = ab * pb * -1;
+    real d4 = ac * pb * -1;
+    if (d3 >= 0 && d4 <= d3)
+    {
+        keepVertex(simplex, b);
+        return;
+    }
+
+    // The region beyond edge ab.
+    real vc = d1*d4 - d3*d2;
+    if (vc <= 0 && d1 >= 0 && d3 <= 0)
+    {
+        keepEdge(simplex, a, b, d1 / (d1 - d3));
+        return;
+    }
+
+    // The region beyond c.
+    real d5 = ab * pc * -1;
+    real d6 = ac * pc * -1;
+    if (d6 >= 0 && d5 <= d6)
+    {
+        keepVertex(simplex, c);
+        return;
+    }
+
+    // The region beyond edge ac.
+    real vb = d5*d2 - d1*d6;
+    if (vb <= 0 && d2 >= 0 && d6 <= 0)
+    {
+        keepEdge(simplex, a, c, d2 / (d2 - d6));
+        return;
+    }
+
+    // The region beyond edge bc.
+    real va = d3*d6 - d5*d4;
+    if (va <= 0 && (d4 - d3) >= 0 && (d5 - d6) >= 0)
+    {
+        keepEdge(simplex, b, c, (d4 - d3) / ((d4 - d3) + (d5 - d6)));
+        return;
+    }
+
+    // Inside the triangle. If it is too thin to work out the
+    // weights, use whichever edge is closest instead.
+    real sum = va + vb + vc;
+    if (sum <= 0)
+    {
+        static const unsigned edges[3][2] = {{0,1}, {0,2}, {1,2}};
+        unsigned vertices[3] = { a, b, c };
+        Simplex original = simplex;
+        real bestDistance = REAL_MAX;
+        for (unsigned i = 0; i < 3; i++)
+        {
+            Simplex candidate = original;
+            solveEdge(candidate, vertices[edges[i][0]], vertices[edges[i][1]]);
+            real distance = getClosestPoint(candidate).squareMagnitude();
+            if (distance < bestDistance)
+            {
+                bestDistance = distance;
+                simplex = candidate;
+            }
+        }
+        return;
+    }
+
+    SupportPoint one = simplex.vertex[a];
+    SupportPoint two = simplex.vertex[b];
+    SupportPoint three = simplex.vertex[c];
+    simplex.vertex[0] = one;
+    simplex.vertex[1] = two;
+    simplex.vertex[2] = three;
+    simplex.weight[1] = vb / sum;
+    simplex.weight[2] = vc / sum;
+    simplex.weight[0] = 1 - simplex.weight[1] - simplex.weight[2];
+    simplex.count = 3;
+}
+
+/**
+ * Finds the closest point to the origin on the tetrahedron in the
+ * simplex, reducing the simplex to the vertices needed. If the
+ * origin is inside, the simplex is left whole.
+ */
+static void solveTetrahedron(Simplex &simplex)
+{
+    // Each face, with the vertex opposite it.
+    static const unsigned faces[4][4] = {
+        {0,1,2,3}, {0,3,1,2}, {0,2,3,1}, {1,3,2,0}
+    };
+
+    Vector3 a = simplex.vertex[0].point;
+    real volume = (simplex.vertex[1].point - a) %
+        (simplex.vertex[2].point - a) * (simplex.vertex[3].point - a);
+    bool flat = real_abs(volume) <= CONVEX_TOLERANCE * CONVEX_TOLERANCE;
+
+    Simplex original = simplex;
+    Simplex best;
+    best.count = 0;
+    real bestDistance = REAL_MAX;
+    bool inside = !flat;
+
+    for (unsigned f = 0; f < 4; f++)
+    {
+        const unsigned *face = faces[f];
+        Vector3 p = original.vertex[face[0]].point;
+        Vector3 normal = (original.vertex[face[1]].point - p) %
+            (original.vertex[face[2]].point - p);
+        real originSide = normal * p * -1;
+        real vertexSide = normal * (original.vertex[face[3]].point - p);
+
+        // Only faces with the origin on their far side can hold the
+        // closest point.
+        if (!flat && originSide * vertexSide >= 0) continue;
+        inside = false;
+
+        Simplex candidate = original;
+        solveTriangle(candidate, face[0], face[1], face[2]);
+        real distance = getClosestPoint(candidate).squareMagnitude();
+        if (distance < bestDistance)
+        {
+            bestDistance = distance;
+            best = candidate;
+        }
+    }
+
+    if (inside)
+    {
+        simplex = original;
+        return;
+    }
+    simplex = best;
+}
+
+/**
+ * Finds the closest point to the origin on the simplex, reducing
+ * it to the vertices needed.
+ */
+static void solveSimplex(Simplex &simplex)
+{
+    switch (simplex.count)
+    {
+    case 1: simplex.weight[0] = 1; break;
+    case 2: solveEdge(simplex, 0, 1); break;
+    case 3: solveTriangle(simplex, 0, 1, 2); break;
+    case 4: solveTetrahedron(simplex); break;
+    }
+}
+
+/**
+ * Runs GJK on the two shapes, leaving the final simplex in the one
+ * given. Returns true if the shapes overlap, in which case the
+ * simplex holds the origin (if it has four vertices) or touches it.
+ * If stopWhenSeparated is true, the search stops as soon as it is
+ * clear the shapes don't overlap, without finding the distance.
+ */
+static bool runGJK(const ConvexShape &one,
+                   const ConvexShape &two,
+                   ConvexCache *cache,
+                   bool stopWhenSeparated,
+                   Simplex &simplex)
+{
+    // Start with the cached simplex if we have one, moved to where
+    // the shapes are now. Otherwise start with any point.
+    if (cache && cache->count > 0)
+    {
+        simplex.count = cache->count;
+        for (unsigned i = 0; i < simplex.count; i++)
+        {
+            SupportPoint &vertex = simplex.vertex[i];
+            vertex.localOne = cache->pointOne[i];
+            vertex.localTwo = cache->pointTwo[i];
+            vertex.worldOne = one.toWorld(vertex.localOne);
+            vertex.worldTwo = two.toWorld(vertex.localTwo);
+            vertex.point = vertex.worldOne - vertex.worldTwo;
+            simplex.weight[i] = (real)1 / (real)simplex.count;
+        }
+    }
+    else
+    {
+        Vector3 direction = two.getCentre() - one.getCentre();
+        if (direction.squareMagnitude() <= 0) direction = Vector3(1,0,0);
+        simplex.vertex[0] = getSupport(one, two, direction);
+        simplex.weight[0] = 1;
+        simplex.count = 1;
+    }
+
+    bool overlap = false;
+    unsigned iteration = 0;
+    while (iteration < GJK_MAX_ITERATIONS)
+    {
+        iteration++;
+
+        // Find the closest point to the origin, and see if we've
+        // reached it.
+        solveSimplex(simplex);
+        if (simplex.count == 4)
+        {
+            overlap = true;
+            break;
+        }
+
+        Vector3 closest = getClosestPoint(simplex);
+        real distance = closest.squareMagnitude();
+        if (distance <= CONVEX_TOLERANCE * CONVEX_TOLERANCE)
+        {
+            overlap = true;
+            break;
+        }
+
+        // Look for a point closer to the origin.
+        SupportPoint vertex = getSupport(one, two, closest * -1);
+        real progress = distance - closest * vertex.point;
+        if (stopWhenSeparated && closest * vertex.point > 0) break;
+
+        // If we got nowhere, the closest point is as close as the
+        // shapes get.
+        if (progress <= CONVEX_TOLERANCE * distance) break;
+
+        bool repeated = false;
+        for (unsigned i = 0; i < simplex.count; i++)
+        {
+            if ((simplex.vertex[i].point - vertex.point).squareMagnitude()
+                <= CONVEX_TOLERANCE * CONVEX_TOLERANCE)
+            {
+                repeated = true;
+            }
+        }
+        if (repeated) break;
+
+        simplex.vertex[simplex.count] = vertex;
+        simplex.count++;
+    }
+
+    // If we ran out of iterations just after adding a vertex, its
+    // weight hasn't been worked out yet.
+    if (iteration == GJK_MAX_ITERATIONS && !overlap)
+    {
+        solveSimplex(simplex);
+        if (simplex.count == 4) overlap = true;
+    }
+
+    if (cache)
+    {
+        cache->count = simplex.count;
+        for (unsigned i = 0; i < simplex.count; i++)
+        {
+            cache->pointOne[i] = simplex.vertex[i].localOne;
+            cache->pointTwo[i] = simplex.vertex[i].localTwo;
+        }
+        cache->iterations = iteration;
+    }
+    return overlap;
+}
+
+/**
+ * Adds support points to a simplex until it is a tetrahedron with
+ * some volume, as EPA needs. Returns false if the shapes are too
+ * flat to make one.
+ */
+static bool completeTetrahedron(const ConvexShape &one,
+                                const ConvexShape &two,
+                                Simplex &simplex)
+{
+    static const Vector3 axes[3] = {
+        Vector3(1,0,0), Vector3(0,1,0), Vector3(0,0,1)
+    };
+    real tolerance = CONVEX_TOLERANCE * CONVEX_TOLERANCE;
+
+    // Find a second point along any axis.
+    for (unsigned i = 0; i < 6 && simplex.count == 1; i++)
+    {
+        SupportPoint vertex = getSupport(
+            one, two, axes[i/2] * (i % 2 ? -1 : 1)
+            );
+        if ((vertex.point - simplex.vertex[0].point).squareMagnitude()
+            > tolerance)
+        {
+            simplex.vertex[simplex.count++] = vertex;
+        }
+    }
+    if (simplex.count < 2) return false;
+
+    // Then a third off the line between the first two.
+    Vector3 line = simplex.vertex[1].point - simplex.vertex[0].point;
+    for (unsigned i = 0; i < 6 && simplex.count == 2; i++)
+    {
+        Vector3 direction = line % axes[i/2];
+        if (i % 2) direction *= -1;
+        if (direction.squareMagnitude() <= tolerance) continue;
+
+        SupportPoint vertex = getSupport(one, two, direction);
+        Vector3 offLine = (vertex.point - simplex.vertex[0].point) % line;
+        if (offLine.squareMagnitude() > tolerance * line.squareMagnitude())
+        {
+            simplex.vertex[simplex.count++] = vertex;
+        }
+    }
+    if (simplex.count < 3) return false;
+
+    // Then a fourth off the plane of the first three.
+    Vector3 normal = (simplex.vertex[1].point - simplex.vertex[0].point) %
+        (simplex.vertex[2].point - simplex.vertex[0].point);
+    for (unsigned i = 0; i < 2 && simplex.count == 3; i++)
+    {
+        SupportPoint vertex = getSupport(
+            one, two, normal * (i ? -1 : 1)
+            );
+        real height = (vertex.point - simplex.vertex[0].point) * normal;
+        if (height * height > tolerance * normal.squareMagnitude())
+        {
+            simplex.vertex[simplex.count++] = vertex;
+        }
+    }
+    return simplex.count == 4;
+}
+
+namespace {
+
+    /**
+     * Holds a face of the polytope EPA builds, with its outward
+     * normal and its distance from the origin.
+     */
+    struct PolytopeFace
+    {
+        unsigned vertex[3];
+        Vector3 normal;
+        real distance;
+        bool removed;
+    };
+
+    /**
+     * Holds the polytope EPA builds.
+     */
+    struct Polytope
+    {
+        SupportPoint vertex[EPA_MAX_VERTICES];
+        unsigned vertexCount;
+        PolytopeFace face[EPA_MAX_FACES];
+        unsigned faceCount;
+    };
+}
+
+/**
+ * Adds a face to the polytope, working out its normal and distance.
+ * Returns false if the polytope is full or the face has no area.
+ */
+static bool addFace(Polytope &polytope,
+                    unsigned a, unsigned b, unsigned c)
+{
+    if (polytope.faceCount >= EPA_MAX_FACES) return false;
+
+    const Vector3 &pa = polytope.vertex[a].point;
+    Vector3 normal = (polytope.vertex[b].point - pa) %
+        (polytope.vertex[c].point - pa);
+    if (normal.squareMagnitude() <= 0) return false;
+    normal.normalise();
+
+    PolytopeFace &face = polytope.face[polytope.faceCount++];
+    face.vertex[0] = a;
+    face.vertex[1] = b;
+    face.vertex[2] = c;
+    face.normal = normal;
+    face.distance = normal * pa;
+    face.removed = false;
+    return true;
+}
+
+/**
+ * Runs EPA on the two shapes, starting from the tetrahedron GJK
+ * finished with. Finds the face of the Minkowski difference closest
+ * to the origin, which gives the direction and depth of the overlap.
+ */
+static bool runEPA(const ConvexShape &one,
+                   const ConvexShape &two,
+                   const Simplex &simplex,
+                   Vector3 *normal,
+                   real *depth,
+                   Vector3 *pointOne,
+                   Vector3 *pointTwo)
+{
+    Polytope polytope;
+    polytope.vertexCount = 4;
+    polytope.faceCount = 0;
+    for (unsigned i = 0; i < 4; i++) polytope.vertex[i] = simplex.vertex[i];
+
+    // Make sure the faces of the tetrahedron wind outwards.
+    Vector3 a = polytope.vertex[0].point;
+    real volume = (polytope.vertex[1].point - a) %
+        (polytope.vertex[2].point - a) * (polytope.vertex[3].point - a);
+    if (volume < 0)
+    {
+        SupportPoint temp = polytope.vertex[1];
+        polytope.vertex[1] = polytope.vertex[2];
+        polytope.vertex[2] = temp;
+    }
+    addFace(polytope, 0, 2, 1);
+    addFace(polytope, 0, 1, 3);
+    addFace(polytope, 0, 3, 2);
+    addFace(polytope, 1, 2, 3);
+    if (polytope.faceCount < 4) return false;
+
+    unsigned edges[EPA_MAX_FACES * 3][2];
+    PolytopeFace *closest = NULL;
+    for (unsigned iteration = 0; iteration < EPA_MAX_ITERATIONS; iteration++)
+    {
+        // Find the face closest to the origin.
+        closest = NULL;
+        for (unsigned i = 0; i < polytope.faceCount; i++)
+        {
+            PolytopeFace &face = polytope.face[i];
+            if (face.removed) continue;
+            if (!closest || face.distance < closest->distance)
+            {
+                closest = &face;
+            }
+        }
+        if (!closest) return false;
+
+        // See if the shapes reach further out in that direction. If
+        // not, the face is on the surface and we're done.
+        SupportPoint vertex = getSupport(one, two, closest->normal);
+        real reach = vertex.point * closest->normal - closest->distance;
+        if (reach <= CONVEX_TOLERANCE) break;
+        if (polytope.vertexCount >= EPA_MAX_VERTICES) break;
+
+        unsigned newVertex = polytope.vertexCount++;
+        polytope.vertex[newVertex] = vertex;
+
+        // Remove the faces the new point can see, keeping track of
+        // the edge of the hole they leave (edges shared by two
+        // removed faces cancel out).
+        unsigned edgeCount = 0;
+        for (unsigned i = 0; i < polytope.faceCount; i++)
+        {
+            PolytopeFace &face = polytope.face[i];
+            if (face.removed) continue;
+            Vector3 toVertex =
+                vertex.point - polytope.vertex[face.vertex[0]].point;
+            if (face.normal * toVertex <= 0) continue;
+
+            face.removed = true;
+            for (unsigned e = 0; e < 3; e++)
+            {
+                unsigned from = face.vertex[e];
+                unsigned to = face.vertex[(e+1) % 3];
+
+                bool shared = false;
+                for (unsigned j = 0; j < edgeCount; j++)
+                {
+                    if (edges[j][0] == to && edges[j][1] == from)
+                    {
+                        edges[j][0] = edges[edgeCount-1][0];
+                        edges[j][1] = edges[edgeCount-1][1];
+                        edgeCount--;
+                        shared = true;
+                        break;
+                    }
+                }
+                if (!shared)
+                {
+                    edges[edgeCount][0] = from;
+                    edges[edgeCount][1] = to;
+                    edgeCount++;
+                }
+            }
+        }
+
+        // Remove the dead faces, then fill the hole with faces to
+        // the new point.
+        unsigned kept = 0;
+        for (unsigned i = 0; i < polytope.faceCount; i++)
+        {
+            if (!polytope.face[i].removed)
+            {
+                polytope.face[kept++] = polytope.face[i];
+            }
+        }
+        polytope.faceCount = kept;
+
+        bool full = false;
+        for (unsigned i = 0; i < edgeCount; i++)
+        {
+            if (polytope.faceCount >= EPA_MAX_FACES)
+            {
+                full = true;
+                break;
+            }
+            addFace(polytope, edges[i][0], edges[i][1], newVertex);
+        }
+        closest = NULL;
+        if (full) break;
+    }
+
+    // Find the closest face again if the last pass changed them.
+    if (!closest)
+    {
+        for (unsigned i = 0; i < polytope.faceCount; i++)
+        {
+            PolytopeFace &face = polytope.face[i];
+            if (!closest || face.distance < closest->distance)
+            {
+                closest = &face;
+            }
+        }
+        if (!closest) return false;
+    }
+    if (closest->distance <= 0) return false;
+
+    // Work out where the closest point on the face is, in terms of
+    // its vertices, to find the matching points on each shape.
+    const SupportPoint &va = polytope.vertex[closest->vertex[0]];
+    const SupportPoint &vb = polytope.vertex[closest->vertex[1]];
+    const SupportPoint &vc = polytope.vertex[closest->vertex[2]];
+    Vector3 point = closest->normal * closest->distance;
+    Vector3 ab = vb.point - va.point;
+    Vector3 ac = vc.point - va.point;
+    Vector3 ap = point - va.point;
+    real d00 = ab * ab, d01 = ab * ac, d11 = ac * ac;
+    real d20 = ap * ab, d21 = ap * ac;
+    real denominator = d00 * d11 - d01 * d01;
+    real v = 0, w = 0;
+    if (denominator > 0)
+    {
+        v = (d11 * d20 - d01 * d21) / denominator;
+        w = (d00 * d21 - d01 * d20) / denominator;
+    }
+    real u = 1 - v - w;
+
+    *normal = closest->normal * -1;
+    *depth = closest->distance;
+    *pointOne = va.worldOne * u + vb.worldOne * v + vc.worldOne * w;
+    *pointTwo = va.worldTwo * u + vb.worldTwo * v + vc.worldTwo * w;
+    return true;
+}
+
+bool ConvexTests::intersect(
+    const ConvexShape &one,
+    const ConvexShape &two,
+    ConvexCache *cache
+    )
+{
+    Simplex simplex;
+    return runGJK(one, two, cache, true, simplex);
+}
+
+real ConvexTests::distance(
+    const ConvexShape &one,
+    const ConvexShape &two,
+    Vector3 *pointOne,
+    Vector3 *pointTwo,
+    ConvexCache *cache
+    )
+{
+    Simplex simplex;
+    if (runGJK(one, two, cache, false, simplex)) return 0;
+
+    Vector3 closestOne, closestTwo;
+    for (unsigned i = 0; i < simplex.count; i++)
+    {
+        closestOne += simplex.vertex[i].worldOne * simplex.weight[i];
+        closestTwo += simplex.vertex[i].worldTwo * simplex.weight[i];
+    }
+    if (pointOne) *pointOne = closestOne;
+    if (pointTwo) *pointTwo = closestTwo;
+    return (closestOne - closestTwo).magnitude();
+}
+
+bool ConvexTests::penetration(
+    const ConvexShape &one,
+    const ConvexShape &two,
+    Vector3 *normal,
+    real *depth,
+    Vector3 *pointOne,
+    Vector3 *pointTwo,
+    ConvexCache *cache
+    )
+{
+    Simplex simplex;
+    if (!runGJK(one, two, cache, true, simplex)) return false;
+    if (simplex.count < 4 && !completeTetrahedron(one, two, simplex))
+    {
+        return false;
+    }
+    return runEPA(one, two, simplex, normal, depth, pointOne, pointTwo);
+}
+
+unsigned ConvexTests::collide(
+    const ConvexShape &one,
+    const ConvexShape &two,
+    CollisionData *data,
+    ConvexCache *cache
+    )
+{
+    // Make sure we have contacts
+    if (!data->hasMoreContacts()) return 0;
+
+    Vector3 normal, pointOne, pointTwo;
+    real depth;
+    if (!penetration(one, two, &normal, &depth, &pointOne, &pointTwo, cache))
+    {
+        // If they are apart but within the margin, use the closest
+        // points for a speculative contact.
+        if (data->margin <= 0) return 0;
+        real gap = distance(one, two, &pointOne, &pointTwo, cache);
+        if (gap <= 0 || gap >= data->margin) return 0;
+
+        normal = (pointOne - pointTwo) * (((real)1.0) / gap);
+        depth = -gap;
+    }
+
+    // Put the contact halfway between the deepest points.
+    Contact* contact = data->contacts;
+    contact->contactNormal = normal;
+    contact->contactPoint = (pointOne + pointTwo) * (real)0.5;
+    contact->penetration = depth;
+    contact->setBodyData(
+        one.getPrimitive()->body, two.getPrimitive()->body,
+        data->friction, data->restitution);
+
+    data->addContacts(1);
+    return 1;
+}
+
+bool ConvexTests::sweep(
+    const ConvexShape &one,
+    const Vector3 &movement,
+    const ConvexShape &two,
+    real *time,
+    Vector3 *normal,
+    Vector3 *point
+    )
+{
+    ConvexShape moving = one;
+    Vector3 towards, pointOne, pointTwo;
+    real travelled = 0;
+    real safe = 0;
+    bool converged = false;
+    for (unsigned i = 0; i < SWEEP_MAX_ITERATIONS; i++)
+    {
+        moving.translation = one.translation + movement * travelled;
+        Vector3 nextOne, nextTwo;
+        real gap = distance(moving, two, &nextOne, &nextTwo);
+
+        if (gap <= 0)
+        {
+            // Shapes that start overlapping aren't reported.
+            if (i == 0) return false;
+
+            // The distance is only found to within a tolerance, so
+            // a step can go too far when the shapes are curved. We
+            // go back to the last point they were apart, and close
+            // in on the contact by bisection.
+            real overlapping = travelled;
+            travelled = safe;
+            for (unsigned j = 0; j < SWEEP_MAX_ITERATIONS / 2; j++)
+            {
+                real middle = (travelled + overlapping) * (real)0.5;
+                moving.translation = one.translation + movement * middle;
+                gap = distance(moving, two, &nextOne, &nextTwo);
+                if (gap <= 0)
+                {
+                    overlapping = middle;
+                    continue;
+                }
+                travelled = middle;
+                pointOne = nextOne;
+                pointTwo = nextTwo;
+                towards = (pointTwo - pointOne) * (((real)1.0) / gap);
+                if (gap < SWEEP_TOLERANCE)
+                {
+                    converged = true;
+                    break;
+                }
+            }
+            break;
+        }
+
+        safe = travelled;
+        pointOne = nextOne;
+        pointTwo = nextTwo;
+        towards = (pointTwo - pointOne) * (((real)1.0) / gap);
+        if (gap < SWEEP_TOLERANCE)
+        {
+            converged = true;
+            break;
+        }
+
+        // Move on by the time the gap takes to close at its current
+        // rate. If it isn't closing it never will, as the distance
+        // along a straight movement is convex.
+        real closing = towards * movement;
+        if (closing <= 0) return false;
+        travelled += gap / closing;
+        if (travelled > 1) return false;
+    }
+
+    // If the steps ran out before the gap closed, the time and the
+    // points are from a position still apart, so don't report them.
+    if (!converged) return false;
+
+    *time = travelled;
+    *normal = towards * -1;
+    *point = (pointOne + pointTwo) * (real)0.5;
+    return true;
+}
@@ -15,12 +15,326 @@
 #include <assert.h>
 #include <cstdlib>
 #include <cstdio>
+#include <algorithm>
 
 using namespace cyclone;
 
 void CollisionPrimitive::calculateInternals()
 {
-    transform = body->getTransform() * offset;
+    // Nothing to do if the body hasn't moved since last time.
+    unsigned version = body->getTransformVersion();
+    if (body == transformBody && version == transformVersion) return;
+    transformBody = body;
+    transformVersion = version;
+
+    if (offset.isIdentity()) transform = body->getTransform();
+    else transform = body->getTransform() * offset;
+    calculateBounds();
+}
+
+void CollisionPrimitive::calculateBounds()
+{
+    worldBounds = BoundingBox(getAxis(3), Vector3());
+}
+
+void CollisionSphere::calculateBounds()
+{
+    worldBounds = BoundingBox(getAxis(3), Vector3(radius, radius, radius));
+}
+
+Vector3 CollisionPrimitive::getWorldHalfSize(const Vector3 &halfSize) const
+{
+    // Each local axis adds its projection onto each world axis: the
+    // absolute rotation matrix times the half-sizes.
+    const real *data = transform.data;
+    return Vector3(
+        real_abs(data[0])*halfSize.x + real_abs(data[1])*halfSize.y +
+            real_abs(data[2])*halfSize.z,
+        real_abs(data[4])*halfSize.x + real_abs(data[5])*halfSize.y +
+            real_abs(data[6])*halfSize.z,
+        real_abs(data[8])*halfSize.x + real_abs(data[9])*halfSize.y +
+            real_abs(data[10])*halfSize.z
+        );
+}
+
+void CollisionBox::calculateBounds()
+{
+    worldBounds = BoundingBox(getAxis(3), getWorldHalfSize(halfSize));
+}
+
+void CollisionCapsule::calculateBounds()
+{
+    Vector3 halfSize = getAxis(1) * halfLength;
+    halfSize.x = real_abs(halfSize.x) + radius;
+    halfSize.y = real_abs(halfSize.y) + radius;
+    halfSize.z = real_abs(halfSize.z) + radius;
+    worldBounds = BoundingBox(getAxis(3), halfSize);
+}
+
+void CollisionConvexHull::calculateBounds()
+{
+    if (vertices.empty())
+    {
+        CollisionPrimitive::calculateBounds();
+        return;
+    }
+
+    Vector3 low = transform.transform(vertices[0]);
+    Vector3 high = low;
+    for (unsigned i = 1; i < vertices.size(); i++)
+    {
+        Vector3 vertex = transform.transform(vertices[i]);
+        for (unsigned j = 0; j < 3; j++)
+        {
+            if (vertex[j] < low[j]) low[j] = vertex[j];
+            if (vertex[j] > high[j]) high[j] = vertex[j];
+        }
+    }
+    worldBounds = BoundingBox((low + high) * (real)0.5, (high - low) * (real)0.5);
+}
+
+Vector3 CollisionConvexHull::getSupport(const Vector3 &direction) const
+{
+    if (vertices.empty()) return Vector3();
+
+    unsigned best = 0;
+    real bestDistance = vertices[0] * direction;
+    for (unsigned i = 1; i < vertices.size(); i++)
+    {
+        real distance = vertices[i] * direction;
+        if (distance > bestDistance)
+        {
+            best = i;
+            bestDistance = distance;
+        }
+    }
+    return vertices[best];
+}
+
+real CollisionConvexHull::getRadius() const
+{
+    real radius = 0;
+    for (unsigned i = 0; i < vertices.size(); i++)
+    {
+        real distance = vertices[i].squareMagnitude();
+        if (distance > radius) radius = distance;
+    }
+    return real_sqrt(radius);
+}
+
+ContactBuffer::ContactBuffer(unsigned initialCapacity, unsigned chunkSize,
+                             unsigned maxContacts)
+:
+chunkSize(chunkSize > 0 ? chunkSize : 1),
+maxContacts(maxContacts),
+chunkStart(0),
+overflowFrames(0),
+refusedRequests(0),
+peakContacts(0)
+{
+    Chunk main;
+    main.capacity = initialCapacity > 0 ? initialCapacity : this->chunkSize;
+    main.contacts = new Contact[main.capacity];
+    main.used = 0;
+    chunks.push_back(main);
+}
+
+ContactBuffer::~ContactBuffer()
+{
+    releaseChunks();
+    delete[] chunks[0].contacts;
+}
+
+void ContactBuffer::releaseChunks()
+{
+    for (unsigned i = 1; i < chunks.size(); i++)
+    {
+        delete[] chunks[i].contacts;
+    }
+    chunks.resize(1);
+}
+
+void ContactBuffer::begin(CollisionData *data)
+{
+    // Any chunks still here weren't joined by finish, so their
+    // contacts are thrown away with the rest of the last frame's.
+    releaseChunks();
+    chunks[0].used = 0;
+    chunkStart = 0;
+
+    unsigned room = chunks[0].capacity;
+    if (maxContacts > 0 && room > maxContacts) room = maxContacts;
+
+    data->buffer = this;
+    data->contactArray = chunks[0].contacts;
+    data->contacts = chunks[0].contacts;
+    data->contactsLeft = room;
+    data->contactCount = 0;
+}
+
+bool ContactBuffer::grow(CollisionData *data, unsigned minimum)
+{
+    unsigned size = minimum > chunkSize ? minimum : chunkSize;
+    if (maxContacts > 0)
+    {
+        unsigned room = data->contactCount < maxContacts ?
+            maxContacts - data->contactCount : 0;
+        if (room < minimum)
+        {
+            refusedRequests++;
+            return false;
+        }
+        if (size > room) size = room;
+    }
+
+    // Close the chunk we're writing, and start a new one.
+    chunks.back().used = data->contactCount - chunkStart;
+    chunkStart = data->contactCount;
+
+    Chunk chunk;
+    chunk.contacts = new Contact[size];
+    chunk.capacity = size;
+    chunk.used = 0;
+    chunks.push_back(chunk);
+
+    data->contacts = chunk.contacts;
+    data->contactsLeft = size;
+    return true;
+}
+
+void ContactBuffer::finish(CollisionData *data)
+{
+    unsigned total = data->contactCount;
+    if (total > peakContacts) peakContacts = total;
+
+    // If everything fitted in the main block there is nothing to do.
+    if (chunks.size() == 1)
+    {
+        chunks[0].used = total;
+        return;
+    }
+    chunks.back().used = total - chunkStart;
+    overflowFrames++;
+
+    // Make a main block with room for all this frame's contacts and
+    // a chunk to spare, and copy them in.
+    unsigned capacity = total + chunkSize;
+    if (maxContacts > 0 && capacity > maxContacts && total <= maxContacts)
+    {
+        capacity = maxContacts;
+    }
+
+    Contact *joined = new Contact[capacity];
+    unsigned next = 0;
+    for (unsigned i = 0; i < chunks.size(); i++)
+    {
+        for (unsigned j = 0; j < chunks[i].used; j++)
+        {
+            joined[next++] = chunks[i].contacts[j];
+        }
+    }
+
+    releaseChunks();
+    delete[] chunks[0].contacts;
+    chunks[0].contacts = joined;
+    chunks[0].capacity = capacity;
+    chunks[0].used = total;
+    chunkStart = 0;
+
+    data->contactArray = joined;
+    data->contacts = joined + total;
+    data->contactsLeft = capacity - total;
+}
+
+SeparatingAxisCache::SeparatingAxisCache()
+:
+count(0), frame(0)
+{
+    Entry empty = { NULL, NULL, NO_AXIS, 0 };
+    entries.assign(64, empty);
+}
+
+unsigned& SeparatingAxisCache::find(const CollisionBox *one,
+                                    const CollisionBox *two)
+{
+    // Keep the table no more than half full, so probes stay short.
+    if ((count + 1) * 2 > entries.size())
+    {
+        rehash((unsigned)entries.size() * 2);
+    }
+
+    size_t hash = ((size_t)one >> 3) * 31 + ((size_t)two >> 3);
+    hash ^= hash >> 16;
+    hash *= 0x45d9f3b;
+    hash ^= hash >> 16;
+
+    size_t mask = entries.size() - 1;
+    size_t slot = hash & mask;
+    while (entries[slot].one &&
+        (entries[slot].one != one || entries[slot].two != two))
+    {
+        slot = (slot + 1) & mask;
+    }
+
+    Entry &entry = entries[slot];
+    if (!entry.one)
+    {
+        entry.one = one;
+        entry.two = two;
+        entry.axis = NO_AXIS;
+        count++;
+    }
+    entry.lastFrame = frame;
+    return entry.axis;
+}
+
+void SeparatingAxisCache::rehash(unsigned capacity)
+{
+    std::vector<Entry> old;
+    old.swap(entries);
+
+    Entry empty = { NULL, NULL, NO_AXIS, 0 };
+    entries.assign(capacity, empty);
+    count = 0;
+
+    size_t mask = capacity - 1;
+    for (unsigned i = 0; i < old.size(); i++)
+    {
+        const Entry &entry = old[i];
+        if (!entry.one || entry.lastFrame + 1 < frame) continue;
+
+        size_t hash = ((size_t)entry.one >> 3) * 31 +
+            ((size_t)entry.two >> 3);
+        hash ^= hash >> 16;
+        hash *= 0x45d9f3b;
+        hash ^= hash >> 16;
+
+        size_t slot = hash & mask;
+        while (entries[slot].one) slot = (slot + 1) & mask;
+        entries[slot] = entry;
+        count++;
+    }
+}
+
+void SeparatingAxisCache::nextFrame()
+{
+    frame++;
+
+    // Drop the old entries once the table is getting full, growing it
+    // if that doesn't free enough room.
+    unsigned capacity = (unsigned)entries.size();
+    if (count * 8 > capacity * 3)
+    {
+        rehash(capacity);
+        if (count * 4 > capacity) rehash(capacity * 2);
+    }
+}
+
+void SeparatingAxisCache::clear()
+{
+    Entry empty = { NULL, NULL, NO_AXIS, 0 };
+    entries.assign(entries.size(), empty);
+    count = 0;
 }
 
 bool IntersectionTests::sphereAndHalfSpace(
@@ -49,6 +363,97 @@ bool IntersectionTests::sphereAndSphere(
         (one.radius+two.radius)*(one.radius+two.radius);
 }
 
+void TriggerEventBuffer::begin()
+{
+    lastOverlaps.swap(overlaps);
+    overlaps.clear();
+}
+
+void TriggerEventBuffer::finish()
+{
+    events.clear();
+
+    lastSorted.swap(sorted);
+    sorted = overlaps;
+    std::sort(sorted.begin(), sorted.end());
+
+    TriggerEvent event;
+    event.type = TriggerEvent::TRIGGER_EXIT;
+    for (unsigned i = 0; i < lastOverlaps.size(); i++)
+    {
+        if (std::binary_search(sorted.begin(), sorted.end(), lastOverlaps[i]))
+        {
+            continue;
+        }
+        event.trigger = lastOverlaps[i].first;
+        event.other = lastOverlaps[i].second;
+        events.push_back(event);
+    }
+
+    event.type = TriggerEvent::TRIGGER_ENTER;
+    for (unsigned i = 0; i < overlaps.size(); i++)
+    {
+        if (std::binary_search(lastSorted.begin(), lastSorted.end(),
+            overlaps[i]))
+        {
+            continue;
+        }
+        event.trigger = overlaps[i].first;
+        event.other = overlaps[i].second;
+        events.push_back(event);
+    }
+}
+
+bool TriggerEventBuffer::isOverlapping(CollisionPrimitive *trigger,
+                                       CollisionPrimitive *other) const
+{
+    return std::binary_search(sorted.begin(), sorted.end(),
+        Overlap(trigger, other));
+}
+
+void TriggerEventBuffer::clear()
+{
+    overlaps.clear();
+    lastOverlaps.clear();
+    sorted.clear();
+    lastSorted.clear();
+    events.clear();
+}
+
+void CollisionSphereBatch::clear()
+{
+    x.clear();
+    y.clear();
+    z.clear();
+    radius.clear();
+    body.clear();
+}
+
+unsigned CollisionSphereBatch::add(RigidBody *body, const Vector3 &centre,
+                                   real radius)
+{
+    x.push_back(centre.x);
+    y.push_back(centre.y);
+    z.push_back(centre.z);
+    CollisionSphereBatch::radius.push_back(radius);
+    CollisionSphereBatch::body.push_back(body);
+    return size() - 1;
+}
+
+unsigned CollisionSphereBatch::add(const CollisionSphere &sphere)
+{
+    return add(sphere.body, sphere.getAxis(3), sphere.radius);
+}
+
+/*
+ * The number of spheres or pairs the batched sphere tests work on
+ * at once. Each chunk is gathered into local arrays and tested in a
+ * single loop with no branches, which the compiler can turn into
+ * SIMD instructions. Contacts are then written for the hits in the
+ * chunk.
+ */
+#define SPHERE_BATCH_LANES 16
+
 static inline real transformToAxis(
     const CollisionBox &box,
     const Vector3 &axis
@@ -73,6 +478,10 @@ static inline bool overlapOnAxis(
     const Vector3 &toCentre
     )
 {
+    // Cross products of parallel edges give no axis to test. The
+    // face axes cover that case.
+    if (axis.squareMagnitude() < 0.0001) return true;
+
     // Project the half-size of one onto axis
     real oneProject = transformToAxis(one, axis);
     real twoProject = transformToAxis(two, axis);
@@ -93,6 +502,9 @@ bool IntersectionTests::boxAndBox(
     const CollisionBox &two
     )
 {
+    // Check the world bounds first, which is much cheaper.
+    if (!one.getWorldBounds().overlaps(&two.getWorldBounds())) return false;
+
     // Find the vector between the two centres
     Vector3 toCentre = two.getAxis(3) - one.getAxis(3);
 
@@ -121,6 +533,27 @@ bool IntersectionTests::boxAndBox(
 }
 #undef TEST_OVERLAP
 
+bool IntersectionTests::boxAndSphere(
+    const CollisionBox &box,
+    const CollisionSphere &sphere
+    )
+{
+    // Find the closest point in the box to the centre of the sphere,
+    // in box coordinates.
+    Vector3 relCentre = box.transform.transformInverse(sphere.getAxis(3));
+    Vector3 closestPt;
+    for (unsigned i = 0; i < 3; i++)
+    {
+        real dist = relCentre[i];
+        if (dist > box.halfSize[i]) dist = box.halfSize[i];
+        if (dist < -box.halfSize[i]) dist = -box.halfSize[i];
+        closestPt[i] = dist;
+    }
+
+    return (closestPt - relCentre).squareMagnitude() <
+        sphere.radius * sphere.radius;
+}
+
 bool IntersectionTests::boxAndHalfSpace(
     const CollisionBox &box,
     const CollisionPlane &plane
@@ -146,7 +579,7 @@ unsigned CollisionDetector::sphereAndTruePlane(
     )
 {
     // Make sure we have contacts
-    if (data->contactsLeft <= 0) return 0;
+    if (!data->hasMoreContacts()) return 0;
 
     // Cache the sphere position
     Vector3 position = sphere.getAxis(3);
@@ -155,7 +588,8 @@ unsigned CollisionDetector::sphereAndTruePlane(
     real centreDistance = plane.direction * position - plane.offset;
 
     // Check if we're within radius
-    if (centreDistance*centreDistance > sphere.radius*sphere.radius)
+    real reach = sphere.radius + data->margin;
+    if (centreDistance*centreDistance > reach*reach)
     {
         return 0;
     }
@@ -189,7 +623,7 @@ unsigned CollisionDetector::sphereAndHalfSpace(
     )
 {
     // Make sure we have contacts
-    if (data->contactsLeft <= 0) return 0;
+    if (!data->hasMoreContacts()) return 0;
 
     // Cache the sphere position
     Vector3 position = sphere.getAxis(3);
@@ -199,7 +633,7 @@ unsigned CollisionDetector::sphereAndHalfSpace(
         plane.direction * position -
         sphere.radius - plane.offset;
 
-    if (ballDistance >= 0) return 0;
+    if (ballDistance >= data->margin) return 0;
 
     // Create the contact - it has a normal in the plane direction.
     Contact* contact = data->contacts;
@@ -221,7 +655,7 @@ unsigned CollisionDetector::sphereAndSphere(
     )
 {
     // Make sure we have contacts
-    if (data->contactsLeft <= 0) return 0;
+    if (!data->hasMoreContacts()) return 0;
 
     // Cache the sphere positions
     Vector3 positionOne = one.getAxis(3);
@@ -232,7 +666,7 @@ unsigned CollisionDetector::sphereAndSphere(
     real size = midline.magnitude();
 
     // See if it is large enough.
-    if (size <= 0.0f || size >= one.radius+two.radius)
+    if (size <= 0.0f || size >= one.radius+two.radius+data->margin)
     {
         return 0;
     }
@@ -243,7 +677,7 @@ unsigned CollisionDetector::sphereAndSphere(
 
     Contact* contact = data->contacts;
     contact->contactNormal = normal;
-    contact->contactPoint = positionOne + midline * (real)0.5;
+    contact->contactPoint = positionOne - midline * (real)0.5;
     contact->penetration = (one.radius+two.radius - size);
     contact->setBodyData(one.body, two.body,
         data->friction, data->restitution);
@@ -252,6 +686,191 @@ unsigned CollisionDetector::sphereAndSphere(
     return 1;
 }
 
+unsigned CollisionDetector::sphereAndHalfSpaceBatch(
+    const CollisionSphereBatch &spheres,
+    const CollisionPlane &plane,
+    CollisionData *data
+    )
+{
+    unsigned used = 0;
+    unsigned count = spheres.size();
+    real distance[SPHERE_BATCH_LANES];
+
+    for (unsigned first = 0; first < count; first += SPHERE_BATCH_LANES)
+    {
+        unsigned lanes = count - first;
+        if (lanes > SPHERE_BATCH_LANES) lanes = SPHERE_BATCH_LANES;
+
+        // Find the distance of each ball from the plane.
+        const real *x = &spheres.x[first];
+        const real *y = &spheres.y[first];
+        const real *z = &spheres.z[first];
+        const real *radius = &spheres.radius[first];
+        for (unsigned lane = 0; lane < lanes; lane++)
+        {
+            distance[lane] =
+                plane.direction.x * x[lane] +
+                plane.direction.y * y[lane] +
+                plane.direction.z * z[lane] -
+                radius[lane] - plane.offset;
+        }
+
+        // Create the contacts for the balls that are through it.
+        for (unsigned lane = 0; lane < lanes; lane++)
+        {
+            if (distance[lane] >= data->margin) continue;
+            if (!data->hasMoreContacts()) return used;
+
+            real ballDistance = distance[lane];
+            Vector3 position(x[lane], y[lane], z[lane]);
+
+            Contact* contact = data->contacts;
+            contact->contactNormal = plane.direction;
+            contact->penetration = -ballDistance;
+            contact->contactPoint =
+                position - plane.direction * (ballDistance + radius[lane]);
+            contact->setBodyData(spheres.body[first + lane], NULL,
+                data->friction, data->restitution);
+
+            data->addContacts(1);
+            used++;
+        }
+    }
+    return used;
+}
+
+unsigned CollisionDetector::sphereAndTruePlaneBatch(
+    const CollisionSphereBatch &spheres,
+    const CollisionPlane &plane,
+    CollisionData *data
+    )
+{
+    unsigned used = 0;
+    unsigned count = spheres.size();
+    real distance[SPHERE_BATCH_LANES];
+    unsigned char touching[SPHERE_BATCH_LANES];
+    real margin = data->margin;
+
+    for (unsigned first = 0; first < count; first += SPHERE_BATCH_LANES)
+    {
+        unsigned lanes = count - first;
+        if (lanes > SPHERE_BATCH_LANES) lanes = SPHERE_BATCH_LANES;
+
+        // Find the distance of each centre from the plane, and
+        // whether it's within the radius.
+        const real *x = &spheres.x[first];
+        const real *y = &spheres.y[first];
+        const real *z = &spheres.z[first];
+        const real *radius = &spheres.radius[first];
+        for (unsigned lane = 0; lane < lanes; lane++)
+        {
+            distance[lane] =
+                plane.direction.x * x[lane] +
+                plane.direction.y * y[lane] +
+                plane.direction.z * z[lane] -
+                plane.offset;
+            real reach = radius[lane] + margin;
+            touching[lane] = distance[lane]*distance[lane] <= reach*reach;
+        }
+
+        // Create the contacts, on whichever side of the plane each
+        // ball is.
+        for (unsigned lane = 0; lane < lanes; lane++)
+        {
+            if (!touching[lane]) continue;
+            if (!data->hasMoreContacts()) return used;
+
+            real centreDistance = distance[lane];
+            Vector3 position(x[lane], y[lane], z[lane]);
+            Vector3 normal = plane.direction;
+            real penetration = -centreDistance;
+            if (centreDistance < 0)
+            {
+                normal *= -1;
+                penetration = -penetration;
+            }
+            penetration += radius[lane];
+
+            Contact* contact = data->contacts;
+            contact->contactNormal = normal;
+            contact->penetration = penetration;
+            contact->contactPoint = position - plane.direction * centreDistance;
+            contact->setBodyData(spheres.body[first + lane], NULL,
+                data->friction, data->restitution);
+
+            data->addContacts(1);
+            used++;
+        }
+    }
+    return used;
+}
+
+unsigned CollisionDetector::sphereAndSphereBatch(
+    const CollisionSphereBatch &spheres,
+    const unsigned *pairs,
+    unsigned pairCount,
+    CollisionData *data,
+    unsigned *pairHits
+    )
+{
+    unsigned used = 0;
+    real dx[SPHERE_BATCH_LANES], dy[SPHERE_BATCH_LANES], dz[SPHERE_BATCH_LANES];
+    real radiusSum[SPHERE_BATCH_LANES], sizeSquared[SPHERE_BATCH_LANES];
+    unsigned char touching[SPHERE_BATCH_LANES];
+    real margin = data->margin;
+
+    for (unsigned first = 0; first < pairCount; first += SPHERE_BATCH_LANES)
+    {
+        unsigned lanes = pairCount - first;
+        if (lanes > SPHERE_BATCH_LANES) lanes = SPHERE_BATCH_LANES;
+
+        // Gather the midlines between each pair of centres.
+        const unsigned *pair = pairs + first*2;
+        for (unsigned lane = 0; lane < lanes; lane++)
+        {
+            unsigned one = pair[lane*2], two = pair[lane*2+1];
+            dx[lane] = spheres.x[one] - spheres.x[two];
+            dy[lane] = spheres.y[one] - spheres.y[two];
+            dz[lane] = spheres.z[one] - spheres.z[two];
+            radiusSum[lane] = spheres.radius[one] + spheres.radius[two];
+        }
+
+        // Check them all in one pass.
+        for (unsigned lane = 0; lane < lanes; lane++)
+        {
+            real reach = radiusSum[lane] + margin;
+            sizeSquared[lane] =
+                dx[lane]*dx[lane] + dy[lane]*dy[lane] + dz[lane]*dz[lane];
+            touching[lane] = (sizeSquared[lane] > 0) &
+                (sizeSquared[lane] < reach*reach);
+        }
+
+        // Create the contacts for the pairs that are touching.
+        for (unsigned lane = 0; lane < lanes; lane++)
+        {
+            if (!touching[lane]) continue;
+            if (!data->hasMoreContacts()) return used;
+
+            unsigned one = pair[lane*2], two = pair[lane*2+1];
+            real size = real_sqrt(sizeSquared[lane]);
+            Vector3 midline(dx[lane], dy[lane], dz[lane]);
+            Vector3 positionOne(spheres.x[one], spheres.y[one], spheres.z[one]);
+
+            Contact* contact = data->contacts;
+            contact->contactNormal = midline * (((real)1.0)/size);
+            contact->contactPoint = positionOne - midline * (real)0.5;
+            contact->penetration = radiusSum[lane] - size;
+            contact->setBodyData(spheres.body[one], spheres.body[two],
+                data->friction, data->restitution);
+
+            data->addContacts(1);
+            if (pairHits) pairHits[used] = first + lane;
+            used++;
+        }
+    }
+    return used;
+}
+
 
 
 
@@ -282,28 +901,172 @@ static inline real penetrationOnAxis(
 }
 
 
-static inline bool tryAxis(
+/*
+ * The number of axes tested by the box-box separating axis kernel,
+ * rounded up to a whole number of SIMD registers.
+ */
+#define BOX_AXIS_LANES 16
+
+/*
+ * This function runs the separating axis test for all fifteen
+ * axes of a pair of boxes at once: the three face normals of each
+ * box, then the nine cross products of their edges (in the order
+ * one's axis 0 with two's axes 0, 1 and 2, then one's axis 1 and so
+ * on).
+ *
+ * Rather than projecting the boxes onto each axis in turn, it works
+ * out the nine dot products between the two boxes' axes once, and
+ * uses them to fill arrays holding the projected half-sizes and
+ * centre distance for every axis. The penetrations are then found
+ * in a single pass over those arrays, which has no branches and so
+ * is turned into SIMD instructions by the compiler, followed by a
+ * reduction to find the smallest.
+ *
+ * Returns false if the boxes are further apart than the margin,
+ * along with the axis that separates them furthest. Otherwise the
+ * smallest penetration and its axis are returned, along with the
+ * best face axis (used for the edge-edge case). The penetration is
+ * negative if the boxes are apart but within the margin. Almost
+ * parallel edges give a degenerate axis, which is skipped.
+ */
+static inline bool findBoxAndBoxAxis(
     const CollisionBox &one,
     const CollisionBox &two,
-    Vector3 axis,
-    const Vector3& toCentre,
-    unsigned index,
-
-    // These values may be updated
-    real& smallestPenetration,
-    unsigned &smallestCase
+    const Vector3 &toCentre,
+    real margin,
+    real &smallestPenetration,
+    unsigned &smallestCase,
+    unsigned &smallestSingleAxis,
+    unsigned &separatingAxis
     )
 {
-    // Make sure we have a normalized axis, and don't check almost parallel axes
-    if (axis.squareMagnitude() < 0.0001) return true;
-    axis.normalise();
+    // Find the axes of two in one's coordinates, along with the
+    // centre offset in both boxes' coordinates.
+    real r[3][3], absR[3][3], t[3], tTwo[3];
+    for (unsigned i = 0; i < 3; i++)
+    {
+        Vector3 oneAxis = one.getAxis(i);
+        for (unsigned j = 0; j < 3; j++)
+        {
+            r[i][j] = oneAxis * two.getAxis(j);
+            absR[i][j] = real_abs(r[i][j]);
+        }
+        t[i] = toCentre * oneAxis;
+        tTwo[i] = toCentre * two.getAxis(i);
+    }
+
+    // Fill in the projection of each box onto each axis, and the
+    // projection of the offset between them.
+    real oneProject[BOX_AXIS_LANES];
+    real twoProject[BOX_AXIS_LANES];
+    real distance[BOX_AXIS_LANES];
+    real lengthSquared[BOX_AXIS_LANES];
+
+    for (unsigned i = 0; i < 3; i++)
+    {
+        // One's face axes.
+        oneProject[i] = one.halfSize[i];
+        twoProject[i] =
+            two.halfSize.x * absR[i][0] +
+            two.halfSize.y * absR[i][1] +
+            two.halfSize.z * absR[i][2];
+        distance[i] = t[i];
+        lengthSquared[i] = 1;
+
+        // Two's face axes.
+        oneProject[i+3] =
+            one.halfSize.x * absR[0][i] +
+            one.halfSize.y * absR[1][i] +
+            one.halfSize.z * absR[2][i];
+        twoProject[i+3] = two.halfSize[i];
+        distance[i+3] = tTwo[i];
+        lengthSquared[i+3] = 1;
+    }
+
+    for (unsigned i = 0; i < 3; i++)
+    {
+        unsigned i1 = (i+1)%3, i2 = (i+2)%3;
+        for (unsigned j = 0; j < 3; j++)
+        {
+            unsigned j1 = (j+1)%3, j2 = (j+2)%3;
+            unsigned lane = 6 + i*3 + j;
+
+            // The edge axis is one's axis i crossed with two's
+            // axis j. It isn't normalised, so the penetration is
+            // scaled by its length below.
+            oneProject[lane] =
+                one.halfSize[i1] * absR[i2][j] +
+                one.halfSize[i2] * absR[i1][j];
+            twoProject[lane] =
+                two.halfSize[j1] * absR[i][j2] +
+                two.halfSize[j2] * absR[i][j1];
+            distance[lane] = t[i2] * r[i1][j] - t[i1] * r[i2][j];
+            lengthSquared[lane] = r[i1][j]*r[i1][j] + r[i2][j]*r[i2][j];
+        }
+    }
+
+    // The spare lane can never be chosen or separate the boxes.
+    oneProject[15] = 0;
+    twoProject[15] = 0;
+    distance[15] = 0;
+    lengthSquared[15] = 0;
+
+    // Work out the penetration on every axis in one pass. Degenerate
+    // axes get the largest penetration so they are never chosen.
+    real penetration[BOX_AXIS_LANES];
+    real separation[BOX_AXIS_LANES];
+    for (unsigned lane = 0; lane < BOX_AXIS_LANES; lane++)
+    {
+        real overlap =
+            oneProject[lane] + twoProject[lane] - real_abs(distance[lane]);
+        real valid = lengthSquared[lane] < 0.0001 ? 0 : 1;
+        real scale = ((real)1.0) / real_sqrt(lengthSquared[lane] + 1 - valid);
+
+        separation[lane] = (overlap * scale + margin) * valid;
+        penetration[lane] = valid * overlap * scale + (1 - valid) * REAL_MAX;
+    }
 
-    real penetration = penetrationOnAxis(one, two, axis, toCentre);
+    // Reduce to find whether any axis separates the boxes, and which
+    // axis has the smallest penetration. Ties go to the earlier axis.
+    real smallestSeparation = separation[0];
+    for (unsigned lane = 1; lane < BOX_AXIS_LANES; lane++)
+    {
+        if (separation[lane] < smallestSeparation)
+        {
+            smallestSeparation = separation[lane];
+        }
+    }
+    if (smallestSeparation < 0)
+    {
+        separatingAxis = 0;
+        for (unsigned lane = 1; lane < 15; lane++)
+        {
+            if (penetration[lane] < penetration[separatingAxis])
+            {
+                separatingAxis = lane;
+            }
+        }
+        return false;
+    }
 
-    if (penetration < 0) return false;
-    if (penetration < smallestPenetration) {
-        smallestPenetration = penetration;
-        smallestCase = index;
+    smallestPenetration = REAL_MAX;
+    smallestCase = 0xffffff;
+    for (unsigned lane = 0; lane < 6; lane++)
+    {
+        if (penetration[lane] < smallestPenetration)
+        {
+            smallestPenetration = penetration[lane];
+            smallestCase = lane;
+        }
+    }
+    smallestSingleAxis = smallestCase;
+    for (unsigned lane = 6; lane < 15; lane++)
+    {
+        if (penetration[lane] < smallestPenetration)
+        {
+            smallestPenetration = penetration[lane];
+            smallestCase = lane;
+        }
     }
     return true;
 }
@@ -346,7 +1109,232 @@ void fillPointFaceBoxBox(
         data->friction, data->restitution);
 }
 
-static inline Vector3 contactPoint(
+/*
+ * Chooses which of the given contact points to keep when there are
+ * more than the given limit, writing their indices into chosen in
+ * order of importance and returning how many were chosen. The
+ * deepest point comes first, then the point furthest from it, then
+ * the points making the largest triangles with those two on either
+ * side, so the points kept cover as much of the contact area as
+ * possible.
+ */
+static unsigned chooseContactPoints(
+    const Vector3 *points,
+    const real *depths,
+    unsigned count,
+    const Vector3 &normal,
+    unsigned limit,
+    unsigned *chosen
+    )
+{
+    if (count <= limit)
+    {
+        for (unsigned i = 0; i < count; i++) chosen[i] = i;
+        return count;
+    }
+    if (limit == 0) return 0;
+
+    // Start with the deepest point.
+    unsigned deepest = 0;
+    for (unsigned i = 1; i < count; i++)
+    {
+        if (depths[i] > depths[deepest]) deepest = i;
+    }
+    chosen[0] = deepest;
+    if (limit == 1) return 1;
+
+    // Then the point furthest from it.
+    unsigned furthest = deepest;
+    real furthestDistance = -1;
+    for (unsigned i = 0; i < count; i++)
+    {
+        real distance = (points[i] - points[deepest]).squareMagnitude();
+        if (i != deepest && distance > furthestDistance)
+        {
+            furthest = i;
+            furthestDistance = distance;
+        }
+    }
+    chosen[1] = furthest;
+    if (limit == 2) return 2;
+
+    // Then the points giving the largest triangles on each side of
+    // the line between the first two.
+    Vector3 line = points[furthest] - points[deepest];
+    unsigned positive = count, negative = count;
+    real mostPositive = 0, mostNegative = 0;
+    for (unsigned i = 0; i < count; i++)
+    {
+        if (i == deepest || i == furthest) continue;
+        real area = (line % (points[i] - points[deepest])) * normal;
+        if (area > mostPositive)
+        {
+            positive = i;
+            mostPositive = area;
+        }
+        else if (area < mostNegative)
+        {
+            negative = i;
+            mostNegative = area;
+        }
+    }
+
+    unsigned used = 2;
+    if (positive < count) chosen[used++] = positive;
+    if (negative < count && used < limit) chosen[used++] = negative;
+    return used;
+}
+
+/*
+ * This function is called when the axis of least penetration is a
+ * face of box one. Rather than a single vertex of box two, it finds
+ * the face of box two that is turned most towards that face, and
+ * clips it against the sides of box one's face (Sutherland-Hodgman
+ * clipping). The clipped points that are inside box one become the
+ * contacts, up to four of them, so a box resting on another box is
+ * supported across its whole face.
+ *
+ * The bodies are given to the contacts in the order one, two, and
+ * each contact gets a feature identifier made from the two faces and
+ * where on box two's face the point came from. If flipped is true
+ * the caller has swapped the boxes, and this is recorded in the
+ * identifier too. Returns the number of contacts written, or zero if
+ * clipping left no points.
+ */
+static unsigned fillFaceFaceBoxBox(
+    const CollisionBox &one,
+    const CollisionBox &two,
+    const Vector3 &toCentre,
+    CollisionData *data,
+    unsigned best,
+    bool flipped
+    )
+{
+    if (data->contactsLeft <= 0) return 0;
+
+    // Work out which face of one we're clipping against, and the
+    // contact normal (which points from two towards one).
+    Vector3 axis = one.getAxis(best);
+    real faceSign = (axis * toCentre > 0) ? 1 : -1;
+    Vector3 normal = axis * -faceSign;
+
+    // Find the face of two that is turned most towards one.
+    unsigned incident = 0;
+    real incidentDot = 0;
+    for (unsigned i = 0; i < 3; i++)
+    {
+        real dot = two.getAxis(i) * normal;
+        if (real_abs(dot) > real_abs(incidentDot))
+        {
+            incident = i;
+            incidentDot = dot;
+        }
+    }
+    real incidentSign = (incidentDot > 0) ? 1 : -1;
+
+    // Build the incident face's corners, in order around the face,
+    // and move them into one's coordinates.
+    const unsigned maxPoints = 8;
+    Vector3 polygon[maxPoints], clipped[maxPoints];
+    unsigned tags[maxPoints], clippedTags[maxPoints];
+    unsigned u = (incident+1)%3, v = (incident+2)%3;
+    Vector3 faceCentre = two.getAxis(3) +
+        two.getAxis(incident) * (incidentSign * two.halfSize[incident]);
+    static const real cornerSigns[4][2] = {{1,1}, {-1,1}, {-1,-1}, {1,-1}};
+    for (unsigned i = 0; i < 4; i++)
+    {
+        Vector3 corner = faceCentre +
+            two.getAxis(u) * (cornerSigns[i][0] * two.halfSize[u]) +
+            two.getAxis(v) * (cornerSigns[i][1] * two.halfSize[v]);
+        polygon[i] = one.getTransform().transformInverse(corner);
+        tags[i] = i;
+    }
+    unsigned count = 4;
+
+    // Clip the face against the four sides of one's face. Points
+    // created by clipping are tagged with the side and the point
+    // before them, so they can be recognised next frame.
+    for (unsigned side = 0; side < 4 && count > 0; side++)
+    {
+        unsigned sideAxis = (best + 1 + side/2) % 3;
+        real sideSign = (side & 1) ? -1 : 1;
+        real limit = one.halfSize[sideAxis];
+
+        unsigned clippedCount = 0;
+        for (unsigned i = 0; i < count; i++)
+        {
+            const Vector3 &start = polygon[i];
+            const Vector3 &end = polygon[(i+1) % count];
+            real startDistance = sideSign * start[sideAxis] - limit;
+            real endDistance = sideSign * end[sideAxis] - limit;
+
+            if (startDistance <= 0)
+            {
+                clipped[clippedCount] = start;
+                clippedTags[clippedCount++] = tags[i];
+            }
+            if ((startDistance <= 0) != (endDistance <= 0))
+            {
+                real t = startDistance / (startDistance - endDistance);
+                clipped[clippedCount] = start + (end - start) * t;
+                clippedTags[clippedCount++] =
+                    ((side+1) << 4) | (tags[i] & 0xf);
+            }
+        }
+
+        for (unsigned i = 0; i < clippedCount; i++)
+        {
+            polygon[i] = clipped[i];
+            tags[i] = clippedTags[i];
+        }
+        count = clippedCount;
+    }
+
+    // Keep the points that are inside one (or within the margin of
+    // it), back in world coordinates.
+    Vector3 points[maxPoints];
+    real depths[maxPoints];
+    unsigned pointTags[maxPoints];
+    unsigned inside = 0;
+    for (unsigned i = 0; i < count; i++)
+    {
+        real depth = one.halfSize[best] - faceSign * polygon[i][best];
+        if (depth < -data->margin) continue;
+
+        points[inside] = one.getTransform().transform(polygon[i]);
+        depths[inside] = depth;
+        pointTags[inside++] = tags[i];
+    }
+    if (inside == 0) return 0;
+
+    // Reduce to the best four points (or fewer if we're short of
+    // room), and write the contacts.
+    data->reserveContacts(inside < 4 ? inside : 4);
+    unsigned limit = data->contactsLeft < 4 ? data->contactsLeft : 4;
+    unsigned chosen[4];
+    unsigned used = chooseContactPoints(
+        points, depths, inside, normal, limit, chosen
+        );
+
+    unsigned faces =
+        (best*2 + (faceSign > 0)) |
+        ((incident*2 + (incidentSign > 0)) << 3);
+    Contact *contact = data->contacts;
+    for (unsigned i = 0; i < used; i++, contact++)
+    {
+        contact->contactNormal = normal;
+        contact->penetration = depths[chosen[i]];
+        contact->contactPoint = points[chosen[i]];
+        contact->setBodyData(one.body, two.body,
+            data->friction, data->restitution);
+        contact->feature = 0x8000 | (flipped ? 0x4000 : 0) |
+            (pointTags[chosen[i]] << 6) | faces;
+    }
+    data->addContacts(used);
+    return used;
+}
+
+static inline Vector3 contactPoint(
     const Vector3 &pOne,
     const Vector3 &dOne,
     real oneSize,
@@ -401,50 +1389,100 @@ static inline Vector3 contactPoint(
     }
 }
 
-// This preprocessor definition is only used as a convenience
-// in the boxAndBox contact generation method.
-#define CHECK_OVERLAP(axis, index) \
-    if (!tryAxis(one, two, (axis), toCentre, (index), pen, best)) return 0;
+/*
+ * Converts an axis number for the boxes one and two (as used by
+ * findBoxAndBoxAxis) into the number of the same axis with the boxes
+ * the other way around.
+ */
+static inline unsigned swapBoxAndBoxAxis(unsigned axis)
+{
+    if (axis < 3) return axis + 3;
+    if (axis < 6) return axis - 3;
+    axis -= 6;
+    return 6 + (axis % 3) * 3 + axis / 3;
+}
+
+/*
+ * Checks if the given axis, numbered as for findBoxAndBoxAxis,
+ * separates the two boxes by more than the margin.
+ */
+static inline bool separatedOnAxis(
+    const CollisionBox &one,
+    const CollisionBox &two,
+    const Vector3 &toCentre,
+    unsigned axisNumber,
+    real margin
+    )
+{
+    Vector3 axis;
+    if (axisNumber < 3) axis = one.getAxis(axisNumber);
+    else if (axisNumber < 6) axis = two.getAxis(axisNumber - 3);
+    else
+    {
+        axisNumber -= 6;
+        axis = one.getAxis(axisNumber / 3) % two.getAxis(axisNumber % 3);
+        if (axis.squareMagnitude() < 0.0001) return false;
+        axis.normalise();
+    }
+    return penetrationOnAxis(one, two, axis, toCentre) < -margin;
+}
 
 unsigned CollisionDetector::boxAndBox(
     const CollisionBox &one,
     const CollisionBox &two,
-    CollisionData *data
+    CollisionData *data,
+    SeparatingAxisCache *cache
     )
 {
-    //if (!IntersectionTests::boxAndBox(one, two)) return 0;
+    // Make sure we have contacts
+    if (!data->hasMoreContacts()) return 0;
+
+    // Boxes whose world bounds are apart can't touch.
+    if (!one.getWorldBounds().overlaps(&two.getWorldBounds(), data->margin))
+    {
+        return 0;
+    }
 
     // Find the vector between the two centres
     Vector3 toCentre = two.getAxis(3) - one.getAxis(3);
 
-    // We start assuming there is no contact
-    real pen = REAL_MAX;
-    unsigned best = 0xffffff;
-
-    // Now we check each axes, returning if it gives us
-    // a separating axis, and keeping track of the axis with
-    // the smallest penetration otherwise.
-    CHECK_OVERLAP(one.getAxis(0), 0);
-    CHECK_OVERLAP(one.getAxis(1), 1);
-    CHECK_OVERLAP(one.getAxis(2), 2);
-
-    CHECK_OVERLAP(two.getAxis(0), 3);
-    CHECK_OVERLAP(two.getAxis(1), 4);
-    CHECK_OVERLAP(two.getAxis(2), 5);
-
-    // Store the best axis-major, in case we run into almost
-    // parallel edge collisions later
-    unsigned bestSingleAxis = best;
-
-    CHECK_OVERLAP(one.getAxis(0) % two.getAxis(0), 6);
-    CHECK_OVERLAP(one.getAxis(0) % two.getAxis(1), 7);
-    CHECK_OVERLAP(one.getAxis(0) % two.getAxis(2), 8);
-    CHECK_OVERLAP(one.getAxis(1) % two.getAxis(0), 9);
-    CHECK_OVERLAP(one.getAxis(1) % two.getAxis(1), 10);
-    CHECK_OVERLAP(one.getAxis(1) % two.getAxis(2), 11);
-    CHECK_OVERLAP(one.getAxis(2) % two.getAxis(0), 12);
-    CHECK_OVERLAP(one.getAxis(2) % two.getAxis(1), 13);
-    CHECK_OVERLAP(one.getAxis(2) % two.getAxis(2), 14);
+    // Try the axis that separated the boxes last time first. The
+    // cache holds the pair in address order, so the axis may need
+    // converting.
+    unsigned *cachedAxis = NULL;
+    bool swapped = &two < &one;
+    if (cache)
+    {
+        cachedAxis = swapped ? &cache->find(&two, &one)
+                             : &cache->find(&one, &two);
+        unsigned axis = *cachedAxis;
+        if (axis != SeparatingAxisCache::NO_AXIS)
+        {
+            if (swapped) axis = swapBoxAndBoxAxis(axis);
+            if (separatedOnAxis(one, two, toCentre, axis, data->margin))
+            {
+                return 0;
+            }
+        }
+    }
+
+    // Check all the axes, returning if one of them separates the
+    // boxes, and otherwise finding the axis with the smallest
+    // penetration. We also keep the best face axis, in case we run
+    // into almost parallel edge collisions later.
+    real pen;
+    unsigned best, bestSingleAxis, separatingAxis;
+    if (!findBoxAndBoxAxis(one, two, toCentre, data->margin,
+        pen, best, bestSingleAxis, separatingAxis))
+    {
+        if (cachedAxis)
+        {
+            *cachedAxis = swapped ? swapBoxAndBoxAxis(separatingAxis)
+                                  : separatingAxis;
+        }
+        return 0;
+    }
+    if (cachedAxis) *cachedAxis = SeparatingAxisCache::NO_AXIS;
 
     // Make sure we've got a result.
     assert(best != 0xffffff);
@@ -455,17 +1493,27 @@ unsigned CollisionDetector::boxAndBox(
     // the case.
     if (best < 3)
     {
-        // We've got a vertex of box two on a face of box one.
+        // We've got box two touching a face of box one. Clip to
+        // find the whole contact area, falling back to the deepest
+        // vertex if clipping fails for numerical reasons.
+        unsigned used = fillFaceFaceBoxBox(one, two, toCentre, data, best, false);
+        if (used > 0) return used;
+
         fillPointFaceBoxBox(one, two, toCentre, data, best, pen);
         data->addContacts(1);
         return 1;
     }
     else if (best < 6)
     {
-        // We've got a vertex of box one on a face of box two.
+        // We've got box one touching a face of box two.
         // We use the same algorithm as above, but swap around
         // one and two (and therefore also the vector between their
         // centres).
+        unsigned used = fillFaceFaceBoxBox(
+            two, one, toCentre*-1.0f, data, best-3, true
+            );
+        if (used > 0) return used;
+
         fillPointFaceBoxBox(two, one, toCentre*-1.0f, data, best-3, pen);
         data->addContacts(1);
         return 1;
@@ -490,15 +1538,26 @@ unsigned CollisionDetector::boxAndBox(
         // its component in the direction of the box's collision axis is zero
         // (its a mid-point) and we determine which of the extremes in each
         // of the other axes is closest.
+        // We also note which edges they are, for the feature
+        // identifier.
         Vector3 ptOnOneEdge = one.halfSize;
         Vector3 ptOnTwoEdge = two.halfSize;
+        unsigned edges = (oneAxisIndex << 2) | twoAxisIndex;
         for (unsigned i = 0; i < 3; i++)
         {
             if (i == oneAxisIndex) ptOnOneEdge[i] = 0;
-            else if (one.getAxis(i) * axis > 0) ptOnOneEdge[i] = -ptOnOneEdge[i];
+            else if (one.getAxis(i) * axis > 0)
+            {
+                ptOnOneEdge[i] = -ptOnOneEdge[i];
+                edges |= 0x10 << i;
+            }
 
             if (i == twoAxisIndex) ptOnTwoEdge[i] = 0;
-            else if (two.getAxis(i) * axis < 0) ptOnTwoEdge[i] = -ptOnTwoEdge[i];
+            else if (two.getAxis(i) * axis < 0)
+            {
+                ptOnTwoEdge[i] = -ptOnTwoEdge[i];
+                edges |= 0x80 << i;
+            }
         }
 
         // Move them into world coordinates (they are already oriented
@@ -523,12 +1582,12 @@ unsigned CollisionDetector::boxAndBox(
         contact->contactPoint = vertex;
         contact->setBodyData(one.body, two.body,
             data->friction, data->restitution);
+        contact->feature = 0x10000 | edges;
         data->addContacts(1);
         return 1;
     }
     return 0;
 }
-#undef CHECK_OVERLAP
 
 
 
@@ -539,6 +1598,9 @@ unsigned CollisionDetector::boxAndPoint(
     CollisionData *data
     )
 {
+    // Make sure we have contacts
+    if (!data->hasMoreContacts()) return 0;
+
     // Transform the point into box coordinates
     Vector3 relPt = box.transform.transformInverse(point);
 
@@ -588,14 +1650,18 @@ unsigned CollisionDetector::boxAndSphere(
     CollisionData *data
     )
 {
+    // Make sure we have contacts
+    if (!data->hasMoreContacts()) return 0;
+
     // Transform the centre of the sphere into box coordinates
     Vector3 centre = sphere.getAxis(3);
     Vector3 relCentre = box.transform.transformInverse(centre);
 
     // Early out check to see if we can exclude the contact
-    if (real_abs(relCentre.x) - sphere.radius > box.halfSize.x ||
-        real_abs(relCentre.y) - sphere.radius > box.halfSize.y ||
-        real_abs(relCentre.z) - sphere.radius > box.halfSize.z)
+    real reach = sphere.radius + data->margin;
+    if (real_abs(relCentre.x) - reach > box.halfSize.x ||
+        real_abs(relCentre.y) - reach > box.halfSize.y ||
+        real_abs(relCentre.z) - reach > box.halfSize.z)
     {
         return 0;
     }
@@ -621,7 +1687,7 @@ unsigned CollisionDetector::boxAndSphere(
 
     // Check we're in contact
     dist = (closestPt - relCentre).squareMagnitude();
-    if (dist > sphere.radius * sphere.radius) return 0;
+    if (dist > reach * reach) return 0;
 
     // Compile the contact
     Vector3 closestPtWorld = box.transform.transform(closestPt);
@@ -641,14 +1707,17 @@ unsigned CollisionDetector::boxAndSphere(
 unsigned CollisionDetector::boxAndHalfSpace(
     const CollisionBox &box,
     const CollisionPlane &plane,
-    CollisionData *data
+    CollisionData *data,
+    bool reduce
     )
 {
     // Make sure we have contacts
-    if (data->contactsLeft <= 0) return 0;
+    if (!data->hasMoreContacts()) return 0;
 
-    // Check for intersection
-    if (!IntersectionTests::boxAndHalfSpace(box, plane))
+    // Check for intersection, with the plane moved out by the margin
+    CollisionPlane reach = plane;
+    reach.offset += data->margin;
+    if (!IntersectionTests::boxAndHalfSpace(box, reach))
     {
         return 0;
     }
@@ -661,8 +1730,9 @@ unsigned CollisionDetector::boxAndHalfSpace(
     static real mults[8][3] = {{1,1,1},{-1,1,1},{1,-1,1},{-1,-1,1},
                                {1,1,-1},{-1,1,-1},{1,-1,-1},{-1,-1,-1}};
 
-    Contact* contact = data->contacts;
-    unsigned contactsUsed = 0;
+    Vector3 points[8];
+    real depths[8];
+    unsigned count = 0;
     for (unsigned i = 0; i < 8; i++) {
 
         // Calculate the position of each vertex
@@ -674,30 +1744,1399 @@ unsigned CollisionDetector::boxAndHalfSpace(
         real vertexDistance = vertexPos * plane.direction;
 
         // Compare this to the plane's distance
-        if (vertexDistance <= plane.offset)
+        if (vertexDistance <= reach.offset)
         {
-            // Create the contact data.
-
             // The contact point is halfway between the vertex and the
             // plane - we multiply the direction by half the separation
             // distance and add the vertex location.
-            contact->contactPoint = plane.direction;
-            contact->contactPoint *= (vertexDistance-plane.offset);
-            contact->contactPoint += vertexPos;
-            contact->contactNormal = plane.direction;
-            contact->penetration = plane.offset - vertexDistance;
+            points[count] = plane.direction;
+            points[count] *= (vertexDistance-plane.offset);
+            points[count] += vertexPos;
+            depths[count] = plane.offset - vertexDistance;
+            count++;
+        }
+    }
 
-            // Write the appropriate data
-            contact->setBodyData(box.body, NULL,
-                data->friction, data->restitution);
+    // Work out which vertices to keep. Without reduction we keep
+    // them in order until we run out of room.
+    data->reserveContacts(reduce && count > 4 ? 4 : count);
+    unsigned limit = (unsigned)data->contactsLeft;
+    if (reduce && limit > 4) limit = 4;
 
-            // Move onto the next contact
-            contact++;
-            contactsUsed++;
-            if (contactsUsed == (unsigned)data->contactsLeft) return contactsUsed;
-        }
+    unsigned chosen[8];
+    unsigned contactsUsed;
+    if (reduce)
+    {
+        contactsUsed = chooseContactPoints(
+            points, depths, count, plane.direction, limit, chosen
+            );
+    }
+    else
+    {
+        contactsUsed = count < limit ? count : limit;
+        for (unsigned i = 0; i < contactsUsed; i++) chosen[i] = i;
+    }
+
+    // Create the contact data.
+    Contact* contact = data->contacts;
+    for (unsigned i = 0; i < contactsUsed; i++, contact++)
+    {
+        contact->contactPoint = points[chosen[i]];
+        contact->contactNormal = plane.direction;
+        contact->penetration = depths[chosen[i]];
+
+        // Write the appropriate data
+        contact->setBodyData(box.body, NULL,
+            data->friction, data->restitution);
     }
 
     data->addContacts(contactsUsed);
     return contactsUsed;
 }
+
+/**
+ * Writes a contact between two spheres at the given positions,
+ * if they are touching. This is the core of the capsule tests,
+ * which reduce to a pair of spheres once the closest points on
+ * their segments have been found. The normal points from the
+ * second sphere to the first. If the centres are at the same
+ * place, the fallback normal is used if one is given.
+ */
+static unsigned sphereContact(
+    const Vector3 &positionOne, real radiusOne, RigidBody *bodyOne,
+    const Vector3 &positionTwo, real radiusTwo, RigidBody *bodyTwo,
+    const Vector3 *fallbackNormal,
+    CollisionData *data
+    )
+{
+    // Make sure we have contacts
+    if (!data->hasMoreContacts()) return 0;
+
+    Vector3 midline = positionOne - positionTwo;
+    real size = midline.magnitude();
+    if (size >= radiusOne + radiusTwo + data->margin) return 0;
+
+    Vector3 normal;
+    if (size > 0.0f)
+    {
+        normal = midline * (((real)1.0)/size);
+    }
+    else if (fallbackNormal)
+    {
+        normal = *fallbackNormal;
+    }
+    else
+    {
+        return 0;
+    }
+
+    Contact* contact = data->contacts;
+    contact->contactNormal = normal;
+    contact->contactPoint = positionOne - midline * (real)0.5;
+    contact->penetration = (radiusOne + radiusTwo - size);
+    contact->setBodyData(bodyOne, bodyTwo,
+        data->friction, data->restitution);
+
+    data->addContacts(1);
+    return 1;
+}
+
+/**
+ * Finds the closest point to the given point on the segment from
+ * start along the given direction, as a proportion of the
+ * direction (so between zero and one).
+ */
+static inline real closestOnSegment(
+    const Vector3 &start,
+    const Vector3 &direction,
+    const Vector3 &point
+    )
+{
+    real length = direction.squareMagnitude();
+    if (length <= 0.0f) return 0;
+
+    real t = ((point - start) * direction) / length;
+    if (t < 0) return 0;
+    if (t > 1) return 1;
+    return t;
+}
+
+/**
+ * Finds the closest points of two segments, each given by a start
+ * point and a direction, as proportions s and t along each.
+ */
+static void closestOnSegments(
+    const Vector3 &startOne,
+    const Vector3 &dirOne,
+    const Vector3 &startTwo,
+    const Vector3 &dirTwo,
+    real *s,
+    real *t
+    )
+{
+    Vector3 r = startOne - startTwo;
+    real a = dirOne.squareMagnitude();
+    real e = dirTwo.squareMagnitude();
+    real b = dirOne * dirTwo;
+    real c = dirOne * r;
+    real f = dirTwo * r;
+    real denom = a*e - b*b;
+
+    if (a <= 0.0f && e <= 0.0f)
+    {
+        // Both segments are points.
+        *s = *t = 0;
+        return;
+    }
+    if (a <= 0.0f)
+    {
+        *s = 0;
+        *t = closestOnSegment(startTwo, dirTwo, startOne);
+        return;
+    }
+    if (e <= 0.0f)
+    {
+        *t = 0;
+        *s = closestOnSegment(startOne, dirOne, startTwo);
+        return;
+    }
+
+    // Find the closest point on the first line to the second,
+    // clamped to the first segment (any s will do if parallel).
+    real sValue = 0;
+    if (denom > 0.0f)
+    {
+        sValue = (b*f - c*e) / denom;
+        if (sValue < 0) sValue = 0;
+        else if (sValue > 1) sValue = 1;
+    }
+
+    // Then the closest point on the second segment to that, and
+    // if it had to be clamped, recompute s for the clamped t.
+    real tValue = (b*sValue + f) / e;
+    if (tValue < 0)
+    {
+        tValue = 0;
+        sValue = -c / a;
+    }
+    else if (tValue > 1)
+    {
+        tValue = 1;
+        sValue = (b - c) / a;
+    }
+    if (sValue < 0) sValue = 0;
+    else if (sValue > 1) sValue = 1;
+
+    *s = sValue;
+    *t = tValue;
+}
+
+unsigned CollisionDetector::capsuleAndHalfSpace(
+    const CollisionCapsule &capsule,
+    const CollisionPlane &plane,
+    CollisionData *data
+    )
+{
+    // Make sure we have contacts
+    if (!data->hasMoreContacts()) return 0;
+    data->reserveContacts(2);
+
+    // Treat each end of the segment as a sphere.
+    unsigned contactsUsed = 0;
+    for (unsigned i = 0; i < 2; i++)
+    {
+        if (!data->hasMoreContacts()) break;
+
+        Vector3 position = capsule.getEnd(i);
+        real endDistance =
+            plane.direction * position -
+            capsule.radius - plane.offset;
+
+        if (endDistance >= data->margin) continue;
+
+        Contact* contact = data->contacts;
+        contact->contactNormal = plane.direction;
+        contact->penetration = -endDistance;
+        contact->contactPoint =
+            position - plane.direction * (endDistance + capsule.radius);
+        contact->setBodyData(capsule.body, NULL,
+            data->friction, data->restitution);
+
+        data->addContacts(1);
+        contactsUsed++;
+    }
+    return contactsUsed;
+}
+
+unsigned CollisionDetector::capsuleAndSphere(
+    const CollisionCapsule &capsule,
+    const CollisionSphere &sphere,
+    CollisionData *data
+    )
+{
+    // Find the point on the segment closest to the sphere, then
+    // treat it as a pair of spheres.
+    Vector3 start = capsule.getEnd(1);
+    Vector3 direction = capsule.getEnd(0) - start;
+    Vector3 centre = sphere.getAxis(3);
+
+    real t = closestOnSegment(start, direction, centre);
+    return sphereContact(
+        start + direction * t, capsule.radius, capsule.body,
+        centre, sphere.radius, sphere.body,
+        NULL, data
+        );
+}
+
+unsigned CollisionDetector::capsuleAndCapsule(
+    const CollisionCapsule &one,
+    const CollisionCapsule &two,
+    CollisionData *data
+    )
+{
+    // Make sure we have contacts
+    if (!data->hasMoreContacts()) return 0;
+
+    Vector3 startOne = one.getEnd(1);
+    Vector3 dirOne = one.getEnd(0) - startOne;
+    Vector3 startTwo = two.getEnd(1);
+    Vector3 dirTwo = two.getEnd(0) - startTwo;
+
+    real a = dirOne.squareMagnitude();
+    real e = dirTwo.squareMagnitude();
+    real b = dirOne * dirTwo;
+    real denom = a*e - b*b;
+
+    // If the segments cross, there's no line between the closest
+    // points to use as a normal, so use the normal of both segments.
+    Vector3 crossing = dirOne % dirTwo;
+    crossing.normalise();
+    const Vector3 *fallback =
+        crossing.squareMagnitude() > 0.0f ? &crossing : NULL;
+
+    // Capsules lying alongside each other touch along a length, so
+    // get a contact at each end of the part they share. Otherwise
+    // they would roll about the single closest point.
+    if (a > 0.0f && e > 0.0f && denom <= (real)0.0001 * a * e)
+    {
+        real sharedStart = closestOnSegment(startOne, dirOne, startTwo);
+        real sharedEnd = closestOnSegment(startOne, dirOne, startTwo + dirTwo);
+        if (sharedStart > sharedEnd)
+        {
+            real temp = sharedStart;
+            sharedStart = sharedEnd;
+            sharedEnd = temp;
+        }
+
+        if ((sharedEnd - sharedStart) * real_sqrt(a) > one.radius)
+        {
+            data->reserveContacts(2);
+            unsigned contactsUsed = 0;
+            real ends[2] = { sharedStart, sharedEnd };
+            for (unsigned i = 0; i < 2; i++)
+            {
+                Vector3 pointOne = startOne + dirOne * ends[i];
+                real t = closestOnSegment(startTwo, dirTwo, pointOne);
+                contactsUsed += sphereContact(
+                    pointOne, one.radius, one.body,
+                    startTwo + dirTwo * t, two.radius, two.body,
+                    fallback, data
+                    );
+            }
+            return contactsUsed;
+        }
+    }
+
+    real s, t;
+    closestOnSegments(startOne, dirOne, startTwo, dirTwo, &s, &t);
+    return sphereContact(
+        startOne + dirOne * s, one.radius, one.body,
+        startTwo + dirTwo * t, two.radius, two.body,
+        fallback, data
+        );
+}
+
+/**
+ * Returns the square of the distance from the given point, in box
+ * coordinates, to the box, and the closest point on the box.
+ */
+static inline real pointToBoxSquared(
+    const Vector3 &point,
+    const Vector3 &halfSize,
+    Vector3 *closest
+    )
+{
+    real distance = 0;
+    for (unsigned i = 0; i < 3; i++)
+    {
+        real value = point[i];
+        if (value > halfSize[i]) value = halfSize[i];
+        else if (value < -halfSize[i]) value = -halfSize[i];
+        (*closest)[i] = value;
+        distance += (point[i] - value) * (point[i] - value);
+    }
+    return distance;
+}
+
+/**
+ * Finds the point on a segment, given in box coordinates, closest
+ * to the box, returning it as a proportion along the segment.
+ *
+ * The squared distance from the box is made up of one squared
+ * term for each axis on which the point is outside the box. It
+ * only changes form where the segment crosses one of the box's
+ * face planes, so we split the segment there and minimise the
+ * quadratic on each piece directly.
+ */
+static real closestOnSegmentToBox(
+    const Vector3 &start,
+    const Vector3 &direction,
+    const Vector3 &halfSize
+    )
+{
+    // Find where the segment crosses the face planes.
+    real breaks[8];
+    unsigned breakCount = 0;
+    breaks[breakCount++] = 0;
+    for (unsigned i = 0; i < 3; i++)
+    {
+        if (direction[i] == 0.0f) continue;
+        for (int sign = -1; sign <= 1; sign += 2)
+        {
+            real t = (sign * halfSize[i] - start[i]) / direction[i];
+            if (t > 0 && t < 1) breaks[breakCount++] = t;
+        }
+    }
+    breaks[breakCount++] = 1;
+
+    // There are only a few, so sort them by insertion.
+    for (unsigned i = 1; i < breakCount; i++)
+    {
+        real value = breaks[i];
+        unsigned j = i;
+        while (j > 0 && breaks[j-1] > value)
+        {
+            breaks[j] = breaks[j-1];
+            j--;
+        }
+        breaks[j] = value;
+    }
+
+    real best = 0;
+    real bestDistance = REAL_MAX;
+    Vector3 closest;
+    for (unsigned piece = 0; piece + 1 < breakCount; piece++)
+    {
+        real low = breaks[piece];
+        real high = breaks[piece+1];
+
+        // Work out which face planes the middle of the piece is
+        // outside, and minimise the distance to them.
+        Vector3 middle = start + direction * ((low + high) * (real)0.5);
+        real numerator = 0;
+        real denominator = 0;
+        for (unsigned i = 0; i < 3; i++)
+        {
+            real target;
+            if (middle[i] > halfSize[i]) target = halfSize[i];
+            else if (middle[i] < -halfSize[i]) target = -halfSize[i];
+            else continue;
+
+            numerator -= (start[i] - target) * direction[i];
+            denominator += direction[i] * direction[i];
+        }
+
+        // If the piece is inside the box, its middle is at zero
+        // distance.
+        real t = (low + high) * (real)0.5;
+        if (denominator > 0.0f)
+        {
+            t = numerator / denominator;
+            if (t < low) t = low;
+            else if (t > high) t = high;
+        }
+
+        real distance = pointToBoxSquared(
+            start + direction * t, halfSize, &closest
+            );
+        if (distance < bestDistance)
+        {
+            bestDistance = distance;
+            best = t;
+        }
+    }
+    return best;
+}
+
+unsigned CollisionDetector::boxAndCapsule(
+    const CollisionBox &box,
+    const CollisionCapsule &capsule,
+    CollisionData *data
+    )
+{
+    // Make sure we have contacts
+    if (!data->hasMoreContacts()) return 0;
+
+    // Work in box coordinates
+    Vector3 start = box.transform.transformInverse(capsule.getEnd(1));
+    Vector3 direction =
+        box.transform.transformInverse(capsule.getEnd(0)) - start;
+
+    real closestT = closestOnSegmentToBox(start, direction, box.halfSize);
+    Vector3 closestPt;
+    real closestDistance = pointToBoxSquared(
+        start + direction * closestT, box.halfSize, &closestPt
+        );
+    real reach = capsule.radius + data->margin;
+    real radiusSquared = reach * reach;
+
+    // Check we're in contact
+    if (closestDistance > radiusSquared) return 0;
+
+    if (closestDistance > 0.0f)
+    {
+        // The segment is outside the box, so each point we use works
+        // like a sphere against the box. Use each end of the segment
+        // that touches, and the closest point if it is deeper than
+        // them (which it is if the capsule lies across an edge).
+        real candidates[3];
+        unsigned candidateCount = 0;
+        real shallowest = REAL_MAX;
+        for (unsigned i = 0; i < 2; i++)
+        {
+            real distance = pointToBoxSquared(
+                start + direction * (real)i, box.halfSize, &closestPt
+                );
+            if (distance < radiusSquared)
+            {
+                candidates[candidateCount++] = (real)i;
+                if (distance < shallowest) shallowest = distance;
+            }
+        }
+        real margin = capsule.radius * (real)0.01;
+        if (candidateCount == 0 ||
+            real_sqrt(closestDistance) + margin < real_sqrt(shallowest))
+        {
+            candidates[candidateCount++] = closestT;
+        }
+
+        data->reserveContacts(candidateCount);
+        unsigned contactsUsed = 0;
+        for (unsigned i = 0; i < candidateCount; i++)
+        {
+            if (!data->hasMoreContacts()) break;
+
+            Vector3 segmentPt = start + direction * candidates[i];
+            real distance = pointToBoxSquared(
+                segmentPt, box.halfSize, &closestPt
+                );
+            if (distance <= 0.0f) continue;
+
+            // Compile the contact
+            Vector3 closestPtWorld = box.transform.transform(closestPt);
+            Vector3 segmentPtWorld = box.transform.transform(segmentPt);
+
+            Contact* contact = data->contacts;
+            contact->contactNormal = (closestPtWorld - segmentPtWorld);
+            contact->contactNormal.normalise();
+            contact->contactPoint = closestPtWorld;
+            contact->penetration = capsule.radius - real_sqrt(distance);
+            contact->setBodyData(box.body, capsule.body,
+                data->friction, data->restitution);
+
+            data->addContacts(1);
+            contactsUsed++;
+        }
+        return contactsUsed;
+    }
+
+    // The segment passes into the box. Find the face the segment
+    // would have to move the least distance through to get clear,
+    // in the same way as boxAndPoint does for a single point.
+    Vector3 ends[2] = { start, start + direction };
+    real minDepth = REAL_MAX;
+    Vector3 normal;
+    Vector3 deepest;
+    for (unsigned i = 0; i < 3; i++)
+    {
+        for (int sign = -1; sign <= 1; sign += 2)
+        {
+            // How far the segment would have to move out through
+            // this face to be clear of the box.
+            unsigned end = (ends[0][i] * sign < ends[1][i] * sign) ? 0 : 1;
+            real depth = box.halfSize[i] - ends[end][i] * sign;
+            if (depth < minDepth)
+            {
+                minDepth = depth;
+                normal = box.getAxis(i) * (real)(-sign);
+                deepest = ends[end];
+            }
+        }
+    }
+
+    // Compile the contact
+    Contact* contact = data->contacts;
+    contact->contactNormal = normal;
+    contact->contactPoint = box.transform.transform(deepest);
+    contact->penetration = minDepth + capsule.radius;
+    contact->setBodyData(box.body, capsule.body,
+        data->friction, data->restitution);
+
+    data->addContacts(1);
+    return 1;
+}
+
+unsigned CollisionDetector::hullAndHalfSpace(
+    const CollisionConvexHull &hull,
+    const CollisionPlane &plane,
+    CollisionData *data
+    )
+{
+    // Make sure we have contacts
+    if (!data->hasMoreContacts()) return 0;
+
+    // Find the vertices through the plane, putting the contact
+    // points on the plane, in the same way as for a box. Hulls can
+    // have any number of vertices, so whenever the buffer fills it is
+    // cut down to the best four and filling carries on.
+    const unsigned maxPoints = 32;
+    Vector3 points[maxPoints];
+    real depths[maxPoints];
+    unsigned chosen[4];
+    unsigned count = 0;
+    for (unsigned i = 0; i < hull.vertices.size(); i++)
+    {
+        Vector3 vertexPos = hull.transform.transform(hull.vertices[i]);
+        real vertexDistance = vertexPos * plane.direction;
+        if (vertexDistance > plane.offset + data->margin) continue;
+
+        if (count == maxPoints)
+        {
+            count = chooseContactPoints(
+                points, depths, count, plane.direction, 4, chosen
+                );
+            Vector3 keptPoints[4];
+            real keptDepths[4];
+            for (unsigned j = 0; j < count; j++)
+            {
+                keptPoints[j] = points[chosen[j]];
+                keptDepths[j] = depths[chosen[j]];
+            }
+            for (unsigned j = 0; j < count; j++)
+            {
+                points[j] = keptPoints[j];
+                depths[j] = keptDepths[j];
+            }
+        }
+
+        points[count] =
+            vertexPos + plane.direction * (plane.offset - vertexDistance);
+        depths[count] = plane.offset - vertexDistance;
+        count++;
+    }
+    if (count == 0) return 0;
+
+    // Keep the ones covering the most area.
+    data->reserveContacts(count > 4 ? 4 : count);
+    unsigned limit = (unsigned)data->contactsLeft;
+    if (limit > 4) limit = 4;
+
+    unsigned contactsUsed = chooseContactPoints(
+        points, depths, count, plane.direction, limit, chosen
+        );
+
+    // Create the contact data.
+    Contact* contact = data->contacts;
+    for (unsigned i = 0; i < contactsUsed; i++, contact++)
+    {
+        contact->contactPoint = points[chosen[i]];
+        contact->contactNormal = plane.direction;
+        contact->penetration = depths[chosen[i]];
+        contact->setBodyData(hull.body, NULL,
+            data->friction, data->restitution);
+    }
+
+    data->addContacts(contactsUsed);
+    return contactsUsed;
+}
+
+/**
+ * Finds the closest point on the triangle to the given point, by
+ * working through the regions around the triangle in turn.
+ */
+static Vector3 closestOnTriangle(
+    const CollisionTriangle &triangle,
+    const Vector3 &point
+    )
+{
+    const Vector3 &a = triangle.vertex[0];
+    const Vector3 &b = triangle.vertex[1];
+    const Vector3 &c = triangle.vertex[2];
+    Vector3 ab = b - a;
+    Vector3 ac = c - a;
+
+    // The region beyond a.
+    Vector3 ap = point - a;
+    real d1 = ab * ap;
+    real d2 = ac * ap;
+    if (d1 <= 0 && d2 <= 0) return a;
+
+    // The region beyond b.
+    Vector3 bp = point - b;
+    real d3 = ab * bp;
+    real d4 = ac * bp;
+    if (d3 >= 0 && d4 <= d3) return b;
+
+    // The region beyond edge ab.
+    real vc = d1*d4 - d3*d2;
+    if (vc <= 0 && d1 >= 0 && d3 <= 0)
+    {
+        return a + ab * (d1 / (d1 - d3));
+    }
+
+    // The region beyond c.
+    Vector3 cp = point - c;
+    real d5 = ab * cp;
+    real d6 = ac * cp;
+    if (d6 >= 0 && d5 <= d6) return c;
+
+    // The region beyond edge ac.
+    real vb = d5*d2 - d1*d6;
+    if (vb <= 0 && d2 >= 0 && d6 <= 0)
+    {
+        return a + ac * (d2 / (d2 - d6));
+    }
+
+    // The region beyond edge bc.
+    real va = d3*d6 - d5*d4;
+    if (va <= 0 && (d4 - d3) >= 0 && (d5 - d6) >= 0)
+    {
+        return b + (c - b) * ((d4 - d3) / ((d4 - d3) + (d5 - d6)));
+    }
+
+    // Inside the triangle.
+    real sum = va + vb + vc;
+    if (sum <= 0) return a;
+    return a + ab * (vb / sum) + ac * (vc / sum);
+}
+
+// How far the surface has to bend at an edge, as the sine of the
+// angle, before the edge is active.
+#define TRIANGLE_FLAT_EDGE ((real)0.01)
+
+void CollisionTriangle::setNeighbour(unsigned edge, const Vector3 &opposite)
+{
+    Vector3 toOpposite = opposite - vertex[edge];
+    real distance = toOpposite.magnitude();
+    if (distance <= 0) return;
+
+    // Work out how far the other triangle rises out of the plane of
+    // this one.
+    real rise = (getNormal() * toOpposite) / distance;
+    activeEdges &= ~((1u << edge) | (1u << (edge + 3)));
+    if (rise < -TRIANGLE_FLAT_EDGE) activeEdges |= 1u << edge;
+    else if (rise > TRIANGLE_FLAT_EDGE) activeEdges |= 1u << (edge + 3);
+}
+
+bool CollisionTriangle::allowsNormal(const Vector3 &normal) const
+{
+    if (activeEdges == 0x3f) return true;
+
+    Vector3 faceNormal = getNormal();
+    unsigned side = normal * faceNormal >= 0 ? 0 : 3;
+    for (unsigned i = 0; i < 3; i++)
+    {
+        if (activeEdges & (1u << (i + side))) continue;
+
+        // The edge's outward direction in the plane of the triangle.
+        Vector3 outward = (vertex[(i+1) % 3] - vertex[i]) % faceNormal;
+        if (normal * outward > (real)0.001 * outward.magnitude()) return false;
+    }
+    return true;
+}
+
+/**
+ * Checks if the given point, assumed to be on the triangle's plane,
+ * is inside the triangle.
+ */
+static bool insideTriangle(
+    const Vector3 *vertices,
+    const Vector3 &normal,
+    const Vector3 &point
+    )
+{
+    for (unsigned i = 0; i < 3; i++)
+    {
+        Vector3 edge = vertices[(i+1) % 3] - vertices[i];
+        if ((edge % (point - vertices[i])) * normal < 0) return false;
+    }
+    return true;
+}
+
+unsigned CollisionDetector::sphereAndTriangle(
+    const CollisionSphere &sphere,
+    const CollisionTriangle &triangle,
+    CollisionData *data
+    )
+{
+    // Make sure we have contacts
+    if (!data->hasMoreContacts()) return 0;
+
+    Vector3 centre = sphere.getAxis(3);
+    Vector3 closestPt = closestOnTriangle(triangle, centre);
+    Vector3 toCentre = centre - closestPt;
+    real distance = toCentre.squareMagnitude();
+    real reach = sphere.radius + data->margin;
+    if (distance >= reach * reach) return 0;
+
+    // If the centre is on the triangle, push out along its normal.
+    distance = real_sqrt(distance);
+    Vector3 normal;
+    if (distance > 0) normal = toCentre * ((real)1.0 / distance);
+    else normal = triangle.getNormal();
+    if (!triangle.allowsNormal(normal)) return 0;
+
+    Contact* contact = data->contacts;
+    contact->contactNormal = normal;
+    contact->contactPoint = closestPt;
+    contact->penetration = sphere.radius - distance;
+    contact->setBodyData(sphere.body, NULL,
+        data->friction, data->restitution);
+
+    data->addContacts(1);
+    return 1;
+}
+
+/**
+ * Finds the closest points of a segment and a triangle, when the
+ * segment doesn't pass through the triangle, returning the square
+ * of the distance between them.
+ */
+static real closestOnSegmentToTriangle(
+    const CollisionTriangle &triangle,
+    const Vector3 &start,
+    const Vector3 &direction,
+    Vector3 *segmentPt,
+    Vector3 *trianglePt
+    )
+{
+    real best = REAL_MAX;
+
+    // Either an end of the segment is closest to the inside of the
+    // triangle...
+    for (unsigned i = 0; i < 2; i++)
+    {
+        Vector3 end = start + direction * (real)i;
+        Vector3 onTriangle = closestOnTriangle(triangle, end);
+        real distance = (end - onTriangle).squareMagnitude();
+        if (distance < best)
+        {
+            best = distance;
+            *segmentPt = end;
+            *trianglePt = onTriangle;
+        }
+    }
+
+    // ...or the segment is closest to one of its edges.
+    for (unsigned i = 0; i < 3; i++)
+    {
+        const Vector3 &edgeStart = triangle.vertex[i];
+        Vector3 edge = triangle.vertex[(i+1) % 3] - edgeStart;
+        real s, t;
+        closestOnSegments(start, direction, edgeStart, edge, &s, &t);
+
+        Vector3 onSegment = start + direction * s;
+        Vector3 onEdge = edgeStart + edge * t;
+        real distance = (onSegment - onEdge).squareMagnitude();
+        if (distance < best)
+        {
+            best = distance;
+            *segmentPt = onSegment;
+            *trianglePt = onEdge;
+        }
+    }
+    return best;
+}
+
+unsigned CollisionDetector::capsuleAndTriangle(
+    const CollisionCapsule &capsule,
+    const CollisionTriangle &triangle,
+    CollisionData *data
+    )
+{
+    // Make sure we have contacts
+    if (!data->hasMoreContacts()) return 0;
+
+    Vector3 start = capsule.getEnd(1);
+    Vector3 direction = capsule.getEnd(0) - start;
+    Vector3 normal = triangle.getNormal();
+
+    // If the segment passes through the triangle, push the capsule
+    // out along the normal, on whichever side needs less movement.
+    real startHeight = (start - triangle.vertex[0]) * normal;
+    real endHeight = (start + direction - triangle.vertex[0]) * normal;
+    if (startHeight * endHeight < 0)
+    {
+        Vector3 crossing =
+            start + direction * (startHeight / (startHeight - endHeight));
+        if (insideTriangle(triangle.vertex, normal, crossing))
+        {
+            real depth;
+            if (real_abs(endHeight) < real_abs(startHeight))
+            {
+                depth = real_abs(endHeight);
+                if (startHeight < 0) normal *= -1;
+            }
+            else
+            {
+                depth = real_abs(startHeight);
+                if (endHeight < 0) normal *= -1;
+            }
+
+            Contact* contact = data->contacts;
+            contact->contactNormal = normal;
+            contact->contactPoint = crossing;
+            contact->penetration = depth + capsule.radius;
+            contact->setBodyData(capsule.body, NULL,
+                data->friction, data->restitution);
+
+            data->addContacts(1);
+            return 1;
+        }
+    }
+
+    // Otherwise find the closest points.
+    Vector3 segmentPt, trianglePt;
+    real closestDistance = closestOnSegmentToTriangle(
+        triangle, start, direction, &segmentPt, &trianglePt
+        );
+    real reach = capsule.radius + data->margin;
+    real radiusSquared = reach * reach;
+    if (closestDistance >= radiusSquared) return 0;
+
+    // Use each end of the segment that touches, and the closest
+    // point if it is deeper than them, as for boxAndCapsule.
+    Vector3 points[3][2];
+    unsigned count = 0;
+    real shallowest = REAL_MAX;
+    for (unsigned i = 0; i < 2; i++)
+    {
+        Vector3 end = i == 0 ? start : start + direction;
+        Vector3 onTriangle = closestOnTriangle(triangle, end);
+        real distance = (end - onTriangle).squareMagnitude();
+        if (distance < radiusSquared)
+        {
+            points[count][0] = end;
+            points[count][1] = onTriangle;
+            count++;
+            if (distance < shallowest) shallowest = distance;
+        }
+    }
+    real margin = capsule.radius * (real)0.01;
+    if (count == 0 ||
+        real_sqrt(closestDistance) + margin < real_sqrt(shallowest))
+    {
+        points[count][0] = segmentPt;
+        points[count][1] = trianglePt;
+        count++;
+    }
+
+    data->reserveContacts(count);
+    unsigned contactsUsed = 0;
+    for (unsigned i = 0; i < count; i++)
+    {
+        if (!data->hasMoreContacts()) break;
+
+        Vector3 toSegment = points[i][0] - points[i][1];
+        real distance = toSegment.magnitude();
+        Vector3 contactNormal = normal;
+        if (distance > 0)
+        {
+            contactNormal = toSegment * ((real)1.0 / distance);
+        }
+        else if ((start + direction * (real)0.5 - triangle.vertex[0]) *
+                 normal < 0)
+        {
+            contactNormal *= -1;
+        }
+        if (!triangle.allowsNormal(contactNormal)) continue;
+
+        Contact* contact = data->contacts;
+        contact->contactNormal = contactNormal;
+        contact->contactPoint = points[i][1];
+        contact->penetration = capsule.radius - distance;
+        contact->setBodyData(capsule.body, NULL,
+            data->friction, data->restitution);
+
+        data->addContacts(1);
+        contactsUsed++;
+    }
+    return contactsUsed;
+}
+
+/**
+ * Clips a convex polygon, in place, to the side of the plane with
+ * the given normal and offset where normal * point <= offset.
+ * Returns the number of points left. The polygon needs room for one
+ * more point than it starts with.
+ */
+static unsigned clipPolygon(
+    Vector3 *points,
+    unsigned count,
+    const Vector3 &normal,
+    real offset
+    )
+{
+    Vector3 clipped[16];
+    unsigned clippedCount = 0;
+    for (unsigned i = 0; i < count; i++)
+    {
+        const Vector3 &from = points[i];
+        const Vector3 &to = points[(i+1) % count];
+        real fromDistance = normal * from - offset;
+        real toDistance = normal * to - offset;
+
+        if (fromDistance <= 0) clipped[clippedCount++] = from;
+        if ((fromDistance < 0 && toDistance > 0) ||
+            (fromDistance > 0 && toDistance < 0))
+        {
+            real t = fromDistance / (fromDistance - toDistance);
+            clipped[clippedCount++] = from + (to - from) * t;
+        }
+    }
+    for (unsigned i = 0; i < clippedCount; i++) points[i] = clipped[i];
+    return clippedCount;
+}
+
+unsigned CollisionDetector::boxAndTriangle(
+    const CollisionBox &box,
+    const CollisionTriangle &triangle,
+    CollisionData *data
+    )
+{
+    // Make sure we have contacts
+    if (!data->hasMoreContacts()) return 0;
+
+    // Work in box coordinates, where the box is centred on the origin
+    // and lined up with the axes.
+    Vector3 vertices[3];
+    for (unsigned i = 0; i < 3; i++)
+    {
+        vertices[i] = box.transform.transformInverse(triangle.vertex[i]);
+    }
+    Vector3 edges[3] = {
+        vertices[1] - vertices[0],
+        vertices[2] - vertices[1],
+        vertices[0] - vertices[2]
+    };
+    Vector3 faceNormal = edges[0] % edges[1];
+    if (faceNormal.squareMagnitude() <= 0) return 0;
+    faceNormal.normalise();
+
+    // Test the triangle normal, the box axes and the edge to edge
+    // axes, keeping the one needing the least movement of the box
+    // to separate them. Axes are numbered in that order.
+    static const Vector3 boxAxes[3] = {
+        Vector3(1,0,0), Vector3(0,1,0), Vector3(0,0,1)
+    };
+    real bestDepth = REAL_MAX;
+    Vector3 bestMove;
+    unsigned bestAxis = 0;
+    for (unsigned axisIndex = 0; axisIndex < 13; axisIndex++)
+    {
+        Vector3 axis;
+        if (axisIndex == 0) axis = faceNormal;
+        else if (axisIndex < 4) axis = boxAxes[axisIndex - 1];
+        else
+        {
+            axis = boxAxes[(axisIndex - 4) / 3] % edges[(axisIndex - 4) % 3];
+            if (axis.squareMagnitude() < (real)0.0001 *
+                edges[(axisIndex - 4) % 3].squareMagnitude()) continue;
+            axis.normalise();
+        }
+
+        real boxRadius =
+            box.halfSize.x * real_abs(axis.x) +
+            box.halfSize.y * real_abs(axis.y) +
+            box.halfSize.z * real_abs(axis.z);
+        real low = vertices[0] * axis, high = low;
+        for (unsigned i = 1; i < 3; i++)
+        {
+            real projection = vertices[i] * axis;
+            if (projection < low) low = projection;
+            if (projection > high) high = projection;
+        }
+        if (low > boxRadius + data->margin ||
+            high < -boxRadius - data->margin) return 0;
+
+        // The box can move either way along the axis. If they are
+        // apart, the depth is negative.
+        real depth = high + boxRadius;
+        Vector3 move = axis;
+        if (boxRadius - low < depth)
+        {
+            depth = boxRadius - low;
+            move = axis * -1;
+        }
+
+        // Only use an edge axis if it is clearly better, as face
+        // contacts are more stable. The depth can be negative.
+        real bias = axisIndex >= 4 ? real_abs(depth) * (real)0.05 : 0;
+        if (depth + bias < bestDepth &&
+            triangle.allowsNormal(box.transform.transformDirection(move)))
+        {
+            bestDepth = depth;
+            bestMove = move;
+            bestAxis = axisIndex;
+        }
+    }
+
+    // Find the contact points, with their depths along the direction
+    // the box moves.
+    Vector3 points[20];
+    real depths[20];
+    unsigned count = 0;
+    if (bestAxis == 0)
+    {
+        // The box is through the face of the triangle: use the box
+        // vertices behind the triangle, moved onto it.
+        static real mults[8][3] = {{1,1,1},{-1,1,1},{1,-1,1},{-1,-1,1},
+                                   {1,1,-1},{-1,1,-1},{1,-1,-1},{-1,-1,-1}};
+        for (unsigned i = 0; i < 8; i++)
+        {
+            Vector3 vertex(mults[i][0], mults[i][1], mults[i][2]);
+            vertex.componentProductUpdate(box.halfSize);
+            real depth = (vertices[0] - vertex) * bestMove;
+            if (depth <= -data->margin) continue;
+
+            Vector3 onTriangle = vertex + bestMove * depth;
+            if (!insideTriangle(vertices, faceNormal, onTriangle)) continue;
+            points[count] = onTriangle;
+            depths[count] = depth;
+            count++;
+        }
+    }
+    if (bestAxis == 0)
+    {
+        // Triangle vertices inside the box also touch, which matters
+        // when the triangle is smaller than the box.
+        real boxRadius =
+            box.halfSize.x * real_abs(bestMove.x) +
+            box.halfSize.y * real_abs(bestMove.y) +
+            box.halfSize.z * real_abs(bestMove.z);
+        for (unsigned i = 0; i < 3; i++)
+        {
+            const Vector3 &vertex = vertices[i];
+            if (real_abs(vertex.x) > box.halfSize.x ||
+                real_abs(vertex.y) > box.halfSize.y ||
+                real_abs(vertex.z) > box.halfSize.z) continue;
+
+            points[count] = vertex;
+            depths[count] = vertex * bestMove + boxRadius;
+            count++;
+        }
+    }
+    else if (bestAxis < 4)
+    {
+        // The triangle is through a face of the box: clip it to the
+        // sides of that face, and keep the points through the face.
+        unsigned faceAxis = bestAxis - 1;
+        unsigned clippedCount = 3;
+        for (unsigned i = 0; i < 3; i++) points[i] = vertices[i];
+        for (unsigned i = 0; i < 3 && clippedCount > 0; i++)
+        {
+            if (i == faceAxis) continue;
+            clippedCount = clipPolygon(points, clippedCount,
+                boxAxes[i], box.halfSize[i]);
+            clippedCount = clipPolygon(points, clippedCount,
+                boxAxes[i] * -1, box.halfSize[i]);
+        }
+
+        for (unsigned i = 0; i < clippedCount; i++)
+        {
+            real depth = points[i] * bestMove + box.halfSize[faceAxis];
+            if (depth <= -data->margin) continue;
+            points[count] = points[i];
+            depths[count] = depth;
+            count++;
+        }
+    }
+    if (count == 0)
+    {
+        // Edge to edge, or no points were found: use a single point
+        // between the deepest parts of the box and the triangle.
+        Vector3 boxPt(
+            bestMove.x > 0 ? -box.halfSize.x : box.halfSize.x,
+            bestMove.y > 0 ? -box.halfSize.y : box.halfSize.y,
+            bestMove.z > 0 ? -box.halfSize.z : box.halfSize.z
+            );
+        if (bestAxis >= 4)
+        {
+            // The box edge runs through its deepest vertex along the
+            // box axis; find the closest points with the triangle
+            // edge.
+            unsigned boxAxis = (bestAxis - 4) / 3;
+            const Vector3 &edgeStart = vertices[(bestAxis - 4) % 3];
+            const Vector3 &edge = edges[(bestAxis - 4) % 3];
+            Vector3 boxEdgeStart = boxPt;
+            boxEdgeStart[boxAxis] = -box.halfSize[boxAxis];
+            Vector3 boxEdge = boxAxes[boxAxis] * (box.halfSize[boxAxis] * 2);
+            real s, t;
+            closestOnSegments(boxEdgeStart, boxEdge, edgeStart, edge, &s, &t);
+            boxPt = (boxEdgeStart + boxEdge * s + edgeStart + edge * t) *
+                (real)0.5;
+        }
+        points[0] = boxPt;
+        depths[0] = bestDepth;
+        count = 1;
+    }
+
+    // Keep the four covering the most area.
+    data->reserveContacts(count > 4 ? 4 : count);
+    unsigned limit = (unsigned)data->contactsLeft;
+    if (limit > 4) limit = 4;
+
+    unsigned chosen[4];
+    unsigned contactsUsed = chooseContactPoints(
+        points, depths, count, bestMove, limit, chosen
+        );
+
+    Vector3 normal = box.transform.transformDirection(bestMove);
+    Contact* contact = data->contacts;
+    for (unsigned i = 0; i < contactsUsed; i++, contact++)
+    {
+        contact->contactPoint = box.transform.transform(points[chosen[i]]);
+        contact->contactNormal = normal;
+        contact->penetration = depths[chosen[i]];
+        contact->setBodyData(box.body, NULL,
+            data->friction, data->restitution);
+    }
+
+    data->addContacts(contactsUsed);
+    return contactsUsed;
+}
+
+/**
+ * Holds a chunk of rays gathered from a ray batch for the batched
+ * ray casts.
+ */
+struct RayLanes
+{
+    unsigned ray[RAY_BATCH_LANES];
+    real ox[RAY_BATCH_LANES], oy[RAY_BATCH_LANES], oz[RAY_BATCH_LANES];
+    real dx[RAY_BATCH_LANES], dy[RAY_BATCH_LANES], dz[RAY_BATCH_LANES];
+    real limit[RAY_BATCH_LANES];
+    real distance[RAY_BATCH_LANES];
+    unsigned char hit[RAY_BATCH_LANES];
+
+    /**
+     * Gathers the given number of rays, starting at the given
+     * position in the list of indices (or in the batch, if there
+     * is no list).
+     */
+    void gather(const RayBatch &rays, const unsigned *indices,
+                unsigned first, unsigned lanes, const RayHit *hits)
+    {
+        for (unsigned lane = 0; lane < lanes; lane++)
+        {
+            unsigned index = indices ? indices[first + lane] : first + lane;
+            ray[lane] = index;
+            ox[lane] = rays.originX[index];
+            oy[lane] = rays.originY[index];
+            oz[lane] = rays.originZ[index];
+            dx[lane] = rays.directionX[index];
+            dy[lane] = rays.directionY[index];
+            dz[lane] = rays.directionZ[index];
+            limit[lane] = hits[index].distance;
+        }
+    }
+
+    /**
+     * Writes the hit for the given lane.
+     */
+    void keepHit(unsigned lane, const Vector3 &normal,
+                 const CollisionPrimitive *primitive, RayHit *hits) const
+    {
+        RayHit &result = hits[ray[lane]];
+        result.hit = true;
+        result.distance = distance[lane];
+        result.point = Vector3(
+            ox[lane] + dx[lane] * distance[lane],
+            oy[lane] + dy[lane] * distance[lane],
+            oz[lane] + dz[lane] * distance[lane]
+            );
+        result.normal = normal;
+        result.primitive = primitive;
+    }
+};
+
+unsigned RayTests::raysAndSphere(
+    const RayBatch &rays,
+    const unsigned *indices,
+    unsigned count,
+    const CollisionSphere &sphere,
+    RayHit *hits
+    )
+{
+    unsigned used = 0;
+    RayLanes packet;
+    Vector3 centre = sphere.getAxis(3);
+    real radiusSquared = sphere.radius * sphere.radius;
+
+    for (unsigned first = 0; first < count; first += RAY_BATCH_LANES)
+    {
+        unsigned lanes = count - first;
+        if (lanes > RAY_BATCH_LANES) lanes = RAY_BATCH_LANES;
+        packet.gather(rays, indices, first, lanes, hits);
+
+        // Find where each ray enters the sphere in one pass.
+        for (unsigned lane = 0; lane < lanes; lane++)
+        {
+            real mx = packet.ox[lane] - centre.x;
+            real my = packet.oy[lane] - centre.y;
+            real mz = packet.oz[lane] - centre.z;
+            real along = mx*packet.dx[lane] + my*packet.dy[lane] +
+                mz*packet.dz[lane];
+            real outside = mx*mx + my*my + mz*mz - radiusSquared;
+            real discriminant = along*along - outside;
+            real root = real_sqrt(discriminant > 0 ? discriminant : 0);
+            packet.distance[lane] = -along - root;
+
+            packet.hit[lane] = (outside > 0) & (discriminant >= 0) &
+                (packet.distance[lane] >= 0) &
+                (packet.distance[lane] < packet.limit[lane]);
+        }
+
+        // Write the hits.
+        for (unsigned lane = 0; lane < lanes; lane++)
+        {
+            if (!packet.hit[lane]) continue;
+
+            real distance = packet.distance[lane];
+            Vector3 normal(
+                packet.ox[lane] + packet.dx[lane] * distance - centre.x,
+                packet.oy[lane] + packet.dy[lane] * distance - centre.y,
+                packet.oz[lane] + packet.dz[lane] * distance - centre.z
+                );
+            normal *= ((real)1.0) / sphere.radius;
+            packet.keepHit(lane, normal, &sphere, hits);
+            used++;
+        }
+    }
+    return used;
+}
+
+unsigned RayTests::raysAndBox(
+    const RayBatch &rays,
+    const unsigned *indices,
+    unsigned count,
+    const CollisionBox &box,
+    RayHit *hits
+    )
+{
+    unsigned used = 0;
+    RayLanes packet;
+    unsigned char enterAxis[RAY_BATCH_LANES];
+    unsigned char enterBack[RAY_BATCH_LANES];
+    Vector3 axis[3] = { box.getAxis(0), box.getAxis(1), box.getAxis(2) };
+    Vector3 centre = box.getAxis(3);
+
+    for (unsigned first = 0; first < count; first += RAY_BATCH_LANES)
+    {
+        unsigned lanes = count - first;
+        if (lanes > RAY_BATCH_LANES) lanes = RAY_BATCH_LANES;
+        packet.gather(rays, indices, first, lanes, hits);
+
+        // Clip each ray against the box's three slabs in its own
+        // coordinates, in one pass, remembering which face it
+        // enters through.
+        for (unsigned lane = 0; lane < lanes; lane++)
+        {
+            real mx = packet.ox[lane] - centre.x;
+            real my = packet.oy[lane] - centre.y;
+            real mz = packet.oz[lane] - centre.z;
+
+            real enter = -REAL_MAX;
+            real leave = REAL_MAX;
+            unsigned char face = 0, back = 0;
+            for (unsigned i = 0; i < 3; i++)
+            {
+                real origin = mx*axis[i].x + my*axis[i].y + mz*axis[i].z;
+                real direction = packet.dx[lane]*axis[i].x +
+                    packet.dy[lane]*axis[i].y + packet.dz[lane]*axis[i].z;
+                real inverse = direction != 0 ? 1 / direction : REAL_MAX;
+
+                real one = (-box.halfSize[i] - origin) * inverse;
+                real two = (box.halfSize[i] - origin) * inverse;
+                real slabEnter = one < two ? one : two;
+                real slabLeave = one < two ? two : one;
+
+                face = slabEnter > enter ? i : face;
+                back = slabEnter > enter ? direction > 0 : back;
+                enter = slabEnter > enter ? slabEnter : enter;
+                leave = slabLeave < leave ? slabLeave : leave;
+            }
+
+            packet.distance[lane] = enter;
+            enterAxis[lane] = face;
+            enterBack[lane] = back;
+            packet.hit[lane] = (enter >= 0) & (enter <= leave) &
+                (enter < packet.limit[lane]);
+        }
+
+        // Write the hits, with the normal of the face entered.
+        for (unsigned lane = 0; lane < lanes; lane++)
+        {
+            if (!packet.hit[lane]) continue;
+
+            Vector3 normal = axis[enterAxis[lane]];
+            if (enterBack[lane]) normal *= -1;
+            packet.keepHit(lane, normal, &box, hits);
+            used++;
+        }
+    }
+    return used;
+}
+
+unsigned RayTests::raysAndHalfSpace(
+    const RayBatch &rays,
+    const unsigned *indices,
+    unsigned count,
+    const CollisionPlane &plane,
+    RayHit *hits
+    )
+{
+    unsigned used = 0;
+    RayLanes packet;
+    const Vector3 &normal = plane.direction;
+
+    for (unsigned first = 0; first < count; first += RAY_BATCH_LANES)
+    {
+        unsigned lanes = count - first;
+        if (lanes > RAY_BATCH_LANES) lanes = RAY_BATCH_LANES;
+        packet.gather(rays, indices, first, lanes, hits);
+
+        // Find where each ray crosses the plane in one pass.
+        for (unsigned lane = 0; lane < lanes; lane++)
+        {
+            real height = normal.x*packet.ox[lane] + normal.y*packet.oy[lane] +
+                normal.z*packet.oz[lane] - plane.offset;
+            real closing = normal.x*packet.dx[lane] +
+                normal.y*packet.dy[lane] + normal.z*packet.dz[lane];
+            packet.distance[lane] = height / (closing < 0 ? -closing : 1);
+
+            packet.hit[lane] = (height > 0) & (closing < 0) &
+                (packet.distance[lane] < packet.limit[lane]);
+        }
+
+        // Write the hits.
+        for (unsigned lane = 0; lane < lanes; lane++)
+        {
+            if (!packet.hit[lane]) continue;
+
+            packet.keepHit(lane, normal, NULL, hits);
+            used++;
+        }
+    }
+    return used;
+}
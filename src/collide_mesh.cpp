@@ -0,0 +1,377 @@
+/*
+ * Implementation file for the static mesh collision detection system.
+ *
+ * Part of the Cyclone physics system.
+ *
+ * Copyright (c) Icosagon 2003. All Rights Reserved.
+ *
+ * This software is distributed under licence. Use of this software
+ * implies agreement with all terms and conditions of the accompanying
+ * software licence.
+ */
+
+#include <cyclone/collide_mesh.h>
+#include <algorithm>
+#include <math.h>
+
+using namespace cyclone;
+
+// The most triangles held in a leaf of the mesh hierarchy.
+#define MESH_LEAF_TRIANGLES 4
+
+/**
+ * Orders triangle indices by the position of their centres along
+ * one axis, for splitting the mesh hierarchy.
+ */
+struct CentreOrder
+{
+    const std::vector<Vector3> *centres;
+    unsigned axis;
+
+    bool operator()(unsigned a, unsigned b) const
+    {
+        return (*centres)[a][axis] < (*centres)[b][axis];
+    }
+};
+
+void CollisionTriangleMesh::build()
+{
+    nodes.clear();
+    order.clear();
+
+    unsigned count = getTriangleCount();
+    if (count == 0) return;
+
+    centres.resize(count);
+    order.resize(count);
+    for (unsigned i = 0; i < count; i++)
+    {
+        CollisionTriangle triangle = getTriangle(i);
+        Vector3 low = triangle.vertex[0];
+        Vector3 high = triangle.vertex[0];
+        for (unsigned v = 1; v < 3; v++)
+        {
+            for (unsigned axis = 0; axis < 3; axis++)
+            {
+                real value = triangle.vertex[v][axis];
+                if (value < low[axis]) low[axis] = value;
+                if (value > high[axis]) high[axis] = value;
+            }
+        }
+        centres[i] = (low + high) * ((real)0.5);
+        order[i] = i;
+    }
+
+    nodes.push_back(Node());
+    buildNode(0, 0, count);
+
+    // The centres are only needed while building.
+    centres.clear();
+
+    findActiveEdges();
+}
+
+/**
+ * Holds an edge of a mesh triangle, with its vertex indices in
+ * order, so the triangles sharing an edge can be found by sorting.
+ */
+struct MeshEdge
+{
+    unsigned low;
+    unsigned high;
+    unsigned triangle;
+    unsigned edge;
+
+    bool operator<(const MeshEdge &other) const
+    {
+        if (low != other.low) return low < other.low;
+        if (high != other.high) return high < other.high;
+        return triangle < other.triangle;
+    }
+};
+
+void CollisionTriangleMesh::findActiveEdges()
+{
+    unsigned count = getTriangleCount();
+    activeEdges.assign(count, 0x3f);
+
+    std::vector<MeshEdge> edges(count * 3);
+    for (unsigned i = 0; i < count * 3; i++)
+    {
+        unsigned start = indices[i];
+        unsigned end = indices[i - i % 3 + (i + 1) % 3];
+        edges[i].low = start < end ? start : end;
+        edges[i].high = start < end ? end : start;
+        edges[i].triangle = i / 3;
+        edges[i].edge = i % 3;
+    }
+    std::sort(edges.begin(), edges.end());
+
+    // Edges used by exactly two triangles join them. Edges used by
+    // one are on the boundary, and edges used by more are left
+    // active as there's no single surface to follow.
+    for (unsigned i = 0; i + 1 < edges.size(); i++)
+    {
+        const MeshEdge &one = edges[i];
+        const MeshEdge &two = edges[i + 1];
+        if (one.low != two.low || one.high != two.high) continue;
+        if (i + 2 < edges.size() &&
+            edges[i + 2].low == one.low && edges[i + 2].high == one.high)
+        {
+            while (i + 1 < edges.size() &&
+                edges[i + 1].low == one.low && edges[i + 1].high == one.high)
+            {
+                i++;
+            }
+            continue;
+        }
+
+        CollisionTriangle first = getTriangle(one.triangle);
+        CollisionTriangle second = getTriangle(two.triangle);
+        first.activeEdges = activeEdges[one.triangle];
+        second.activeEdges = activeEdges[two.triangle];
+        first.setNeighbour(one.edge, second.vertex[(two.edge + 2) % 3]);
+        second.setNeighbour(two.edge, first.vertex[(one.edge + 2) % 3]);
+        activeEdges[one.triangle] = first.activeEdges;
+        activeEdges[two.triangle] = second.activeEdges;
+        i++;
+    }
+}
+
+void CollisionTriangleMesh::buildNode(unsigned node,
+                                      unsigned first,
+                                      unsigned count)
+{
+    // Find the bounds of the triangles, and of their centres.
+    Vector3 low = vertices[indices[order[first]*3]];
+    Vector3 high = low;
+    Vector3 centreLow = centres[order[first]];
+    Vector3 centreHigh = centreLow;
+    for (unsigned i = first; i < first + count; i++)
+    {
+        for (unsigned v = 0; v < 3; v++)
+        {
+            const Vector3 &vertex = vertices[indices[order[i]*3 + v]];
+            for (unsigned axis = 0; axis < 3; axis++)
+            {
+                if (vertex[axis] < low[axis]) low[axis] = vertex[axis];
+                if (vertex[axis] > high[axis]) high[axis] = vertex[axis];
+            }
+        }
+
+        const Vector3 &centre = centres[order[i]];
+        for (unsigned axis = 0; axis < 3; axis++)
+        {
+            if (centre[axis] < centreLow[axis]) centreLow[axis] = centre[axis];
+            if (centre[axis] > centreHigh[axis]) centreHigh[axis] = centre[axis];
+        }
+    }
+    nodes[node].volume = BoundingBox(
+        (low + high) * ((real)0.5),
+        (high - low) * ((real)0.5)
+        );
+
+    if (count <= MESH_LEAF_TRIANGLES)
+    {
+        nodes[node].first = first;
+        nodes[node].count = count;
+        return;
+    }
+
+    // Split at the median along the axis the centres spread furthest.
+    Vector3 spread = centreHigh - centreLow;
+    CentreOrder compare;
+    compare.centres = &centres;
+    compare.axis = 0;
+    if (spread.y > spread[compare.axis]) compare.axis = 1;
+    if (spread.z > spread[compare.axis]) compare.axis = 2;
+
+    unsigned half = count / 2;
+    std::nth_element(
+        order.begin() + first,
+        order.begin() + first + half,
+        order.begin() + first + count,
+        compare
+        );
+
+    // The children go next to each other at the end of the list.
+    unsigned children = (unsigned)nodes.size();
+    nodes.push_back(Node());
+    nodes.push_back(Node());
+    nodes[node].first = children;
+    nodes[node].count = 0;
+
+    buildNode(children, first, half);
+    buildNode(children + 1, first + half, count - half);
+}
+
+CollisionTriangle CollisionHeightfield::getTriangle(unsigned column,
+                                                  unsigned row,
+                                                  unsigned half) const
+{
+    // Each edge is shared with a triangle in this cell or the next
+    // one along; edges on the border of the grid stay active.
+    CollisionTriangle triangle;
+    if (half == 0)
+    {
+        triangle.vertex[0] = getPoint(column, row);
+        triangle.vertex[1] = getPoint(column, row + 1);
+        triangle.vertex[2] = getPoint(column + 1, row);
+        if (column > 0)
+        {
+            triangle.setNeighbour(0, getPoint(column - 1, row + 1));
+        }
+        triangle.setNeighbour(1, getPoint(column + 1, row + 1));
+        if (row > 0)
+        {
+            triangle.setNeighbour(2, getPoint(column + 1, row - 1));
+        }
+    }
+    else
+    {
+        triangle.vertex[0] = getPoint(column + 1, row);
+        triangle.vertex[1] = getPoint(column, row + 1);
+        triangle.vertex[2] = getPoint(column + 1, row + 1);
+        triangle.setNeighbour(0, getPoint(column, row));
+        if (row + 2 < rows)
+        {
+            triangle.setNeighbour(1, getPoint(column, row + 2));
+        }
+        if (column + 2 < columns)
+        {
+            triangle.setNeighbour(2, getPoint(column + 2, row));
+        }
+    }
+    return triangle;
+}
+
+bool CollisionHeightfield::findCells(const BoundingBox &region,
+                                     int *firstColumn, int *lastColumn,
+                                     int *firstRow, int *lastRow) const
+{
+    Vector3 low = region.centre - region.halfSize - origin;
+    Vector3 high = region.centre + region.halfSize - origin;
+
+    int cellColumns = (int)columns - 1;
+    int cellRows = (int)rows - 1;
+    if (high.x < 0 || low.x > cellColumns * spacingX) return false;
+    if (high.z < 0 || low.z > cellRows * spacingZ) return false;
+
+    *firstColumn = (int)floor(low.x / spacingX);
+    *lastColumn = (int)floor(high.x / spacingX);
+    *firstRow = (int)floor(low.z / spacingZ);
+    *lastRow = (int)floor(high.z / spacingZ);
+
+    if (*firstColumn < 0) *firstColumn = 0;
+    if (*lastColumn > cellColumns - 1) *lastColumn = cellColumns - 1;
+    if (*firstRow < 0) *firstRow = 0;
+    if (*lastRow > cellRows - 1) *lastRow = cellRows - 1;
+    return true;
+}
+
+/**
+ * Runs the triangle test for a primitive on each triangle it is
+ * visited with, counting the contacts generated.
+ */
+template<class Primitive>
+struct TriangleVisitor
+{
+    typedef unsigned (*Test)(
+        const Primitive &primitive,
+        const CollisionTriangle &triangle,
+        CollisionData *data);
+
+    const Primitive &primitive;
+    CollisionData *data;
+    Test test;
+    unsigned used;
+
+    TriangleVisitor(const Primitive &primitive, CollisionData *data, Test test)
+    :
+    primitive(primitive), data(data), test(test), used(0)
+    {
+    }
+
+    void operator()(const CollisionTriangle &triangle)
+    {
+        used += test(primitive, triangle, data);
+    }
+};
+
+template<class Primitive, class Geometry>
+static unsigned collideTriangles(
+    const Primitive &primitive,
+    const Geometry &geometry,
+    CollisionData *data,
+    typename TriangleVisitor<Primitive>::Test test)
+{
+    if (!data->hasMoreContacts()) return 0;
+
+    // Look for triangles within the margin too.
+    BoundingBox bounds = primitive.getWorldBounds();
+    bounds.halfSize += Vector3(data->margin, data->margin, data->margin);
+
+    TriangleVisitor<Primitive> visitor(primitive, data, test);
+    geometry.visitTriangles(bounds, visitor);
+    return visitor.used;
+}
+
+unsigned MeshTests::sphereAndMesh(
+    const CollisionSphere &sphere,
+    const CollisionTriangleMesh &mesh,
+    CollisionData *data
+    )
+{
+    return collideTriangles(sphere, mesh, data,
+        CollisionDetector::sphereAndTriangle);
+}
+
+unsigned MeshTests::boxAndMesh(
+    const CollisionBox &box,
+    const CollisionTriangleMesh &mesh,
+    CollisionData *data
+    )
+{
+    return collideTriangles(box, mesh, data,
+        CollisionDetector::boxAndTriangle);
+}
+
+unsigned MeshTests::capsuleAndMesh(
+    const CollisionCapsule &capsule,
+    const CollisionTriangleMesh &mesh,
+    CollisionData *data
+    )
+{
+    return collideTriangles(capsule, mesh, data,
+        CollisionDetector::capsuleAndTriangle);
+}
+
+unsigned MeshTests::sphereAndHeightfield(
+    const CollisionSphere &sphere,
+    const CollisionHeightfield &heightfield,
+    CollisionData *data
+    )
+{
+    return collideTriangles(sphere, heightfield, data,
+        CollisionDetector::sphereAndTriangle);
+}
+
+unsigned MeshTests::boxAndHeightfield(
+    const CollisionBox &box,
+    const CollisionHeightfield &heightfield,
+    CollisionData *data
+    )
+{
+    return collideTriangles(box, heightfield, data,
+        CollisionDetector::boxAndTriangle);
+}
+
+unsigned MeshTests::capsuleAndHeightfield(
+    const CollisionCapsule &capsule,
+    const CollisionHeightfield &heightfield,
+    CollisionData *data
+    )
+{
+    return collideTriangles(capsule, heightfield, data,
+        CollisionDetector::capsuleAndTriangle);
+}
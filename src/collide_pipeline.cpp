@@ -0,0 +1,1613 @@
+/*
+ * Implementation file for the collision pipeline.
+ *
+ * Part of the Cyclone physics system.
+ *
+ * Copyright (c) Icosagon 2003. All Rights Reserved.
+ *
+ * This software is distributed under licence. Use of this software
+ * implies agreement with all terms and conditions of the accompanying
+ * software licence.
+ */
+
+#include <cyclone/collide_pipeline.h>
+#include <cyclone/collide_compound.h>
+#include <algorithm>
+#include <assert.h>
+
+using namespace cyclone;
+
+CollisionPipeline::CollisionPipeline()
+:
+root(NULL), filtering(false), speculativeTime(0), tolerance(0),
+frame(0)
+{
+}
+
+CollisionPipeline::~CollisionPipeline()
+{
+    delete root;
+    for (unsigned i = 0; i < narrowphaseTasks.size(); i++)
+    {
+        delete narrowphaseTasks[i];
+    }
+}
+
+void CollisionPipeline::add(CollisionPrimitive *primitive,
+                            PrimitiveType type)
+{
+    assert(primitive->body);
+
+    PrimitiveRegistration registration;
+    registration.primitive = primitive;
+    registration.type = type;
+    primitives.push_back(registration);
+}
+
+void CollisionPipeline::addSphere(CollisionSphere *sphere)
+{
+    add(sphere, PRIMITIVE_SPHERE);
+}
+
+void CollisionPipeline::addBox(CollisionBox *box)
+{
+    add(box, PRIMITIVE_BOX);
+}
+
+void CollisionPipeline::addCapsule(CollisionCapsule *capsule)
+{
+    add(capsule, PRIMITIVE_CAPSULE);
+}
+
+void CollisionPipeline::addHull(CollisionConvexHull *hull)
+{
+    add(hull, PRIMITIVE_HULL);
+}
+
+void CollisionPipeline::addCompound(CollisionCompound *compound)
+{
+    add(compound, PRIMITIVE_COMPOUND);
+}
+
+void CollisionPipeline::addPlane(CollisionPlane *plane)
+{
+    planes.push_back(plane);
+}
+
+void CollisionPipeline::addMesh(const CollisionTriangleMesh *mesh)
+{
+    meshes.push_back(mesh);
+}
+
+void CollisionPipeline::addHeightfield(const CollisionHeightfield *heightfield)
+{
+    heightfields.push_back(heightfield);
+}
+
+void CollisionPipeline::remove(const CollisionPrimitive *primitive)
+{
+    for (Registry::iterator i = primitives.begin();
+        i != primitives.end();
+        i++)
+    {
+        if (i->primitive == primitive)
+        {
+            primitives.erase(i);
+            break;
+        }
+    }
+
+    // Drop any cached results for the primitive, as its address may
+    // be reused.
+    for (unsigned t = 0; t < narrowphaseTasks.size(); t++)
+    {
+        ConvexCacheMap &caches = narrowphaseTasks[t]->convexCaches;
+        ConvexCacheMap::iterator j = caches.begin();
+        while (j != caches.end())
+        {
+            if (j->first.first == primitive || j->first.second == primitive)
+            {
+                caches.erase(j++);
+            }
+            else
+            {
+                ++j;
+            }
+        }
+    }
+}
+
+void CollisionPipeline::removePlane(const CollisionPlane *plane)
+{
+    for (std::vector<CollisionPlane*>::iterator i = planes.begin();
+        i != planes.end();
+        i++)
+    {
+        if (*i == plane)
+        {
+            planes.erase(i);
+            return;
+        }
+    }
+}
+
+void CollisionPipeline::removeMesh(const CollisionTriangleMesh *mesh)
+{
+    std::vector<const CollisionTriangleMesh*>::iterator i =
+        std::find(meshes.begin(), meshes.end(), mesh);
+    if (i != meshes.end()) meshes.erase(i);
+}
+
+void CollisionPipeline::removeHeightfield(
+    const CollisionHeightfield *heightfield)
+{
+    std::vector<const CollisionHeightfield*>::iterator i =
+        std::find(heightfields.begin(), heightfields.end(), heightfield);
+    if (i != heightfields.end()) heightfields.erase(i);
+}
+
+void CollisionPipeline::clear()
+{
+    primitives.clear();
+    planes.clear();
+    meshes.clear();
+    heightfields.clear();
+    for (unsigned i = 0; i < narrowphaseTasks.size(); i++)
+    {
+        narrowphaseTasks[i]->convexCaches.clear();
+        narrowphaseTasks[i]->axisCache.clear();
+    }
+    triggerEvents.clear();
+}
+
+CollisionPipeline::BodyPair CollisionPipeline::makeBodyPair(RigidBody *one,
+                                                           RigidBody *two)
+{
+    if (two < one) return BodyPair(two, one);
+    return BodyPair(one, two);
+}
+
+void CollisionPipeline::ignorePair(RigidBody *one, RigidBody *two)
+{
+    ignoredPairs.insert(makeBodyPair(one, two));
+}
+
+void CollisionPipeline::removeIgnoredPair(RigidBody *one, RigidBody *two)
+{
+    ignoredPairs.erase(makeBodyPair(one, two));
+}
+
+void CollisionPipeline::clearIgnoredPairs()
+{
+    ignoredPairs.clear();
+}
+
+bool CollisionPipeline::isPairIgnored(RigidBody *one, RigidBody *two) const
+{
+    return !ignoredPairs.empty() &&
+        ignoredPairs.find(makeBodyPair(one, two)) != ignoredPairs.end();
+}
+
+void CollisionPipeline::setThreadCount(unsigned threads)
+{
+    pool.setThreadCount(threads);
+}
+
+void CollisionPipeline::setSpeculativeTime(real time)
+{
+    speculativeTime = time > 0 ? time : 0;
+}
+
+BoundingSphere CollisionPipeline::getBoundingSphere(
+    const PrimitiveRegistration &registration)
+{
+    const CollisionPrimitive *primitive = registration.primitive;
+    switch (registration.type)
+    {
+    case PRIMITIVE_SPHERE:
+        return BoundingSphere(
+            primitive->getAxis(3),
+            static_cast<const CollisionSphere*>(primitive)->radius
+            );
+
+    case PRIMITIVE_CAPSULE:
+        {
+            const CollisionCapsule *capsule =
+                static_cast<const CollisionCapsule*>(primitive);
+            return BoundingSphere(
+                primitive->getAxis(3),
+                capsule->halfLength + capsule->radius
+                );
+        }
+
+    case PRIMITIVE_HULL:
+        return BoundingSphere(
+            primitive->getAxis(3),
+            static_cast<const CollisionConvexHull*>(primitive)->getRadius()
+            );
+
+    case PRIMITIVE_COMPOUND:
+        return static_cast<const CollisionCompound*>(primitive)->
+            getBoundingSphere();
+
+    case PRIMITIVE_BOX:
+    default:
+        return BoundingSphere(
+            primitive->getAxis(3),
+            static_cast<const CollisionBox*>(primitive)->halfSize.magnitude()
+            );
+    }
+}
+
+void CollisionPipeline::buildHierarchy()
+{
+    delete root;
+    root = NULL;
+
+    bodies.clear();
+    bodyLookup.clear();
+    bodyPrimitives.clear();
+
+    // Sort the primitives by body, so each body's primitives are
+    // together (and in registration order within the body).
+    typedef std::pair<RigidBody*, unsigned> BodyIndex;
+    std::vector<BodyIndex> sorted(primitives.size());
+    for (unsigned i = 0; i < primitives.size(); i++)
+    {
+        sorted[i] = BodyIndex(primitives[i].primitive->body, i);
+    }
+    std::sort(sorted.begin(), sorted.end());
+
+    // We want the bodies in the order they were first registered,
+    // not in address order, so the results don't depend on where
+    // the bodies happen to be in memory. Order the groups by their
+    // first primitive.
+    std::vector< std::pair<unsigned, unsigned> > order;
+    for (unsigned i = 0; i < sorted.size(); i++)
+    {
+        if (i == 0 || sorted[i].first != sorted[i-1].first)
+        {
+            order.push_back(std::make_pair(sorted[i].second, i));
+        }
+    }
+    std::sort(order.begin(), order.end());
+
+    // Create the records, copying each group's primitives into place.
+    filtering = !ignoredPairs.empty();
+    bodyLookup.resize(order.size());
+    for (unsigned r = 0; r < order.size(); r++)
+    {
+        unsigned index = order[r].second;
+        BodyRecord record;
+        record.body = sorted[index].first;
+        record.firstPrimitive = (unsigned)bodyPrimitives.size();
+        record.category = 0;
+        record.mask = 0;
+        while (index < sorted.size() && sorted[index].first == record.body)
+        {
+            const CollisionPrimitive *primitive =
+                primitives[sorted[index].second].primitive;
+            record.category |= primitive->category;
+            record.mask |= primitive->mask;
+            bodyPrimitives.push_back(sorted[index].second);
+            index++;
+        }
+        record.primitiveCount =
+            (unsigned)bodyPrimitives.size() - record.firstPrimitive;
+        record.margin = 0;
+
+        // Join the world bounds of the body's primitives.
+        const BoundingBox &first = primitives[
+            bodyPrimitives[record.firstPrimitive]].primitive->getWorldBounds();
+        Vector3 low = first.centre - first.halfSize;
+        Vector3 high = first.centre + first.halfSize;
+        for (unsigned p = 1; p < record.primitiveCount; p++)
+        {
+            const BoundingBox &bounds = primitives[
+                bodyPrimitives[record.firstPrimitive + p]
+                ].primitive->getWorldBounds();
+            for (unsigned j = 0; j < 3; j++)
+            {
+                real lower = bounds.centre[j] - bounds.halfSize[j];
+                real upper = bounds.centre[j] + bounds.halfSize[j];
+                if (lower < low[j]) low[j] = lower;
+                if (upper > high[j]) high[j] = upper;
+            }
+        }
+        record.bounds = BoundingBox((low + high) * (real)0.5,
+            (high - low) * (real)0.5);
+
+        // Bodies that collide with everything never need filtering.
+        if (record.category == 0 || record.mask != 0xffffffff)
+        {
+            filtering = true;
+        }
+        bodies.push_back(record);
+        bodyLookup[r] = BodyIndex(record.body, r);
+    }
+    std::sort(bodyLookup.begin(), bodyLookup.end());
+
+    // Build the hierarchy, with one leaf per body enclosing all of
+    // its primitives.
+    for (unsigned b = 0; b < bodies.size(); b++)
+    {
+        BodyRecord &record = bodies[b];
+        BoundingSphere volume = getBoundingSphere(
+            primitives[bodyPrimitives[record.firstPrimitive]]
+            );
+        for (unsigned p = 1; p < record.primitiveCount; p++)
+        {
+            volume = BoundingSphere(volume, getBoundingSphere(
+                primitives[bodyPrimitives[record.firstPrimitive + p]]
+                ));
+        }
+
+        // For speculative contacts, grow the volume by as far as any
+        // point in it can move, and half the tolerance, so pairs that
+        // could close the gap between them are found.
+        if (speculativeTime > 0)
+        {
+            const RigidBody *body = record.body;
+            real reach = volume.radius +
+                (volume.centre - body->getPosition()).magnitude();
+            record.margin = speculativeTime * (
+                body->getVelocity().magnitude() +
+                body->getRotation().magnitude() * reach
+                );
+            volume.radius += record.margin + tolerance * (real)0.5;
+        }
+
+        if (!root)
+        {
+            root = new BVHNode<BoundingSphere>(NULL, volume, record.body);
+        }
+        else
+        {
+            root->insert(record.body, volume);
+        }
+    }
+}
+
+unsigned CollisionPipeline::findBody(RigidBody *body) const
+{
+    std::vector< std::pair<RigidBody*, unsigned> >::const_iterator i =
+        std::lower_bound(bodyLookup.begin(), bodyLookup.end(),
+            std::make_pair(body, 0u));
+    assert(i != bodyLookup.end() && i->first == body);
+    return i->second;
+}
+
+struct CollisionPipeline::BodyFilter : public PairFilter
+{
+    const CollisionPipeline *pipeline;
+
+    bool allowPair(RigidBody *one, RigidBody *two) const
+    {
+        const BodyRecord &first = pipeline->bodies[pipeline->findBody(one)];
+        const BodyRecord &second = pipeline->bodies[pipeline->findBody(two)];
+
+        // The body's categories and masks are each the union of its
+        // primitives', so if they rule the pair out, no pair of
+        // primitives could collide.
+        if ((first.category & second.mask) == 0 ||
+            (second.category & first.mask) == 0)
+        {
+            return false;
+        }
+        return !pipeline->isPairIgnored(one, two);
+    }
+};
+
+unsigned CollisionPipeline::findPotentialContacts()
+{
+    buildHierarchy();
+
+    potentialContacts.clear();
+    if (root)
+    {
+        BodyFilter filter;
+        filter.pipeline = this;
+        root->getPotentialContacts(potentialContacts, &pool,
+            filtering ? &filter : NULL);
+    }
+
+    pairManager.update(
+        potentialContacts.empty() ? NULL : &potentialContacts[0],
+        (unsigned)potentialContacts.size()
+        );
+    return (unsigned)potentialContacts.size();
+}
+
+void CollisionPipeline::collide(const PrimitiveRegistration &one,
+                                const PrimitiveRegistration &two,
+                                CollisionData *data,
+                                const NarrowphaseOutput &output)
+{
+    // Put the pair in type order, so there's one case for each
+    // combination of types.
+    if (one.type > two.type)
+    {
+        collide(two, one, data, output);
+        return;
+    }
+
+    // Compounds come last in type order.
+    if (two.type == PRIMITIVE_COMPOUND)
+    {
+        collideCompound(one, two, data, output);
+        return;
+    }
+
+    // This is reached for triggers that are children of compounds.
+    if (one.primitive->trigger || two.primitive->trigger)
+    {
+        collideTrigger(one, two, output);
+        return;
+    }
+
+    unsigned firstContact = data->contactCount;
+    unsigned used = 0;
+
+    // The tests take the more complex primitive first.
+    CollisionPrimitive *first = two.primitive;
+    CollisionPrimitive *second = one.primitive;
+
+    switch (one.type * PRIMITIVE_TYPE_COUNT + two.type)
+    {
+    case PRIMITIVE_SPHERE * PRIMITIVE_TYPE_COUNT + PRIMITIVE_SPHERE:
+        first = one.primitive;
+        second = two.primitive;
+        used = CollisionDetector::sphereAndSphere(
+            *static_cast<CollisionSphere*>(first),
+            *static_cast<CollisionSphere*>(second),
+            data);
+        break;
+
+    case PRIMITIVE_SPHERE * PRIMITIVE_TYPE_COUNT + PRIMITIVE_BOX:
+        used = CollisionDetector::boxAndSphere(
+            *static_cast<CollisionBox*>(first),
+            *static_cast<CollisionSphere*>(second),
+            data);
+        break;
+
+    case PRIMITIVE_SPHERE * PRIMITIVE_TYPE_COUNT + PRIMITIVE_CAPSULE:
+        used = CollisionDetector::capsuleAndSphere(
+            *static_cast<CollisionCapsule*>(first),
+            *static_cast<CollisionSphere*>(second),
+            data);
+        break;
+
+    case PRIMITIVE_BOX * PRIMITIVE_TYPE_COUNT + PRIMITIVE_BOX:
+        first = one.primitive;
+        second = two.primitive;
+        used = CollisionDetector::boxAndBox(
+            *static_cast<CollisionBox*>(first),
+            *static_cast<CollisionBox*>(second),
+            data,
+            &output.task->axisCache);
+        break;
+
+    case PRIMITIVE_BOX * PRIMITIVE_TYPE_COUNT + PRIMITIVE_CAPSULE:
+        first = one.primitive;
+        second = two.primitive;
+        used = CollisionDetector::boxAndCapsule(
+            *static_cast<CollisionBox*>(first),
+            *static_cast<CollisionCapsule*>(second),
+            data);
+        break;
+
+    case PRIMITIVE_CAPSULE * PRIMITIVE_TYPE_COUNT + PRIMITIVE_CAPSULE:
+        first = one.primitive;
+        second = two.primitive;
+        used = CollisionDetector::capsuleAndCapsule(
+            *static_cast<CollisionCapsule*>(first),
+            *static_cast<CollisionCapsule*>(second),
+            data);
+        break;
+
+    default:
+        // Anything involving a hull uses the general convex test.
+        first = one.primitive;
+        second = two.primitive;
+        used = ConvexTests::collide(
+            getConvexShape(one), getConvexShape(two), data,
+            getConvexCache(output.task, first, second));
+        break;
+    }
+
+    if (used > 0)
+    {
+        CollisionPair pair;
+        pair.primitive[0] = first;
+        pair.primitive[1] = second;
+        pair.firstContact = firstContact;
+        pair.contactCount = used;
+        output.collisionPairs->push_back(pair);
+    }
+}
+
+void CollisionPipeline::collideTrigger(const PrimitiveRegistration &one,
+                                       const PrimitiveRegistration &two,
+                                       const NarrowphaseOutput &output)
+{
+    // Put the pair in type order, as for collide.
+    if (one.type > two.type)
+    {
+        collideTrigger(two, one, output);
+        return;
+    }
+
+    // A compound is tested a child at a time.
+    if (two.type == PRIMITIVE_COMPOUND)
+    {
+        const CollisionCompound *compound =
+            static_cast<const CollisionCompound*>(two.primitive);
+        for (unsigned i = 0; i < compound->getChildCount(); i++)
+        {
+            const CollisionCompound::Child &child = compound->getChild(i);
+            if (!child.primitive->canCollide(*one.primitive)) continue;
+            if (!child.primitive->getWorldBounds().overlaps(
+                &one.primitive->getWorldBounds()))
+            {
+                continue;
+            }
+
+            PrimitiveRegistration childRegistration;
+            childRegistration.primitive = child.primitive;
+            childRegistration.type = child.type;
+            collideTrigger(one, childRegistration, output);
+        }
+        return;
+    }
+
+    // Triggers don't report each other.
+    if (one.primitive->trigger == two.primitive->trigger) return;
+
+    bool overlap;
+    switch (one.type * PRIMITIVE_TYPE_COUNT + two.type)
+    {
+    case PRIMITIVE_SPHERE * PRIMITIVE_TYPE_COUNT + PRIMITIVE_SPHERE:
+        overlap = IntersectionTests::sphereAndSphere(
+            *static_cast<CollisionSphere*>(one.primitive),
+            *static_cast<CollisionSphere*>(two.primitive));
+        break;
+
+    case PRIMITIVE_SPHERE * PRIMITIVE_TYPE_COUNT + PRIMITIVE_BOX:
+        overlap = IntersectionTests::boxAndSphere(
+            *static_cast<CollisionBox*>(two.primitive),
+            *static_cast<CollisionSphere*>(one.primitive));
+        break;
+
+    case PRIMITIVE_BOX * PRIMITIVE_TYPE_COUNT + PRIMITIVE_BOX:
+        overlap = IntersectionTests::boxAndBox(
+            *static_cast<CollisionBox*>(one.primitive),
+            *static_cast<CollisionBox*>(two.primitive));
+        break;
+
+    default:
+        // Capsules and hulls use the general convex test.
+        overlap = ConvexTests::intersect(
+            getConvexShape(one), getConvexShape(two),
+            getConvexCache(output.task, one.primitive, two.primitive));
+        break;
+    }
+
+    if (!overlap) return;
+    if (one.primitive->trigger)
+    {
+        output.overlaps->push_back(
+            TriggerEventBuffer::Overlap(one.primitive, two.primitive));
+    }
+    else
+    {
+        output.overlaps->push_back(
+            TriggerEventBuffer::Overlap(two.primitive, one.primitive));
+    }
+}
+
+void CollisionPipeline::collideStatic(
+    const PrimitiveRegistration &registration,
+    CollisionData *data)
+{
+    const CollisionPrimitive *primitive = registration.primitive;
+    if (primitive->trigger) return;
+
+    switch (registration.type)
+    {
+    case PRIMITIVE_SPHERE:
+        {
+            const CollisionSphere &sphere =
+                *static_cast<const CollisionSphere*>(primitive);
+            for (unsigned m = 0; m < meshes.size(); m++)
+            {
+                MeshTests::sphereAndMesh(sphere, *meshes[m], data);
+            }
+            for (unsigned h = 0; h < heightfields.size(); h++)
+            {
+                MeshTests::sphereAndHeightfield(sphere, *heightfields[h], data);
+            }
+        }
+        break;
+
+    case PRIMITIVE_BOX:
+        {
+            const CollisionBox &box =
+                *static_cast<const CollisionBox*>(primitive);
+            for (unsigned m = 0; m < meshes.size(); m++)
+            {
+                MeshTests::boxAndMesh(box, *meshes[m], data);
+            }
+            for (unsigned h = 0; h < heightfields.size(); h++)
+            {
+                MeshTests::boxAndHeightfield(box, *heightfields[h], data);
+            }
+        }
+        break;
+
+    case PRIMITIVE_CAPSULE:
+        {
+            const CollisionCapsule &capsule =
+                *static_cast<const CollisionCapsule*>(primitive);
+            for (unsigned m = 0; m < meshes.size(); m++)
+            {
+                MeshTests::capsuleAndMesh(capsule, *meshes[m], data);
+            }
+            for (unsigned h = 0; h < heightfields.size(); h++)
+            {
+                MeshTests::capsuleAndHeightfield(
+                    capsule, *heightfields[h], data);
+            }
+        }
+        break;
+
+    case PRIMITIVE_COMPOUND:
+        {
+            const CollisionCompound *compound =
+                static_cast<const CollisionCompound*>(primitive);
+            for (unsigned i = 0; i < compound->getChildCount(); i++)
+            {
+                if (!data->hasMoreContacts()) return;
+
+                const CollisionCompound::Child &child = compound->getChild(i);
+                PrimitiveRegistration childRegistration;
+                childRegistration.primitive = child.primitive;
+                childRegistration.type = child.type;
+                collideStatic(childRegistration, data);
+            }
+        }
+        break;
+
+    default:
+        // Hulls have no triangle test.
+        break;
+    }
+}
+
+struct CollisionPipeline::CompoundVisitor
+{
+    CollisionPipeline *pipeline;
+    const PrimitiveRegistration *other;
+    const CollisionCompound *compound;
+    CollisionData *data;
+    const NarrowphaseOutput *output;
+
+    void operator()(unsigned index)
+    {
+        const CollisionCompound::Child &child = compound->getChild(index);
+        if (!child.primitive->canCollide(*other->primitive)) return;
+        if (!child.primitive->getWorldBounds().overlaps(
+            &other->primitive->getWorldBounds(), data->margin))
+        {
+            return;
+        }
+
+        // Triggers don't use up contacts, so they are tested even
+        // once the collision data is full.
+        if (!child.primitive->trigger && !other->primitive->trigger &&
+            !data->hasMoreContacts())
+        {
+            return;
+        }
+
+        PrimitiveRegistration registration;
+        registration.primitive = child.primitive;
+        registration.type = child.type;
+        pipeline->collide(*other, registration, data, *output);
+    }
+};
+
+void CollisionPipeline::collideCompound(
+    const PrimitiveRegistration &other,
+    const PrimitiveRegistration &compound,
+    CollisionData *data,
+    const NarrowphaseOutput &output)
+{
+    const CollisionCompound *shape =
+        static_cast<const CollisionCompound*>(compound.primitive);
+
+    // Find the bounds of the other primitive in the compound's
+    // coordinates, and test it against the children they overlap.
+    BoundingSphere sphere = getBoundingSphere(other);
+    real radius = sphere.radius + data->margin;
+    BoundingBox region(
+        shape->getTransform().transformInverse(sphere.centre),
+        Vector3(radius, radius, radius)
+        );
+
+    CompoundVisitor visitor;
+    visitor.pipeline = this;
+    visitor.other = &other;
+    visitor.compound = shape;
+    visitor.data = data;
+    visitor.output = &output;
+    shape->visitChildren(region, visitor);
+}
+
+/**
+ * Keeps a sweep hit in the result if it is earlier than the hit
+ * already there.
+ */
+static void keepSweepHit(
+    const CollisionSphere &sphere,
+    const Vector3 &movement,
+    real time,
+    const Vector3 &normal,
+    CollisionPrimitive *primitive,
+    SweepResult *result)
+{
+    if (time >= result->time) return;
+
+    result->time = time;
+    result->normal = normal;
+    result->point = sphere.getAxis(3) + movement * time -
+        normal * sphere.radius;
+    result->primitive = primitive;
+}
+
+/**
+ * Sweeps a sphere against each triangle it is visited with.
+ */
+struct SweepVisitor
+{
+    const CollisionSphere *sphere;
+    const Vector3 *movement;
+    SweepResult *result;
+
+    void operator()(const CollisionTriangle &triangle)
+    {
+        real time;
+        Vector3 normal;
+        if (SweptTests::sphereAndTriangle(
+            *sphere, *movement, triangle, &time, &normal))
+        {
+            keepSweepHit(*sphere, *movement, time, normal, NULL, result);
+        }
+    }
+};
+
+void CollisionPipeline::sweepPrimitive(
+    const PrimitiveRegistration &registration,
+    const CollisionSphere &sphere,
+    const Vector3 &movement,
+    SweepResult *result)
+{
+    CollisionPrimitive *primitive = registration.primitive;
+    if (primitive->trigger) return;
+
+    // Skip primitives whose bounding sphere the swept sphere misses.
+    BoundingSphere bounds = getBoundingSphere(registration);
+    Vector3 start = sphere.getAxis(3);
+    Vector3 toCentre = bounds.centre - start;
+    real movementSquared = movement.squareMagnitude();
+    real along = movementSquared > 0 ?
+        (toCentre * movement) / movementSquared : 0;
+    if (along < 0) along = 0;
+    else if (along > 1) along = 1;
+    real reach = bounds.radius + sphere.radius;
+    if ((toCentre - movement * along).squareMagnitude() > reach * reach)
+    {
+        return;
+    }
+
+    real time;
+    Vector3 normal;
+    bool hit = false;
+    switch (registration.type)
+    {
+    case PRIMITIVE_SPHERE:
+        hit = SweptTests::sphereAndSphere(sphere, movement,
+            *static_cast<CollisionSphere*>(primitive), &time, &normal);
+        break;
+
+    case PRIMITIVE_BOX:
+        hit = SweptTests::sphereAndBox(sphere, movement,
+            *static_cast<CollisionBox*>(primitive), &time, &normal);
+        break;
+
+    case PRIMITIVE_CAPSULE:
+        hit = SweptTests::sphereAndCapsule(sphere, movement,
+            *static_cast<CollisionCapsule*>(primitive), &time, &normal);
+        break;
+
+    case PRIMITIVE_COMPOUND:
+        {
+            const CollisionCompound *compound =
+                static_cast<const CollisionCompound*>(primitive);
+            for (unsigned i = 0; i < compound->getChildCount(); i++)
+            {
+                const CollisionCompound::Child &child = compound->getChild(i);
+                PrimitiveRegistration childRegistration;
+                childRegistration.primitive = child.primitive;
+                childRegistration.type = child.type;
+                sweepPrimitive(childRegistration, sphere, movement, result);
+            }
+        }
+        break;
+
+    default:
+        // Hulls aren't swept.
+        break;
+    }
+
+    if (hit) keepSweepHit(sphere, movement, time, normal, primitive, result);
+}
+
+/**
+ * Keeps a shape sweep hit in the result if it is earlier than the
+ * hit already there.
+ */
+static void keepShapeHit(
+    real time,
+    const Vector3 &normal,
+    const Vector3 &point,
+    CollisionPrimitive *primitive,
+    SweepResult *result)
+{
+    if (time >= result->time) return;
+
+    result->time = time;
+    result->normal = normal;
+    result->point = point;
+    result->primitive = primitive;
+}
+
+/**
+ * Returns a box around everything a shape with the given bounding
+ * radius passes through when it is moved from the given start.
+ */
+static BoundingBox getSweptRegion(const Vector3 &start,
+                                  const Vector3 &movement,
+                                  real radius)
+{
+    Vector3 halfSize = movement * (real)0.5;
+    halfSize.x = real_abs(halfSize.x) + radius;
+    halfSize.y = real_abs(halfSize.y) + radius;
+    halfSize.z = real_abs(halfSize.z) + radius;
+    return BoundingBox(start + movement * (real)0.5, halfSize);
+}
+
+/**
+ * Sweeps a convex shape against each triangle it is visited with.
+ */
+struct ShapeSweepVisitor
+{
+    const ConvexShape *shape;
+    const Vector3 *movement;
+    SweepResult *result;
+
+    /**
+     * Holds the triangle being tested as a hull, with no body and
+     * its vertices in world coordinates.
+     */
+    CollisionConvexHull triangle;
+
+    void operator()(const CollisionTriangle &current)
+    {
+        triangle.vertices.assign(current.vertex, current.vertex + 3);
+
+        real time;
+        Vector3 normal, point;
+        if (ConvexTests::sweep(*shape, *movement, ConvexShape(triangle),
+            &time, &normal, &point))
+        {
+            keepShapeHit(time, normal, point, NULL, result);
+        }
+    }
+};
+
+void CollisionPipeline::sweepShape(
+    const PrimitiveRegistration &registration,
+    const ConvexShape &shape,
+    const Vector3 &movement,
+    SweepResult *result)
+{
+    if (registration.primitive->trigger) return;
+
+    if (registration.type == PRIMITIVE_COMPOUND)
+    {
+        const CollisionCompound *compound =
+            static_cast<const CollisionCompound*>(registration.primitive);
+        for (unsigned i = 0; i < compound->getChildCount(); i++)
+        {
+            const CollisionCompound::Child &child = compound->getChild(i);
+            PrimitiveRegistration childRegistration;
+            childRegistration.primitive = child.primitive;
+            childRegistration.type = child.type;
+            sweepShape(childRegistration, shape, movement, result);
+        }
+        return;
+    }
+
+    real time;
+    Vector3 normal, point;
+    if (ConvexTests::sweep(shape, movement, getConvexShape(registration),
+        &time, &normal, &point))
+    {
+        keepShapeHit(time, normal, point, registration.primitive, result);
+    }
+}
+
+void CollisionPipeline::findSweptBodies(const Vector3 &start,
+                                        const Vector3 &movement,
+                                        real radius,
+                                        std::vector<RigidBody*> &found) const
+{
+    if (!root) return;
+
+    BoundingSphere region(
+        start + movement * (real)0.5,
+        movement.magnitude() * (real)0.5 + radius
+        );
+    root->getBodiesInRegion(region, found);
+}
+
+bool CollisionPipeline::sweepSphere(const CollisionSphere &sphere,
+                                    const Vector3 &movement,
+                                    SweepResult *result) const
+{
+    result->time = REAL_MAX;
+    result->primitive = NULL;
+
+    sweptBodies.clear();
+    findSweptBodies(sphere.getAxis(3), movement, sphere.radius, sweptBodies);
+    for (unsigned b = 0; b < sweptBodies.size(); b++)
+    {
+        RigidBody *body = sweptBodies[b];
+        if (body == sphere.body) continue;
+        if (isPairIgnored(body, sphere.body)) continue;
+
+        const BodyRecord &record = bodies[findBody(body)];
+        for (unsigned i = 0; i < record.primitiveCount; i++)
+        {
+            unsigned index = bodyPrimitives[record.firstPrimitive + i];
+            if (!sphere.canCollide(*primitives[index].primitive)) continue;
+            sweepPrimitive(primitives[index], sphere, movement, result);
+        }
+    }
+
+    for (unsigned p = 0; p < planes.size(); p++)
+    {
+        real time;
+        Vector3 normal;
+        if (SweptTests::sphereAndHalfSpace(
+            sphere, movement, *planes[p], &time, &normal))
+        {
+            keepSweepHit(sphere, movement, time, normal, NULL, result);
+        }
+    }
+
+    if (!meshes.empty() || !heightfields.empty())
+    {
+        // Look for triangles around the whole sweep.
+        BoundingBox region =
+            getSweptRegion(sphere.getAxis(3), movement, sphere.radius);
+
+        SweepVisitor visitor;
+        visitor.sphere = &sphere;
+        visitor.movement = &movement;
+        visitor.result = result;
+        for (unsigned m = 0; m < meshes.size(); m++)
+        {
+            meshes[m]->visitTriangles(region, visitor);
+        }
+        for (unsigned h = 0; h < heightfields.size(); h++)
+        {
+            heightfields[h]->visitTriangles(region, visitor);
+        }
+    }
+
+    return result->time <= 1;
+}
+
+bool CollisionPipeline::sweepBox(const CollisionBox &box,
+                                 const Vector3 &movement,
+                                 SweepResult *result) const
+{
+    result->time = REAL_MAX;
+    result->primitive = NULL;
+
+    ConvexShape shape(box);
+    Vector3 start = box.getAxis(3);
+    real radius = box.halfSize.magnitude();
+
+    sweptBodies.clear();
+    findSweptBodies(start, movement, radius, sweptBodies);
+    for (unsigned b = 0; b < sweptBodies.size(); b++)
+    {
+        RigidBody *body = sweptBodies[b];
+        if (body == box.body) continue;
+        if (isPairIgnored(body, box.body)) continue;
+
+        const BodyRecord &record = bodies[findBody(body)];
+        for (unsigned i = 0; i < record.primitiveCount; i++)
+        {
+            unsigned index = bodyPrimitives[record.firstPrimitive + i];
+            if (!box.canCollide(*primitives[index].primitive)) continue;
+            sweepShape(primitives[index], shape, movement, result);
+        }
+    }
+
+    for (unsigned p = 0; p < planes.size(); p++)
+    {
+        // The box first touches a plane with its deepest vertex, so
+        // we only need to see when that vertex crosses it.
+        const CollisionPlane &plane = *planes[p];
+        Vector3 vertex = start;
+        for (unsigned i = 0; i < 3; i++)
+        {
+            Vector3 axis = box.getAxis(i);
+            if (axis * plane.direction > 0) vertex -= axis * box.halfSize[i];
+            else vertex += axis * box.halfSize[i];
+        }
+
+        real height = vertex * plane.direction - plane.offset;
+        real closing = -(movement * plane.direction);
+        if (height < 0 || closing <= 0 || height > closing) continue;
+
+        real time = height / closing;
+        keepShapeHit(time, plane.direction, vertex + movement * time,
+            NULL, result);
+    }
+
+    if (!meshes.empty() || !heightfields.empty())
+    {
+        BoundingBox region = getSweptRegion(start, movement, radius);
+
+        ShapeSweepVisitor visitor;
+        visitor.shape = &shape;
+        visitor.movement = &movement;
+        visitor.result = result;
+        for (unsigned m = 0; m < meshes.size(); m++)
+        {
+            meshes[m]->visitTriangles(region, visitor);
+        }
+        for (unsigned h = 0; h < heightfields.size(); h++)
+        {
+            heightfields[h]->visitTriangles(region, visitor);
+        }
+    }
+
+    return result->time <= 1;
+}
+
+void CollisionPipeline::castPrimitive(
+    const PrimitiveRegistration &registration,
+    const RayBatch &rays,
+    const unsigned *indices,
+    unsigned count,
+    RayHit *hits)
+{
+    const CollisionPrimitive *primitive = registration.primitive;
+    if (primitive->trigger) return;
+
+    switch (registration.type)
+    {
+    case PRIMITIVE_SPHERE:
+        RayTests::raysAndSphere(rays, indices, count,
+            *static_cast<const CollisionSphere*>(primitive), hits);
+        break;
+
+    case PRIMITIVE_BOX:
+        RayTests::raysAndBox(rays, indices, count,
+            *static_cast<const CollisionBox*>(primitive), hits);
+        break;
+
+    case PRIMITIVE_COMPOUND:
+        {
+            const CollisionCompound *compound =
+                static_cast<const CollisionCompound*>(primitive);
+            for (unsigned i = 0; i < compound->getChildCount(); i++)
+            {
+                const CollisionCompound::Child &child = compound->getChild(i);
+                PrimitiveRegistration childRegistration;
+                childRegistration.primitive = child.primitive;
+                childRegistration.type = child.type;
+                castPrimitive(childRegistration, rays, indices, count, hits);
+            }
+        }
+        break;
+
+    default:
+        // Capsules and hulls aren't cast against.
+        break;
+    }
+}
+
+struct CollisionPipeline::RayVisitor
+{
+    const CollisionPipeline *pipeline;
+    const RayBatch *rays;
+    RayHit *hits;
+
+    void operator()(RigidBody *body, const unsigned *indices, unsigned count)
+    {
+        const BodyRecord &record = pipeline->bodies[pipeline->findBody(body)];
+        for (unsigned i = 0; i < record.primitiveCount; i++)
+        {
+            unsigned index =
+                pipeline->bodyPrimitives[record.firstPrimitive + i];
+            castPrimitive(pipeline->primitives[index],
+                *rays, indices, count, hits);
+        }
+    }
+};
+
+void CollisionPipeline::castRays(const RayBatch &rays, RayHit *hits) const
+{
+    rays.resetHits(hits);
+
+    // The planes go first, so their hits can cull the hierarchy.
+    for (unsigned p = 0; p < planes.size(); p++)
+    {
+        RayTests::raysAndHalfSpace(rays, NULL, rays.size(), *planes[p], hits);
+    }
+
+    if (root)
+    {
+        RayVisitor visitor;
+        visitor.pipeline = this;
+        visitor.rays = &rays;
+        visitor.hits = hits;
+        root->castRays(rays, hits, visitor);
+    }
+}
+
+void CollisionPipeline::collidePlane(
+    const PrimitiveRegistration &registration,
+    const CollisionPlane &plane,
+    CollisionData *data)
+{
+    CollisionPrimitive *primitive = registration.primitive;
+    if (primitive->trigger) return;
+
+    switch (registration.type)
+    {
+    case PRIMITIVE_SPHERE:
+        CollisionDetector::sphereAndHalfSpace(
+            *static_cast<CollisionSphere*>(primitive), plane, data);
+        break;
+
+    case PRIMITIVE_BOX:
+        CollisionDetector::boxAndHalfSpace(
+            *static_cast<CollisionBox*>(primitive), plane, data, true);
+        break;
+
+    case PRIMITIVE_CAPSULE:
+        CollisionDetector::capsuleAndHalfSpace(
+            *static_cast<CollisionCapsule*>(primitive), plane, data);
+        break;
+
+    case PRIMITIVE_HULL:
+        CollisionDetector::hullAndHalfSpace(
+            *static_cast<CollisionConvexHull*>(primitive), plane, data);
+        break;
+
+    case PRIMITIVE_COMPOUND:
+        {
+            const CollisionCompound *compound =
+                static_cast<const CollisionCompound*>(primitive);
+            for (unsigned i = 0; i < compound->getChildCount(); i++)
+            {
+                if (!data->hasMoreContacts()) return;
+
+                const CollisionCompound::Child &child = compound->getChild(i);
+                PrimitiveRegistration childRegistration;
+                childRegistration.primitive = child.primitive;
+                childRegistration.type = child.type;
+                collidePlane(childRegistration, plane, data);
+            }
+        }
+        break;
+
+    default:
+        break;
+    }
+}
+
+ConvexShape CollisionPipeline::getConvexShape(
+    const PrimitiveRegistration &registration)
+{
+    const CollisionPrimitive *primitive = registration.primitive;
+    switch (registration.type)
+    {
+    case PRIMITIVE_SPHERE:
+        return ConvexShape(*static_cast<const CollisionSphere*>(primitive));
+
+    case PRIMITIVE_BOX:
+        return ConvexShape(*static_cast<const CollisionBox*>(primitive));
+
+    case PRIMITIVE_CAPSULE:
+        return ConvexShape(*static_cast<const CollisionCapsule*>(primitive));
+
+    case PRIMITIVE_HULL:
+    default:
+        return ConvexShape(
+            *static_cast<const CollisionConvexHull*>(primitive)
+            );
+    }
+}
+
+ConvexCache* CollisionPipeline::getConvexCache(
+    NarrowphaseTask *task,
+    const CollisionPrimitive *one,
+    const CollisionPrimitive *two) const
+{
+    CachedSimplex &entry = task->convexCaches[PrimitivePair(one, two)];
+    entry.lastFrame = frame;
+    return &entry.cache;
+}
+
+void CollisionPipeline::buildSphereBatch()
+{
+    sphereBatch.clear();
+    sphereRegistrations.clear();
+    sphereSlots.resize(primitives.size());
+
+    for (unsigned i = 0; i < primitives.size(); i++)
+    {
+        if (primitives[i].type != PRIMITIVE_SPHERE) continue;
+        if (primitives[i].primitive->trigger) continue;
+
+        sphereSlots[i] = sphereBatch.add(
+            *static_cast<CollisionSphere*>(primitives[i].primitive)
+            );
+        sphereRegistrations.push_back(i);
+    }
+}
+
+void CollisionPipeline::generateContacts(CollisionData *data)
+{
+    collisionPairs.clear();
+
+    // Drop the simplex caches for pairs that weren't tested last
+    // frame, as they have moved apart (or into another task).
+    frame++;
+    for (unsigned i = 0; i < narrowphaseTasks.size(); i++)
+    {
+        NarrowphaseTask &task = *narrowphaseTasks[i];
+        task.axisCache.nextFrame();
+        ConvexCacheMap::iterator cache = task.convexCaches.begin();
+        while (cache != task.convexCaches.end())
+        {
+            if (cache->second.lastFrame + 1 < frame)
+            {
+                task.convexCaches.erase(cache++);
+            }
+            else
+            {
+                ++cache;
+            }
+        }
+    }
+
+    triggerEvents.begin();
+
+    // Find the pairs of bodies that might be in contact.
+    tolerance = data->tolerance;
+    findPotentialContacts();
+    if (speculativeTime <= 0) buildSphereBatch();
+
+    // The margin is set for each test when speculative contacts are
+    // on, so put it back afterwards.
+    real margin = data->margin;
+    collideBodies(data);
+    collideScenery(data);
+    data->margin = margin;
+
+    triggerEvents.finish();
+}
+
+// The number of body pairs in each piece of the fine grained tests.
+// The pieces don't depend on the number of threads, so the contacts
+// come out in the same order however many are used.
+static const unsigned NARROWPHASE_TASK_PAIRS = 64;
+
+void CollisionPipeline::reserveNarrowphaseTasks(unsigned count)
+{
+    while (narrowphaseTasks.size() < count)
+    {
+        narrowphaseTasks.push_back(new NarrowphaseTask);
+    }
+}
+
+void CollisionPipeline::collideBodies(CollisionData *data)
+{
+    triggerOverlaps.clear();
+    unsigned pairCount = (unsigned)potentialContacts.size();
+    unsigned taskCount =
+        (pairCount + NARROWPHASE_TASK_PAIRS - 1) / NARROWPHASE_TASK_PAIRS;
+    reserveNarrowphaseTasks(taskCount);
+    for (unsigned i = 0; i < taskCount; i++)
+    {
+        NarrowphaseTask &task = *narrowphaseTasks[i];
+        task.firstPair = i * NARROWPHASE_TASK_PAIRS;
+        task.pairCount = pairCount - task.firstPair;
+        if (task.pairCount > NARROWPHASE_TASK_PAIRS)
+        {
+            task.pairCount = NARROWPHASE_TASK_PAIRS;
+        }
+    }
+
+    if (pool.getThreadCount() > 1 && taskCount > 1)
+    {
+        collideBodiesInParallel(data);
+    }
+    else
+    {
+        // Write straight into the collision data, using each task
+        // for its caches.
+        NarrowphaseOutput output;
+        output.collisionPairs = &collisionPairs;
+        output.overlaps = &triggerOverlaps;
+        for (unsigned i = 0; i < taskCount; i++)
+        {
+            NarrowphaseTask &task = *narrowphaseTasks[i];
+            output.task = &task;
+            collidePairs(task.firstPair, task.pairCount, data, output);
+        }
+    }
+
+    for (unsigned i = 0; i < triggerOverlaps.size(); i++)
+    {
+        triggerEvents.addOverlap(
+            triggerOverlaps[i].first, triggerOverlaps[i].second);
+    }
+}
+
+void CollisionPipeline::collidePairs(unsigned firstPair,
+                                     unsigned pairCount,
+                                     CollisionData *data,
+                                     const NarrowphaseOutput &output)
+{
+    // Spheres can only be batched if they all have the same margin.
+    bool batchSpheres = speculativeTime <= 0;
+
+    // Check every primitive of one body against every primitive
+    // of the other. Pairs of spheres are put aside to be checked
+    // together. Once the collision data is full, only the triggers
+    // are still tested.
+    std::vector<unsigned> &batched = output.task->spherePairs;
+    batched.clear();
+    bool full = false;
+    for (unsigned i = firstPair; i < firstPair + pairCount; i++)
+    {
+        const BodyRecord &one = bodies[findBody(potentialContacts[i].body[0])];
+        const BodyRecord &two = bodies[findBody(potentialContacts[i].body[1])];
+        if (speculativeTime > 0)
+        {
+            data->margin = tolerance + one.margin + two.margin;
+        }
+
+        // Skip the pair if the bodies' bounds are apart.
+        if (!one.bounds.overlaps(&two.bounds, data->margin)) continue;
+
+        for (unsigned a = 0; a < one.primitiveCount; a++)
+        {
+            unsigned oneIndex = bodyPrimitives[one.firstPrimitive + a];
+            for (unsigned b = 0; b < two.primitiveCount; b++)
+            {
+                unsigned twoIndex = bodyPrimitives[two.firstPrimitive + b];
+                const CollisionPrimitive *first = primitives[oneIndex].primitive;
+                const CollisionPrimitive *second =
+                    primitives[twoIndex].primitive;
+                if (!first->canCollide(*second)) continue;
+
+                // Skip the pair if its bounds are apart.
+                if (!first->getWorldBounds().overlaps(
+                    &second->getWorldBounds(), data->margin))
+                {
+                    continue;
+                }
+
+                // Triggers don't use up contacts, so they are tested
+                // even once the collision data is full.
+                if (primitives[oneIndex].primitive->trigger ||
+                    primitives[twoIndex].primitive->trigger)
+                {
+                    collideTrigger(primitives[oneIndex], primitives[twoIndex],
+                        output);
+                    continue;
+                }
+
+                // Compounds can hold triggers as children, so they are
+                // still visited when the collision data is full.
+                bool compound =
+                    primitives[oneIndex].type == PRIMITIVE_COMPOUND ||
+                    primitives[twoIndex].type == PRIMITIVE_COMPOUND;
+                if (full && !compound) continue;
+
+                if (batchSpheres &&
+                    primitives[oneIndex].type == PRIMITIVE_SPHERE &&
+                    primitives[twoIndex].type == PRIMITIVE_SPHERE)
+                {
+                    batched.push_back(sphereSlots[oneIndex]);
+                    batched.push_back(sphereSlots[twoIndex]);
+                    continue;
+                }
+
+                if (!full && !data->hasMoreContacts())
+                {
+                    full = true;
+                    if (!compound) continue;
+                }
+                collide(primitives[oneIndex], primitives[twoIndex], data,
+                    output);
+            }
+        }
+    }
+
+    // Check the pairs of spheres, recording the ones that hit.
+    if (!batched.empty())
+    {
+        std::vector<unsigned> &hits = output.task->sphereHits;
+        unsigned sphereCount = (unsigned)batched.size() / 2;
+        unsigned firstContact = data->contactCount;
+        hits.resize(sphereCount);
+        unsigned used = CollisionDetector::sphereAndSphereBatch(
+            sphereBatch, &batched[0], sphereCount, data, &hits[0]
+            );
+
+        for (unsigned i = 0; i < used; i++)
+        {
+            const unsigned *spheres = &batched[hits[i] * 2];
+            CollisionPair pair;
+            pair.primitive[0] =
+                primitives[sphereRegistrations[spheres[0]]].primitive;
+            pair.primitive[1] =
+                primitives[sphereRegistrations[spheres[1]]].primitive;
+            pair.firstContact = firstContact + i;
+            pair.contactCount = 1;
+            output.collisionPairs->push_back(pair);
+        }
+    }
+}
+
+void CollisionPipeline::collideBodiesInParallel(CollisionData *data)
+{
+    // Give each task its own collision data, set up like the one
+    // given.
+    unsigned taskCount =
+        ((unsigned)potentialContacts.size() + NARROWPHASE_TASK_PAIRS - 1) /
+        NARROWPHASE_TASK_PAIRS;
+    for (unsigned i = 0; i < taskCount; i++)
+    {
+        NarrowphaseTask &task = *narrowphaseTasks[i];
+        task.buffer.begin(&task.data);
+        task.data.friction = data->friction;
+        task.data.restitution = data->restitution;
+        task.data.tolerance = data->tolerance;
+        task.data.margin = data->margin;
+        task.collisionPairs.clear();
+        task.overlaps.clear();
+    }
+
+    // Run the tasks on the pool.
+    NarrowphaseJob job;
+    job.pipeline = this;
+    job.taskCount = taskCount;
+    job.nextTask = 0;
+    pool.run(runNarrowphaseTasks, &job, taskCount);
+
+    // Join the tasks in order, for as long as there is room.
+    for (unsigned i = 0; i < taskCount; i++)
+    {
+        NarrowphaseTask &task = *narrowphaseTasks[i];
+        triggerOverlaps.insert(triggerOverlaps.end(),
+            task.overlaps.begin(), task.overlaps.end());
+
+        unsigned count = task.data.contactCount;
+        if (count == 0) continue;
+        if (!data->reserveContacts(count))
+        {
+            count = data->contactsLeft > 0 ? data->contactsLeft : 0;
+        }
+
+        unsigned offset = data->contactCount;
+        for (unsigned j = 0; j < count; j++)
+        {
+            data->contacts[j] = task.data.contactArray[j];
+        }
+        data->addContacts(count);
+
+        for (unsigned j = 0; j < task.collisionPairs.size(); j++)
+        {
+            CollisionPair pair = task.collisionPairs[j];
+            if (pair.firstContact >= count) continue;
+            if (pair.contactCount > count - pair.firstContact)
+            {
+                pair.contactCount = count - pair.firstContact;
+            }
+            pair.firstContact += offset;
+            collisionPairs.push_back(pair);
+        }
+    }
+}
+
+void CollisionPipeline::runNarrowphaseTasks(void *data, unsigned /*worker*/)
+{
+    NarrowphaseJob *job = static_cast<NarrowphaseJob*>(data);
+    CollisionPipeline *pipeline = job->pipeline;
+    for (;;)
+    {
+        unsigned i = job->nextTask++;
+        if (i >= job->taskCount) return;
+
+        NarrowphaseTask &task = *pipeline->narrowphaseTasks[i];
+        NarrowphaseOutput output;
+        output.collisionPairs = &task.collisionPairs;
+        output.overlaps = &task.overlaps;
+        output.task = &task;
+
+        pipeline->collidePairs(
+            task.firstPair, task.pairCount, &task.data, output);
+        task.buffer.finish(&task.data);
+    }
+}
+
+void CollisionPipeline::collideScenery(CollisionData *data)
+{
+    bool batchSpheres = speculativeTime <= 0;
+
+    // Check the primitives against the planes, the spheres all
+    // together and the others one at a time.
+    for (unsigned p = 0; p < planes.size(); p++)
+    {
+        if (!data->hasMoreContacts()) return;
+        if (batchSpheres)
+        {
+            CollisionDetector::sphereAndHalfSpaceBatch(
+                sphereBatch, *planes[p], data
+                );
+        }
+
+        for (unsigned i = 0; i < primitives.size(); i++)
+        {
+            const PrimitiveRegistration &registration = primitives[i];
+            if (batchSpheres && registration.type == PRIMITIVE_SPHERE)
+            {
+                continue;
+            }
+
+            if (!data->hasMoreContacts()) return;
+            if (speculativeTime > 0)
+            {
+                data->margin = tolerance +
+                    bodies[findBody(registration.primitive->body)].margin;
+            }
+            collidePlane(registration, *planes[p], data);
+        }
+    }
+
+    // Check the primitives against the meshes and heightfields.
+    if (meshes.empty() && heightfields.empty()) return;
+    for (unsigned i = 0; i < primitives.size(); i++)
+    {
+        if (!data->hasMoreContacts()) return;
+        if (speculativeTime > 0)
+        {
+            data->margin = tolerance +
+                bodies[findBody(primitives[i].primitive->body)].margin;
+        }
+        collideStatic(primitives[i], data);
+    }
+}
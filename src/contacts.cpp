@@ -13,6 +13,7 @@
 #include <cyclone/contacts.h>
 #include <memory.h>
 #include <assert.h>
+#include <algorithm>
 
 using namespace cyclone;
 
@@ -25,6 +26,8 @@ void Contact::setBodyData(RigidBody* one, RigidBody *two,
     Contact::body[1] = two;
     Contact::friction = friction;
     Contact::restitution = restitution;
+    Contact::feature = 0;
+    Contact::normalImpulse = 0;
 }
 
 void Contact::matchAwakeState()
@@ -149,6 +152,15 @@ void Contact::calculateDesiredDeltaVelocity(real duration)
 {
     const static real velocityLimit = (real)0.25f;
 
+    // A speculative contact has a gap, which the bodies can close
+    // this frame. Only the closing velocity beyond that is removed,
+    // with no bounce, as they haven't touched yet.
+    if (penetration < 0)
+    {
+        desiredDeltaVelocity = penetration / duration - contactVelocity.x;
+        return;
+    }
+
     // Calculate the acceleration induced velocity accumulated this frame
     real velocityFromAcc = 0;
 
@@ -202,6 +214,9 @@ void Contact::calculateInternals(real duration)
 
     // Calculate the desired change in velocity for resolution
     calculateDesiredDeltaVelocity(duration);
+
+    // No impulse has been applied yet.
+    normalImpulse = 0;
 }
 
 void Contact::applyVelocityChange(Vector3 velocityChange[2],
@@ -229,6 +244,9 @@ void Contact::applyVelocityChange(Vector3 velocityChange[2],
         impulseContact = calculateFrictionImpulse(inverseInertiaTensor);
     }
 
+    // Keep track of the impulse along the normal, for contact events.
+    normalImpulse += impulseContact.x;
+
     // Convert impulse to world coordinates
     Vector3 impulse = contactToWorld.transform(impulseContact);
 
@@ -704,3 +722,162 @@ void ContactResolver::adjustPositions(Contact *c,
         positionIterationsUsed++;
     }
 }
+
+// Contact event implementation
+
+bool ContactEventBuffer::ContactKey::operator<(const ContactKey &other) const
+{
+    if (body[0] != other.body[0]) return body[0] < other.body[0];
+    if (body[1] != other.body[1]) return body[1] < other.body[1];
+    return index < other.index;
+}
+
+/**
+ * Orders pair records by their bodies.
+ */
+template <class Record>
+static inline bool pairBefore(const Record &one, const Record &two)
+{
+    if (one.body[0] != two.body[0]) return one.body[0] < two.body[0];
+    return one.body[1] < two.body[1];
+}
+
+ContactEventBuffer::ContactEventBuffer(real impulseThreshold)
+:
+impulseThreshold(impulseThreshold)
+{
+}
+
+void ContactEventBuffer::setImpulseThreshold(real impulseThreshold)
+{
+    ContactEventBuffer::impulseThreshold = impulseThreshold;
+}
+
+void ContactEventBuffer::update(const Contact *contacts, unsigned numContacts)
+{
+    events.clear();
+    lastPairs.swap(pairs);
+    pairs.clear();
+
+    // Group the contacts by their pair of bodies, with the bodies in
+    // address order and the scenery last.
+    keys.resize(numContacts);
+    for (unsigned i = 0; i < numContacts; i++)
+    {
+        RigidBody *one = contacts[i].body[0];
+        RigidBody *two = contacts[i].body[1];
+        if (!one || (two && two < one)) std::swap(one, two);
+        keys[i].body[0] = one;
+        keys[i].body[1] = two;
+        keys[i].index = i;
+    }
+    std::sort(keys.begin(), keys.end());
+
+    // Summarise each pair, generating its event if it was hit hard
+    // enough.
+    order.clear();
+    ContactEvent event;
+    unsigned start = 0;
+    while (start < numContacts)
+    {
+        const ContactKey &key = keys[start];
+        unsigned end = start + 1;
+        while (end < numContacts &&
+            keys[end].body[0] == key.body[0] &&
+            keys[end].body[1] == key.body[1])
+        {
+            end++;
+        }
+
+        PairRecord record;
+        record.body[0] = key.body[0];
+        record.body[1] = key.body[1];
+        record.firstContact = key.index;
+        record.reported = false;
+
+        // Find the total impulse and the contact that took the most.
+        real total = 0;
+        const Contact *strongest = contacts + key.index;
+        for (unsigned k = start; k < end; k++)
+        {
+            const Contact &contact = contacts[keys[k].index];
+            total += contact.normalImpulse;
+            if (contact.normalImpulse > strongest->normalImpulse)
+            {
+                strongest = &contact;
+            }
+        }
+
+        std::vector<PairRecord>::iterator last = std::lower_bound(
+            lastPairs.begin(), lastPairs.end(), record,
+            pairBefore<PairRecord>);
+        bool touching = last != lastPairs.end() &&
+            !pairBefore(record, *last);
+        if (touching) record.reported = last->reported;
+
+        if (total >= impulseThreshold)
+        {
+            event.body[0] = record.body[0];
+            event.body[1] = record.body[1];
+            event.contactPoint = strongest->contactPoint;
+            event.contactNormal = strongest->contactNormal;
+            if (strongest->body[0] != record.body[0])
+            {
+                event.contactNormal.invert();
+            }
+            event.normalImpulse = total;
+            event.state = touching && last->reported ?
+                ContactEvent::CONTACT_PERSIST : ContactEvent::CONTACT_BEGIN;
+            order.push_back(std::make_pair(record.firstContact,
+                (unsigned)events.size()));
+            events.push_back(event);
+            record.reported = true;
+        }
+
+        pairs.push_back(record);
+        start = end;
+    }
+
+    // Put the events in contact order.
+    std::sort(order.begin(), order.end());
+    std::vector<ContactEvent> sorted(order.size());
+    for (unsigned i = 0; i < order.size(); i++)
+    {
+        sorted[i] = events[order[i].second];
+    }
+    events.swap(sorted);
+
+    // Report the pairs that have stopped touching, in the order they
+    // were in last frame.
+    order.clear();
+    for (unsigned i = 0; i < lastPairs.size(); i++)
+    {
+        if (!lastPairs[i].reported) continue;
+        if (std::binary_search(pairs.begin(), pairs.end(), lastPairs[i],
+            pairBefore<PairRecord>))
+        {
+            continue;
+        }
+        order.push_back(std::make_pair(lastPairs[i].firstContact, i));
+    }
+    std::sort(order.begin(), order.end());
+
+    event.contactPoint.clear();
+    event.contactNormal.clear();
+    event.normalImpulse = 0;
+    event.state = ContactEvent::CONTACT_END;
+    for (unsigned i = 0; i < order.size(); i++)
+    {
+        const PairRecord &record = lastPairs[order[i].second];
+        event.body[0] = record.body[0];
+        event.body[1] = record.body[1];
+        events.push_back(event);
+    }
+}
+
+void ContactEventBuffer::clear()
+{
+    pairs.clear();
+    lastPairs.clear();
+    events.clear();
+}
@@ -191,15 +191,16 @@ void MassAggregateApplication::update()
 
 RigidBodyApplication::RigidBodyApplication()
 :
+    contactBuffer(maxContacts),
+    resolver(maxContacts*8),
     theta(0.0f),
     phi(15.0f),
-    resolver(maxContacts*8),
 
     renderDebugInfo(false),
     pauseSimulation(true),
     autoPauseSimulation(false)
 {
-    cData.contactArray = contacts;
+    contactBuffer.begin(&cData);
 }
 
 void RigidBodyApplication::update()
@@ -224,10 +225,16 @@ void RigidBodyApplication::update()
     // Update the objects
     updateObjects(duration);
 
-    // Perform the contact generation
+    // Perform the contact generation, gathering the contacts into
+    // one array.
     generateContacts();
+    contactBuffer.finish(&cData);
 
-    // Resolve detected contacts
+    // Resolve detected contacts, with more iterations if there are
+    // more contacts than we expected.
+    unsigned iterations = cData.contactCount > maxContacts ?
+        cData.contactCount : maxContacts;
+    resolver.setIterations(iterations*8);
     resolver.resolveContacts(
         cData.contactArray,
         cData.contactCount,
@@ -254,22 +261,23 @@ void RigidBodyApplication::drawDebug()
     // Recalculate the contacts, so they are current (in case we're
     // paused, for example).
     generateContacts();
+    contactBuffer.finish(&cData);
 
     // Render the contacts, if required
     glBegin(GL_LINES);
     for (unsigned i = 0; i < cData.contactCount; i++)
     {
         // Interbody contacts are in green, floor contacts are red.
-        if (contacts[i].body[1]) {
+        if (cData.contactArray[i].body[1]) {
             glColor3f(0,1,0);
         } else {
             glColor3f(1,0,0);
         }
 
-        cyclone::Vector3 vec = contacts[i].contactPoint;
+        cyclone::Vector3 vec = cData.contactArray[i].contactPoint;
         glVertex3f(vec.x, vec.y, vec.z);
 
-        vec += contacts[i].contactNormal;
+        vec += cData.contactArray[i].contactNormal;
         glVertex3f(vec.x, vec.y, vec.z);
     }
 
@@ -179,11 +179,14 @@ public:
  class RigidBodyApplication : public Application
  {
  protected:
-    /** Holds the maximum number of contacts. */
+    /**
+     * Holds the number of contacts there is room for at the start.
+     * The contact buffer grows if more are needed.
+     */
     const static unsigned maxContacts = 256;
 
-    /** Holds the array of contacts. */
-    cyclone::Contact contacts[maxContacts];
+    /** Holds the storage for the contacts. */
+    cyclone::ContactBuffer contactBuffer;
 
     /** Holds the collision data structure for collision detection. */
     cyclone::CollisionData cData;
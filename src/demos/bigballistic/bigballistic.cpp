@@ -35,6 +35,11 @@ public:
     AmmoRound()
     {
         body = new cyclone::RigidBody;
+
+        // Shots go in their own category, and don't collide with
+        // each other.
+        category = 2;
+        mask = ~category;
     }
 
     ~AmmoRound()
@@ -195,6 +200,18 @@ class BigBallisticDemo : public RigidBodyApplication
     /** Holds the box data. */
     Box boxData[boxes];
 
+    /** Holds the ground plane. */
+    cyclone::CollisionPlane plane;
+
+    /** Holds the collision pipeline that finds the contacts. */
+    cyclone::CollisionPipeline collisions;
+
+    /**
+     * Holds the continuous collision stage, which stops fast shots
+     * passing through the boxes between frames.
+     */
+    cyclone::ContinuousCollision sweeps;
+
     /** Holds the current shot type. */
     ShotType currentShotType;
 
@@ -210,6 +227,12 @@ class BigBallisticDemo : public RigidBodyApplication
     /** Dispatches a round. */
     void fire();
 
+    /** Returns the shot for the given primitive, or NULL if it is a box. */
+    AmmoRound *findShot(const cyclone::CollisionPrimitive *primitive);
+
+    /** Retires the given shot, so it can be fired again. */
+    void removeShot(AmmoRound *shot);
+
 public:
     /** Creates a new demo object. */
     BigBallisticDemo();
@@ -234,8 +257,13 @@ public:
 BigBallisticDemo::BigBallisticDemo()
 :
 RigidBodyApplication(),
+sweeps(&collisions),
 currentShotType(LASER)
 {
+    // Create the ground plane data
+    plane.direction = cyclone::Vector3(0,1,0);
+    plane.offset = 0;
+
     pauseSimulation = false;
     reset();
 }
@@ -261,12 +289,15 @@ void BigBallisticDemo::reset()
     {
         shot->type = UNUSED;
     }
+    collisions.clear();
+    sweeps.clear();
 
     // Initialise the box
     cyclone::real z = 20.0f;
     for (Box *box = boxData; box < boxData+boxes; box++)
     {
         box->setState(z);
+        collisions.addBox(box);
         z += 90.0f;
     }
 }
@@ -290,28 +321,59 @@ void BigBallisticDemo::fire()
 
     // Set the shot
     shot->setState(currentShotType);
+    collisions.addSphere(shot);
+    sweeps.addSphere(shot);
+}
+
+AmmoRound *BigBallisticDemo::findShot(
+    const cyclone::CollisionPrimitive *primitive)
+{
+    for (AmmoRound *shot = ammo; shot < ammo+ammoRounds; shot++)
+    {
+        if (shot == primitive) return shot;
+    }
+    return NULL;
+}
 
+void BigBallisticDemo::removeShot(AmmoRound *shot)
+{
+    // We simply set the shot type to be unused, so the
+    // memory it occupies can be reused by another shot.
+    shot->type = UNUSED;
+    collisions.remove(shot);
+    sweeps.removeSphere(shot);
 }
 
 void BigBallisticDemo::updateObjects(cyclone::real duration)
 {
-    // Update the physics of each particle in turn
+    // Run the physics for all the shots, stopping fast ones where
+    // they hit something on the way.
+    sweeps.integrate(duration);
+
+    // A shot stopped by a sweep bounces off before it touches the
+    // box, so it has to be retired here rather than by its contacts.
+    const std::vector<cyclone::ContinuousCollision::Impact> &impacts =
+        sweeps.getImpacts();
+    for (unsigned i = 0; i < impacts.size(); i++)
+    {
+        AmmoRound *shot = findShot(impacts[i].sphere);
+        const cyclone::CollisionPrimitive *hit = impacts[i].result.primitive;
+        if (shot && shot->type != UNUSED && hit && !findShot(hit))
+        {
+            removeShot(shot);
+        }
+    }
+
     for (AmmoRound *shot = ammo; shot < ammo+ammoRounds; shot++)
     {
         if (shot->type != UNUSED)
         {
-            // Run the physics
-            shot->body->integrate(duration);
-            shot->calculateInternals();
-
             // Check if the particle is now invalid
             if (shot->body->getPosition().y < 0.0f ||
                 shot->startTime+5000 < TimingData::get().lastFrameTimestamp ||
                 shot->body->getPosition().z > 200.0f)
             {
-                // We simply set the shot type to be unused, so the
-                // memory it occupies can be reused by another shot.
-                shot->type = UNUSED;
+                removeShot(shot);
             }
         }
     }
@@ -397,13 +459,8 @@ void BigBallisticDemo::display()
 
 void BigBallisticDemo::generateContacts()
 {
-    // Create the ground plane data
-    cyclone::CollisionPlane plane;
-    plane.direction = cyclone::Vector3(0,1,0);
-    plane.offset = 0;
-
     // Set up the collision data structure
-    cData.reset(maxContacts);
+    contactBuffer.begin(&cData);
     cData.friction = (cyclone::real)0.9;
     cData.restitution = (cyclone::real)0.1;
     cData.tolerance = (cyclone::real)0.1;
@@ -413,25 +470,21 @@ void BigBallisticDemo::generateContacts()
     {
         if (!cData.hasMoreContacts()) return;
         cyclone::CollisionDetector::boxAndHalfSpace(*box, plane, &cData);
+    }
 
+    // Check for collisions between the boxes and shots
+    collisions.generateContacts(&cData);
 
-        // Check for collisions with each shot
-        for (AmmoRound *shot = ammo; shot < ammo+ammoRounds; shot++)
-        {
-            if (shot->type != UNUSED)
-            {
-                if (!cData.hasMoreContacts()) return;
-
-                // When we get a collision, remove the shot
-                if (cyclone::CollisionDetector::boxAndSphere(*box, *shot, &cData))
-                {
-                    shot->type = UNUSED;
-                }
-            }
-        }
+    // When a shot hits a box, remove the shot
+    const std::vector<cyclone::CollisionPair> &pairs =
+        collisions.getCollisionPairs();
+    for (unsigned i = 0; i < pairs.size(); i++)
+    {
+        AmmoRound *one = findShot(pairs[i].primitive[0]);
+        AmmoRound *two = findShot(pairs[i].primitive[1]);
+        if (one && !two) removeShot(one);
+        else if (two && !one) removeShot(two);
     }
-
-    // NB We aren't checking box-box collisions.
 }
 
 void BigBallisticDemo::mouse(int button, int state, int x, int y)
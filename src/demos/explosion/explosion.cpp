@@ -235,6 +235,14 @@ class ExplosionDemo : public RigidBodyApplication
     /** Holds the ball data. */
     Ball ballData[balls];
 
+    /** Holds the ground plane. */
+    cyclone::CollisionPlane plane;
+
+    /** Holds the collision pipeline that finds the contacts. */
+    cyclone::CollisionPipeline collisions;
+
+    /** Returns the box for the given primitive, or NULL if it is a ball. */
+    Box *findBox(const cyclone::CollisionPrimitive *primitive);
 
     /** Detonates the explosion. */
     void fire();
@@ -275,6 +283,21 @@ ExplosionDemo::ExplosionDemo()
     editMode(false),
     upMode(false)
 {
+    // Create the ground plane data
+    plane.direction = cyclone::Vector3(0,1,0);
+    plane.offset = 0;
+
+    // Register everything with the collision pipeline
+    for (Box *box = boxData; box < boxData+boxes; box++)
+    {
+        collisions.addBox(box);
+    }
+    for (Ball *ball = ballData; ball < ballData+balls; ball++)
+    {
+        collisions.addSphere(ball);
+    }
+    collisions.addPlane(&plane);
+
     // Reset the position of the boxes
     reset();
 }
@@ -325,63 +348,36 @@ void ExplosionDemo::reset()
     cData.contactCount = 0;
 }
 
-void ExplosionDemo::generateContacts()
+Box *ExplosionDemo::findBox(const cyclone::CollisionPrimitive *primitive)
 {
-    // Note that this method makes a lot of use of early returns to avoid
-    // processing lots of potential contacts that it hasn't got room to
-    // store.
-
-    // Create the ground plane data
-    cyclone::CollisionPlane plane;
-    plane.direction = cyclone::Vector3(0,1,0);
-    plane.offset = 0;
+    for (Box *box = boxData; box < boxData+boxes; box++)
+    {
+        if (box == primitive) return box;
+    }
+    return NULL;
+}
 
+void ExplosionDemo::generateContacts()
+{
     // Set up the collision data structure
-    cData.reset(maxContacts);
+    contactBuffer.begin(&cData);
     cData.friction = (cyclone::real)0.9;
     cData.restitution = (cyclone::real)0.6;
     cData.tolerance = (cyclone::real)0.1;
 
-    // Perform exhaustive collision detection
-    cyclone::Matrix4 transform, otherTransform;
-    cyclone::Vector3 position, otherPosition;
-    for (Box *box = boxData; box < boxData+boxes; box++)
-    {
-        // Check for collisions with the ground plane
-        if (!cData.hasMoreContacts()) return;
-        cyclone::CollisionDetector::boxAndHalfSpace(*box, plane, &cData);
+    // Perform collision detection
+    collisions.generateContacts(&cData);
 
-        // Check for collisions with each other box
-        for (Box *other = box+1; other < boxData+boxes; other++)
-        {
-            if (!cData.hasMoreContacts()) return;
-            cyclone::CollisionDetector::boxAndBox(*box, *other, &cData);
-
-            if (cyclone::IntersectionTests::boxAndBox(*box, *other))
-            {
-                box->isOverlapping = other->isOverlapping = true;
-            }
-        }
-
-        // Check for collisions with each ball
-        for (Ball *other = ballData; other < ballData+balls; other++)
-        {
-            if (!cData.hasMoreContacts()) return;
-            cyclone::CollisionDetector::boxAndSphere(*box, *other, &cData);
-        }
-    }
-
-    for (Ball *ball = ballData; ball < ballData+balls; ball++)
+    // Flag the boxes that are touching each other
+    const std::vector<cyclone::CollisionPair> &pairs =
+        collisions.getCollisionPairs();
+    for (unsigned i = 0; i < pairs.size(); i++)
     {
-        // Check for collisions with the ground plane
-        if (!cData.hasMoreContacts()) return;
-        cyclone::CollisionDetector::sphereAndHalfSpace(*ball, plane, &cData);
-
-        for (Ball *other = ball+1; other < ballData+balls; other++)
+        Box *box = findBox(pairs[i].primitive[0]);
+        Box *other = findBox(pairs[i].primitive[1]);
+        if (box && other)
         {
-            // Check for collisions with the ground plane
-            if (!cData.hasMoreContacts()) return;
-            cyclone::CollisionDetector::sphereAndSphere(*ball, *other, &cData);
+            box->isOverlapping = other->isOverlapping = true;
         }
     }
 }
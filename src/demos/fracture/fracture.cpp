@@ -126,10 +126,10 @@ public:
      * original block is always deleted, this effectively reuses its storage.
      * The algorithm is structured to allow this reuse.
      */
-    void divideBlock(const cyclone::Contact& contact,
+    void divideBlock(const cyclone::ContactEvent& contact,
         Block* target, Block* blocks)
     {
-        // Find out if we're block one or two in the contact structure, and
+        // Find out if we're body one or two in the event, and
         // therefore what the contact normal is.
         cyclone::Vector3 normal = contact.contactNormal;
         cyclone::RigidBody *body = contact.body[0];
@@ -223,6 +223,7 @@ public:
             blocks[i].body->clearAccumulators();
             blocks[i].body->calculateDerivedData();
             blocks[i].offset = cyclone::Matrix4();
+            blocks[i].invalidateTransform();
             blocks[i].exists = true;
             blocks[i].halfSize = halfSize;
 
@@ -237,10 +238,7 @@ public:
  */
 class FractureDemo : public RigidBodyApplication
 {
-    /** Tracks if a block has been hit. */
-    bool hit;
     bool ball_active;
-    unsigned fracture_contact;
 
     /** Handle random numbers. */
     cyclone::Random random;
@@ -251,6 +249,15 @@ class FractureDemo : public RigidBodyApplication
     /** Holds the projectile. */
     cyclone::CollisionSphere ball;
 
+    /** Holds the ground plane. */
+    cyclone::CollisionPlane plane;
+
+    /** Holds the collision pipeline that finds the contacts. */
+    cyclone::CollisionPipeline collisions;
+
+    /** Reports the impacts after the contacts are resolved. */
+    cyclone::ContactEventBuffer impacts;
+
     /** Processes the contact generation code. */
     virtual void generateContacts();
 
@@ -277,7 +284,8 @@ public:
 // Method definitions
 FractureDemo::FractureDemo()
     :
-    RigidBodyApplication()
+    RigidBodyApplication(),
+    impacts(10.0f)
 {
     // Create the ball.
     ball.body = new cyclone::RigidBody();
@@ -292,6 +300,10 @@ FractureDemo::FractureDemo()
     ball.body->setCanSleep(false);
     ball.body->setAwake(true);
 
+    // Create the ground plane data
+    plane.direction = cyclone::Vector3(0,1,0);
+    plane.offset = 0;
+
     // Set up the initial block
     reset();
 }
@@ -303,57 +315,14 @@ const char* FractureDemo::getTitle()
 
 void FractureDemo::generateContacts()
 {
-    hit = false;
-
-    // Create the ground plane data
-    cyclone::CollisionPlane plane;
-    plane.direction = cyclone::Vector3(0,1,0);
-    plane.offset = 0;
-
     // Set up the collision data structure
-    cData.reset(maxContacts);
+    contactBuffer.begin(&cData);
     cData.friction = (cyclone::real)0.9;
     cData.restitution = (cyclone::real)0.2;
     cData.tolerance = (cyclone::real)0.1;
 
     // Perform collision detection
-    cyclone::Matrix4 transform, otherTransform;
-    cyclone::Vector3 position, otherPosition;
-    for (Block *block = blocks; block < blocks+MAX_BLOCKS; block++)
-    {
-        if (!block->exists) continue;
-
-        // Check for collisions with the ground plane
-        if (!cData.hasMoreContacts()) return;
-        cyclone::CollisionDetector::boxAndHalfSpace(*block, plane, &cData);
-
-        if (ball_active)
-        {
-            // And with the sphere
-            if (!cData.hasMoreContacts()) return;
-            if (cyclone::CollisionDetector::boxAndSphere(*block, ball, &cData))
-            {
-                hit = true;
-                fracture_contact = cData.contactCount-1;
-            }
-        }
-
-        // Check for collisions with each other box
-        for (Block *other = block+1; other < blocks+MAX_BLOCKS; other++)
-        {
-            if (!other->exists) continue;
-
-            if (!cData.hasMoreContacts()) return;
-            cyclone::CollisionDetector::boxAndBox(*block, *other, &cData);
-        }
-    }
-
-    // Check for sphere ground collisions
-    if (ball_active)
-    {
-        if (!cData.hasMoreContacts()) return;
-        cyclone::CollisionDetector::sphereAndHalfSpace(ball, plane, &cData);
-    }
+    collisions.generateContacts(&cData);
 }
 
 void FractureDemo::reset()
@@ -399,25 +368,47 @@ void FractureDemo::reset()
     ball.body->setAwake(true);
     ball.calculateInternals();
 
-    hit = false;
+    // Register what exists now; fractures update this as they happen.
+    collisions.clear();
+    collisions.addBox(blocks);
+    collisions.addSphere(&ball);
+    collisions.addPlane(&plane);
 
     // Reset the contacts
     cData.contactCount = 0;
+    impacts.clear();
 }
 
 void FractureDemo::update()
 {
     RigidBodyApplication::update();
+    if (!ball_active) return;
 
-    // Handle fractures.
-    if (hit)
+    // Handle fractures, when the ball first hits the block hard enough.
+    impacts.update(cData.contactArray, cData.contactCount);
+    const std::vector<cyclone::ContactEvent> &events = impacts.getEvents();
+    for (unsigned i = 0; i < events.size(); i++)
     {
-        blocks[0].divideBlock(
-            cData.contactArray[fracture_contact],
-            blocks,
-            blocks+1
-            );
+        const cyclone::ContactEvent &event = events[i];
+        if (event.state != cyclone::ContactEvent::CONTACT_BEGIN) continue;
+        if (event.body[0] != ball.body && event.body[1] != ball.body) continue;
+        if (!blocks[0].exists) continue;
+        if (event.body[0] != blocks[0].body && event.body[1] != blocks[0].body)
+        {
+            continue;
+        }
+
+        blocks[0].divideBlock(event, blocks, blocks+1);
         ball_active = false;
+
+        // Swap the block for its pieces, and retire the ball.
+        collisions.remove(blocks);
+        collisions.remove(&ball);
+        for (Block *block = blocks+1; block < blocks+MAX_BLOCKS; block++)
+        {
+            collisions.addBox(block);
+        }
+        break;
     }
 }
 
@@ -23,9 +23,16 @@
 class Bone : public cyclone::CollisionBox
 {
 public:
+    /**
+     * We use a sphere to collide bone on bone to allow some limited
+     * interpenetration.
+     */
+    cyclone::CollisionSphere sphere;
+
     Bone()
     {
         body = new cyclone::RigidBody();
+        sphere.body = body;
     }
 
     ~Bone()
@@ -33,22 +40,6 @@ public:
         delete body;
     }
 
-    /**
-     * We use a sphere to collide bone on bone to allow some limited
-     * interpenetration.
-     */
-    cyclone::CollisionSphere getCollisionSphere() const
-    {
-        cyclone::CollisionSphere sphere;
-        sphere.body = body;
-        sphere.radius = halfSize.x;
-        sphere.offset = cyclone::Matrix4();
-        if (halfSize.y < sphere.radius) sphere.radius = halfSize.y;
-        if (halfSize.z < sphere.radius) sphere.radius = halfSize.z;
-        sphere.calculateInternals();
-        return sphere;
-    }
-
     /** Draws the bone. */
     void render()
     {
@@ -76,6 +67,10 @@ public:
         body->setRotation(cyclone::Vector3());
         halfSize = extents;
 
+        sphere.radius = halfSize.x;
+        if (halfSize.y < sphere.radius) sphere.radius = halfSize.y;
+        if (halfSize.z < sphere.radius) sphere.radius = halfSize.z;
+
         cyclone::real mass = halfSize.x * halfSize.y * halfSize.z * 8.0f;
         body->setMass(mass);
 
@@ -93,6 +88,7 @@ public:
 
         body->calculateDerivedData();
         calculateInternals();
+        sphere.calculateInternals();
     }
 
 };
@@ -110,6 +106,9 @@ class RagdollDemo : public RigidBodyApplication
     /** Holds the joints. */
     cyclone::Joint joints[NUM_JOINTS];
 
+    /** Holds the collision pipeline for bone on bone contacts. */
+    cyclone::CollisionPipeline collisions;
+
     /** Processes the contact generation code. */
     virtual void generateContacts();
 
@@ -215,6 +214,17 @@ RagdollDemo::RagdollDemo()
         0.15f
         );
 
+    // The bones collide with each other using their spheres, except
+    // where they are joined, as the joint keeps them together.
+    for (Bone *bone = bones; bone < bones+NUM_BONES; bone++)
+    {
+        collisions.addSphere(&bone->sphere);
+    }
+    for (cyclone::Joint *joint = joints; joint < joints+NUM_JOINTS; joint++)
+    {
+        collisions.ignorePair(joint->body[0], joint->body[1]);
+    }
+
     // Set up the initial positions
     reset();
 }
@@ -232,7 +242,7 @@ void RagdollDemo::generateContacts()
     plane.offset = 0;
 
     // Set up the collision data structure
-    cData.reset(maxContacts);
+    contactBuffer.begin(&cData);
     cData.friction = (cyclone::real)0.9;
     cData.restitution = (cyclone::real)0.6;
     cData.tolerance = (cyclone::real)0.1;
@@ -245,24 +255,12 @@ void RagdollDemo::generateContacts()
         // Check for collisions with the ground plane
         if (!cData.hasMoreContacts()) return;
         cyclone::CollisionDetector::boxAndHalfSpace(*bone, plane, &cData);
-
-        cyclone::CollisionSphere boneSphere = bone->getCollisionSphere();
-
-        // Check for collisions with each other box
-        for (Bone *other = bone+1; other < bones+NUM_BONES; other++)
-        {
-            if (!cData.hasMoreContacts()) return;
-
-            cyclone::CollisionSphere otherSphere = other->getCollisionSphere();
-
-            cyclone::CollisionDetector::sphereAndSphere(
-                boneSphere,
-                otherSphere,
-                &cData
-                );
-        }
     }
 
+    // Check for collisions between the bones
+    if (!cData.hasMoreContacts()) return;
+    collisions.generateContacts(&cData);
+
     // Check for joint violation
     for (cyclone::Joint *joint = joints; joint < joints+NUM_JOINTS; joint++)
     {
@@ -333,6 +331,7 @@ void RagdollDemo::updateObjects(cyclone::real duration)
     {
         bone->body->integrate(duration);
         bone->calculateInternals();
+        bone->sphere.calculateInternals();
     }
 }
 
@@ -461,7 +461,7 @@ void BigBallisticDemo::generateContacts()
     plane.offset = 0;
 
     // Set up the collision data structure
-    cData.reset(maxContacts);
+    contactBuffer.begin(&cData);
     cData.friction = (cyclone::real)0.9;
     cData.restitution = (cyclone::real)0.1;
     cData.tolerance = (cyclone::real)0.1;
@@ -194,7 +194,139 @@ void AeroControl::updateForce(RigidBody *body, real duration)
     Aero::updateForceFromTensor(body, duration, tensor);
 }
 
+Explosion::Explosion()
+:
+timePassed(0),
+detonation(0, 0, 0),
+implosionMaxRadius(10),
+implosionMinRadius(2),
+implosionDuration((real)0.1),
+implosionForce(200),
+shockwaveSpeed(50),
+shockwaveThickness(4),
+peakConcussionForce(1000),
+concussionDuration((real)0.5),
+peakConvectionForce(50),
+chimneyRadius(5),
+chimneyHeight(20),
+convectionDuration(5)
+{
+}
+
+Vector3 Explosion::getForce(const Vector3 &position,
+                            const Vector3 &velocity) const
+{
+    Vector3 force;
+    Vector3 offset = position - detonation;
+    real distance = offset.magnitude();
+    Vector3 direction;
+    if (distance > 0) direction = offset * (((real)1.0) / distance);
+
+    // The implosion pulls in objects in a ring around the detonation.
+    if (timePassed < implosionDuration &&
+        distance > implosionMinRadius && distance < implosionMaxRadius)
+    {
+        force -= direction * implosionForce;
+    }
+
+    // The concussion pushes out objects near the shock wave front,
+    // tailing off over the thickness of the wave and over its
+    // lifetime.
+    if (timePassed < concussionDuration)
+    {
+        real front = shockwaveSpeed * timePassed;
+        real halfThickness = shockwaveThickness * ((real)0.5);
+        real fromFront = real_abs(distance - front);
+        if (fromFront < halfThickness)
+        {
+            real scale = (1 - fromFront / halfThickness) *
+                (1 - timePassed / concussionDuration);
+
+            // Objects already moving outwards feel less force, and
+            // objects moving in feel more.
+            if (shockwaveSpeed > 0)
+            {
+                scale *= 1 - (velocity * direction) / shockwaveSpeed;
+                if (scale < 0) scale = 0;
+            }
+            force += direction * (peakConcussionForce * scale);
+        }
+    }
+
+    // The convection chimney lifts objects above the detonation,
+    // strongest in the middle.
+    if (timePassed < convectionDuration &&
+        offset.y >= 0 && offset.y < chimneyHeight)
+    {
+        real radial = real_sqrt(offset.x*offset.x + offset.z*offset.z);
+        if (radial < chimneyRadius)
+        {
+            real scale = (1 - radial / chimneyRadius) *
+                (1 - timePassed / convectionDuration);
+            force.y += peakConvectionForce * scale;
+        }
+    }
+
+    return force;
+}
+
 void Explosion::updateForce(RigidBody* body, real duration)
 {
+    if (!body->hasFiniteMass()) return;
+
+    body->addForce(getForce(body->getPosition(), body->getVelocity()));
+}
+
+void Explosion::updateForce(Particle* particle, real duration)
+{
+    if (!particle->hasFiniteMass()) return;
+
+    particle->addForce(
+        getForce(particle->getPosition(), particle->getVelocity())
+        );
+}
+
+void Explosion::advance(real duration)
+{
+    timePassed += duration;
+}
+
+BoundingSphere Explosion::getAffectedRegion() const
+{
+    real radius = 0;
+
+    if (timePassed < implosionDuration)
+    {
+        radius = implosionMaxRadius;
+    }
+    if (timePassed < concussionDuration)
+    {
+        real reach = shockwaveSpeed * timePassed +
+            shockwaveThickness * ((real)0.5);
+        if (reach > radius) radius = reach;
+    }
+    if (timePassed < convectionDuration)
+    {
+        real reach = real_sqrt(chimneyRadius*chimneyRadius +
+            chimneyHeight*chimneyHeight);
+        if (reach > radius) radius = reach;
+    }
+
+    return BoundingSphere(detonation, radius);
+}
+
+void Explosion::applyToBodies(const BVHNode<BoundingSphere> *hierarchy,
+                              real duration)
+{
+    if (!hierarchy) return;
+
+    BoundingSphere region = getAffectedRegion();
+    if (region.radius <= 0) return;
 
+    std::vector<RigidBody*> bodies;
+    hierarchy->getBodiesInRegion(region, bodies);
+    for (unsigned i = 0; i < bodies.size(); i++)
+    {
+        updateForce(bodies[i], duration);
+    }
 }
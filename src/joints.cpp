@@ -36,6 +36,7 @@ unsigned Joint::addContact(Contact *contact, unsigned limit) const
         contact->penetration = length-error;
         contact->friction = 1.0f;
         contact->restitution = 0;
+        contact->normalImpulse = 0;
         return 1;
     }
 
@@ -11,6 +11,7 @@
  */
 
 #include <cstddef>
+#include <assert.h>
 #include <cyclone/pworld.h>
 
 using namespace cyclone;
@@ -136,4 +137,143 @@ unsigned GroundContacts::addContact(cyclone::ParticleContact *contact,
         if (count >= limit) return count;
     }
     return count;
+}
+
+void ParticleGridContacts::init(cyclone::ParticleWorld::Particles *particles,
+                                real radius, real restitution)
+{
+    ParticleGridContacts::particles = particles;
+    ParticleGridContacts::radius = radius;
+    ParticleGridContacts::restitution = restitution;
+
+    // Particles with no radius never touch, but the grid still needs
+    // cells with some size to hash them into.
+    assert(radius >= 0);
+    cellSize = radius > 0 ? radius * 2 : 1;
+}
+
+unsigned ParticleGridContacts::hashCell(int x, int y, int z,
+                                        unsigned buckets) const
+{
+    // The bucket count is always a power of two, so we can mask
+    // rather than taking the remainder.
+    unsigned hash = ((unsigned)x * 73856093u) ^
+        ((unsigned)y * 19349663u) ^
+        ((unsigned)z * 83492791u);
+    return hash & (buckets - 1);
+}
+
+void ParticleGridContacts::buildGrid() const
+{
+    unsigned count = (unsigned)particles->size();
+
+    // Use around twice as many buckets as particles, to keep
+    // collisions between unrelated cells rare.
+    unsigned buckets = 1;
+    while (buckets < count * 2) buckets <<= 1;
+
+    particleBucket.resize(count);
+    bucketEntries.resize(count);
+    bucketStart.assign(buckets + 1, 0);
+
+    // Find which bucket each particle is in, counting as we go.
+    real inverseCellSize = ((real)1.0) / cellSize;
+    for (unsigned i = 0; i < count; i++)
+    {
+        Vector3 position = (*particles)[i]->getPosition();
+        unsigned bucket = hashCell(
+            (int)real_floor(position.x * inverseCellSize),
+            (int)real_floor(position.y * inverseCellSize),
+            (int)real_floor(position.z * inverseCellSize),
+            buckets);
+        particleBucket[i] = bucket;
+        bucketStart[bucket]++;
+    }
+
+    // Turn the counts into the end of each bucket's range.
+    for (unsigned b = 1; b <= buckets; b++)
+    {
+        bucketStart[b] += bucketStart[b-1];
+    }
+
+    // Scatter the particles into place. Walking backwards moves each
+    // end marker down to the start of its bucket, and keeps the
+    // particles in each bucket in their original order.
+    for (unsigned i = count; i > 0; i--)
+    {
+        bucketEntries[--bucketStart[particleBucket[i-1]]] = i-1;
+    }
+}
+
+unsigned ParticleGridContacts::addContact(cyclone::ParticleContact *contact,
+                                          unsigned limit) const
+{
+    if (limit == 0) return 0;
+
+    buildGrid();
+
+    unsigned count = (unsigned)particles->size();
+    unsigned buckets = (unsigned)bucketStart.size() - 1;
+    real inverseCellSize = ((real)1.0) / cellSize;
+    real diameter = radius * 2;
+
+    unsigned used = 0;
+    for (unsigned i = 0; i < count; i++)
+    {
+        Particle *particle = (*particles)[i];
+        Vector3 position = particle->getPosition();
+        int cx = (int)real_floor(position.x * inverseCellSize);
+        int cy = (int)real_floor(position.y * inverseCellSize);
+        int cz = (int)real_floor(position.z * inverseCellSize);
+
+        // Neighbouring cells may hash to the same bucket, so we keep
+        // track of which we've already checked.
+        unsigned visited[27];
+        unsigned visitedCount = 0;
+
+        for (int dx = -1; dx <= 1; dx++)
+        for (int dy = -1; dy <= 1; dy++)
+        for (int dz = -1; dz <= 1; dz++)
+        {
+            unsigned bucket = hashCell(cx+dx, cy+dy, cz+dz, buckets);
+
+            bool seen = false;
+            for (unsigned v = 0; v < visitedCount; v++)
+            {
+                if (visited[v] == bucket) { seen = true; break; }
+            }
+            if (seen) continue;
+            visited[visitedCount++] = bucket;
+
+            for (unsigned e = bucketStart[bucket];
+                e < bucketStart[bucket+1];
+                e++)
+            {
+                // Only report each pair once, from its lower index.
+                unsigned j = bucketEntries[e];
+                if (j <= i) continue;
+
+                Particle *other = (*particles)[j];
+                Vector3 midline = position - other->getPosition();
+                real distanceSquared = midline.squareMagnitude();
+                if (distanceSquared >= diameter*diameter ||
+                    distanceSquared <= 0)
+                {
+                    continue;
+                }
+
+                real distance = real_sqrt(distanceSquared);
+                contact->contactNormal = midline * (((real)1.0)/distance);
+                contact->particle[0] = particle;
+                contact->particle[1] = other;
+                contact->penetration = diameter - distance;
+                contact->restitution = restitution;
+                contact++;
+                used++;
+
+                if (used >= limit) return used;
+            }
+        }
+    }
+    return used;
 }
\ No newline at end of file
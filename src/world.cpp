@@ -15,20 +15,21 @@
 
 using namespace cyclone;
 
-World::World(unsigned maxContacts, unsigned iterations)
+World::World(unsigned maxContacts, unsigned iterations,
+             unsigned contactLimit)
 :
 firstBody(NULL),
 resolver(iterations),
 firstContactGen(NULL),
-maxContacts(maxContacts)
+contactBuffer(maxContacts, maxContacts, contactLimit),
+truncatedFrames(0)
 {
-    contacts = new Contact[maxContacts];
+    contactBuffer.begin(&contactData);
     calculateIterations = (iterations == 0);
 }
 
 World::~World()
 {
-    delete[] contacts;
 }
 
 void World::startFrame()
@@ -47,25 +48,41 @@ void World::startFrame()
 
 unsigned World::generateContacts()
 {
-    unsigned limit = maxContacts;
-    Contact *nextContact = contacts;
+    contactBuffer.begin(&contactData);
 
     ContactGenRegistration * reg = firstContactGen;
+    bool truncated = false;
     while (reg)
     {
-        unsigned used = reg->gen->addContact(nextContact, limit);
-        limit -= used;
-        nextContact += used;
-
-        // We've run out of contacts to fill. This means we're missing
-        // contacts.
-        if (limit <= 0) break;
-
+        unsigned limit = contactData.contactsLeft;
+        unsigned used = 0;
+        if (limit > 0)
+        {
+            used = reg->gen->addContact(contactData.contacts, limit);
+        }
+
+        // If the generator filled all the room it had, it may have
+        // had more to give, so get a bigger chunk and ask it again
+        // until it fits. finish keeps the room this frame needed for
+        // the next, so this only happens while the scene grows.
+        if (used >= limit)
+        {
+            if (contactBuffer.grow(&contactData, limit*2)) continue;
+
+            // The buffer is at its limit, so whatever didn't fit is
+            // lost this frame.
+            truncated = true;
+        }
+
+        contactData.addContacts(used);
         reg = reg->next;
     }
+    if (truncated) truncatedFrames++;
 
-    // Return the number of contacts used.
-    return maxContacts - limit;
+    // Join the contacts into one array for the resolver, and return
+    // the number of contacts used.
+    contactBuffer.finish(&contactData);
+    return contactData.contactCount;
 }
 
 void World::runPhysics(real duration)
@@ -89,5 +106,5 @@ void World::runPhysics(real duration)
 
     // And process them
     if (calculateIterations) resolver.setIterations(usedContacts * 4);
-    resolver.resolveContacts(contacts, usedContacts, duration);
+    resolver.resolveContacts(contactData.contactArray, usedContacts, duration);
 }